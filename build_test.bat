@@ -10,7 +10,8 @@ REM Try MSVC (Visual Studio) compiler first
 where cl.exe >nul 2>&1
 if %ERRORLEVEL% == 0 (
     echo Using MSVC compiler...
-    cl.exe /W4 /O2 /I./src /Fe:test_standalone.exe test_main.c src/rpn_vm.c
+    cl.exe /W4 /O2 /I./src /Fe:presetgen.exe presetgen_main.c src/rpn_vm.c src/rpn_ir.c src/rpn_opt.c src/preset_factory.c && presetgen.exe preset_native_gen.c
+    cl.exe /W4 /O2 /I./src /Fe:test_standalone.exe test_main.c src/rpn_vm.c src/rpn_ir.c src/rpn_opt.c src/rpn_batch.c src/rpn_jit.c src/preset_factory.c src/preset_native.c preset_native_gen.c
     if %ERRORLEVEL% == 0 (
         echo.
         echo Build successful! Run with: test_standalone.exe
@@ -22,7 +23,8 @@ REM Try GCC (MinGW/MSYS2/Cygwin)
 where gcc.exe >nul 2>&1
 if %ERRORLEVEL% == 0 (
     echo Using GCC compiler...
-    gcc -Wall -Wextra -O2 -I./src -o test_standalone.exe test_main.c src/rpn_vm.c
+    gcc -O2 -I./src -o presetgen.exe presetgen_main.c src/rpn_vm.c src/rpn_ir.c src/rpn_opt.c src/preset_factory.c && presetgen.exe preset_native_gen.c
+    gcc -Wall -Wextra -O2 -pthread -I./src -o test_standalone.exe test_main.c src/rpn_vm.c src/rpn_ir.c src/rpn_opt.c src/rpn_batch.c src/rpn_jit.c src/preset_factory.c src/preset_native.c preset_native_gen.c -lm
     if %ERRORLEVEL% == 0 (
         echo.
         echo Build successful! Run with: test_standalone.exe
@@ -34,7 +36,8 @@ REM Try Clang
 where clang.exe >nul 2>&1
 if %ERRORLEVEL% == 0 (
     echo Using Clang compiler...
-    clang -Wall -Wextra -O2 -I./src -o test_standalone.exe test_main.c src/rpn_vm.c
+    clang -O2 -I./src -o presetgen.exe presetgen_main.c src/rpn_vm.c src/rpn_ir.c src/rpn_opt.c src/preset_factory.c && presetgen.exe preset_native_gen.c
+    clang -Wall -Wextra -O2 -pthread -I./src -o test_standalone.exe test_main.c src/rpn_vm.c src/rpn_ir.c src/rpn_opt.c src/rpn_batch.c src/rpn_jit.c src/preset_factory.c src/preset_native.c preset_native_gen.c -lm
     if %ERRORLEVEL% == 0 (
         echo.
         echo Build successful! Run with: test_standalone.exe
@@ -50,7 +53,7 @@ echo   - MinGW-w64: https://www.mingw-w64.org/
 echo   - MSYS2: https://www.msys2.org/
 echo   - Clang: https://releases.llvm.org/
 echo.
-echo Or use WSL and run: gcc -I./src -o test_standalone test_main.c src/rpn_vm.c
+echo Or use WSL and run: gcc -I./src -o test_standalone test_main.c src/rpn_vm.c src/rpn_ir.c src/rpn_opt.c src/rpn_batch.c src/rpn_jit.c
 exit /b 1
 
 :end
@@ -0,0 +1,827 @@
+/**
+ * Differential fuzzer for the expression compiler and the VM.
+ *
+ * Random expressions (well-formed, and mutated into malformed ones) go
+ * through compileRPN(), the interpreters in src/rpn_vm.c and the native
+ * code from src/rpn_jit.c, and through an independent recursive-descent
+ * reference parser and tree evaluator. The two sides must agree on which
+ * expressions are valid and on the value of every sampled t: all 32 bits, or
+ * the low byte for programs compiled for the audio output only. A
+ * disagreement is shrunk to a small reproducer.
+ *
+ * Build: make -f Makefile.test fuzz (POSIX threads: Linux, macOS)
+ */
+
+#include "rpn_vm.h"
+#include "rpn_compile.h"
+#include "rpn_jit.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+#define MAX_FUZZ_THREADS 256
+#define MAX_EXPR_LEN 200        // stays clear of TEXT_BUFFER_SIZE
+#define MAX_REF_NODES 256
+#define REF_NONE 0xFFFF
+#define FUZZ_BLOCK 256          // consecutive samples checked on the block renderer
+#define DEFAULT_SAMPLES_PER_EXPR 1024
+#define MALFORMED_PERCENT 25
+
+// ============================================================================
+// Reference Evaluator
+// ============================================================================
+
+typedef enum {
+    REF_T, REF_NUM, REF_NEG, REF_NOT,
+    REF_MUL, REF_DIV, REF_MOD, REF_ADD, REF_SUB, REF_SHL, REF_SHR,
+    REF_LT, REF_GT, REF_LE, REF_GE, REF_EQ, REF_AND, REF_XOR, REF_OR,
+    REF_OP_COUNT
+} RefOp;
+
+#define REF_FIRST_BINARY REF_MUL
+
+// Binary operators as written, with the language's precedence levels
+static const struct {
+    const char* symbol;
+    int precedence;
+} refBinary[REF_OP_COUNT] = {
+    [REF_MUL] = {"*", 6}, [REF_DIV] = {"/", 6}, [REF_MOD] = {"%", 6},
+    [REF_ADD] = {"+", 5}, [REF_SUB] = {"-", 5},
+    [REF_SHL] = {"<<", 4}, [REF_SHR] = {">>", 4},
+    [REF_LT] = {"<", 3}, [REF_GT] = {">", 3}, [REF_LE] = {"<=", 3}, [REF_GE] = {">=", 3},
+    [REF_EQ] = {"=", 2},
+    [REF_AND] = {"&", 1},
+    [REF_XOR] = {"^", 0}, [REF_OR] = {"|", 0},
+};
+
+typedef struct {
+    uint8_t op;
+    uint16_t lhs;
+    uint16_t rhs;
+    uint32_t value;
+} RefNode;
+
+typedef struct {
+    RefNode nodes[MAX_REF_NODES];
+    uint16_t count;
+    uint16_t root;
+} RefTree;
+
+static uint16_t refNode(RefTree* tree, uint8_t op, uint16_t lhs, uint16_t rhs, uint32_t value) {
+    if (tree->count >= MAX_REF_NODES) return REF_NONE;
+    RefNode* node = &tree->nodes[tree->count];
+    node->op = op;
+    node->lhs = lhs;
+    node->rhs = rhs;
+    node->value = value;
+    return tree->count++;
+}
+
+static bool isBinaryRef(uint8_t op) {
+    return op >= REF_FIRST_BINARY;
+}
+
+typedef struct {
+    const char* s;
+    size_t pos;
+    RefTree* tree;
+} RefParser;
+
+static void refSkipSpaces(RefParser* p) {
+    while (p->s[p->pos] == ' ') p->pos++;
+}
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Literal at p->pos: decimal, 0x hex or 0b binary, wrapping modulo 2^32
+static uint16_t refParseNumber(RefParser* p) {
+    const char* s = p->s;
+    uint32_t value = 0;
+
+    if (s[p->pos] == '0' && (s[p->pos + 1] == 'x' || s[p->pos + 1] == 'X')) {
+        p->pos += 2;
+        if (hexValue(s[p->pos]) < 0) return REF_NONE;
+        while (hexValue(s[p->pos]) >= 0) value = (value << 4) | hexValue(s[p->pos++]);
+    } else if (s[p->pos] == '0' && (s[p->pos + 1] == 'b' || s[p->pos + 1] == 'B')) {
+        p->pos += 2;
+        if (s[p->pos] != '0' && s[p->pos] != '1') return REF_NONE;
+        while (s[p->pos] == '0' || s[p->pos] == '1') value = (value << 1) | (s[p->pos++] - '0');
+    } else {
+        while (s[p->pos] >= '0' && s[p->pos] <= '9') value = value * 10 + (s[p->pos++] - '0');
+    }
+    return refNode(p->tree, REF_NUM, REF_NONE, REF_NONE, value);
+}
+
+static uint16_t refParseExpr(RefParser* p, int minPrecedence);
+
+// Operand: unary prefixes (+ is ignored), parentheses, t or a literal
+static uint16_t refParseUnary(RefParser* p) {
+    refSkipSpaces(p);
+    char c = p->s[p->pos];
+
+    if (c == '+') {
+        p->pos++;
+        return refParseUnary(p);
+    }
+    if (c == '-' || c == '~') {
+        p->pos++;
+        uint16_t operand = refParseUnary(p);
+        if (operand == REF_NONE) return REF_NONE;
+        return refNode(p->tree, c == '-' ? REF_NEG : REF_NOT, operand, REF_NONE, 0);
+    }
+    if (c == '(') {
+        p->pos++;
+        uint16_t inner = refParseExpr(p, 0);
+        if (inner == REF_NONE) return REF_NONE;
+        refSkipSpaces(p);
+        if (p->s[p->pos] != ')') return REF_NONE;
+        p->pos++;
+        return inner;
+    }
+    if (c == 't') {
+        p->pos++;
+        return refNode(p->tree, REF_T, REF_NONE, REF_NONE, 0);
+    }
+    if (c >= '0' && c <= '9') return refParseNumber(p);
+    return REF_NONE;
+}
+
+// Binary operator at p->pos, or REF_OP_COUNT; *length receives its length
+static uint8_t refPeekBinary(const RefParser* p, size_t* length) {
+    const char* s = p->s + p->pos;
+    *length = 1;
+    switch (s[0]) {
+        case '*': return REF_MUL;
+        case '/': return REF_DIV;
+        case '%': return REF_MOD;
+        case '+': return REF_ADD;
+        case '-': return REF_SUB;
+        case '&': return REF_AND;
+        case '^': return REF_XOR;
+        case '|': return REF_OR;
+        case '=': return REF_EQ;
+        case '<':
+            if (s[1] == '<' || s[1] == '=') *length = 2;
+            return s[1] == '<' ? REF_SHL : s[1] == '=' ? REF_LE : REF_LT;
+        case '>':
+            if (s[1] == '>' || s[1] == '=') *length = 2;
+            return s[1] == '>' ? REF_SHR : s[1] == '=' ? REF_GE : REF_GT;
+        default:
+            return REF_OP_COUNT;
+    }
+}
+
+// Precedence climbing; every binary operator is left associative
+static uint16_t refParseExpr(RefParser* p, int minPrecedence) {
+    uint16_t lhs = refParseUnary(p);
+
+    while (lhs != REF_NONE) {
+        refSkipSpaces(p);
+        size_t length;
+        uint8_t op = refPeekBinary(p, &length);
+        if (op == REF_OP_COUNT || refBinary[op].precedence < minPrecedence) break;
+        p->pos += length;
+
+        uint16_t rhs = refParseExpr(p, refBinary[op].precedence + 1);
+        if (rhs == REF_NONE) return REF_NONE;
+        lhs = refNode(p->tree, op, lhs, rhs, 0);
+    }
+    return lhs;
+}
+
+static bool refParse(const char* text, RefTree* tree) {
+    RefParser p = {text, 0, tree};
+    tree->count = 0;
+    tree->root = refParseExpr(&p, 0);
+    refSkipSpaces(&p);
+    return tree->root != REF_NONE && text[p.pos] == '\0';
+}
+
+static uint32_t refEval(const RefTree* tree, uint16_t n, uint32_t t) {
+    const RefNode* node = &tree->nodes[n];
+    if (node->op == REF_T) return t;
+    if (node->op == REF_NUM) return node->value;
+
+    uint32_t a = refEval(tree, node->lhs, t);
+    if (node->op == REF_NEG) return 0u - a;
+    if (node->op == REF_NOT) return ~a;
+
+    uint32_t b = refEval(tree, node->rhs, t);
+    switch (node->op) {
+        case REF_MUL: return a * b;
+        case REF_DIV: return b == 0 ? 0 : a / b;
+        case REF_MOD: return b == 0 ? 0 : a % b;
+        case REF_ADD: return a + b;
+        case REF_SUB: return a - b;
+        case REF_SHL: return a << (b % 32);
+        case REF_SHR: return a >> (b % 32);
+        case REF_LT:  return a < b ? 1 : 0;
+        case REF_GT:  return a > b ? 1 : 0;
+        case REF_LE:  return a <= b ? 1 : 0;
+        case REF_GE:  return a >= b ? 1 : 0;
+        case REF_EQ:  return a == b ? 1 : 0;
+        case REF_AND: return a & b;
+        case REF_XOR: return a ^ b;
+        case REF_OR:  return a | b;
+        default:      return 0;
+    }
+}
+
+// ============================================================================
+// Generator
+// ============================================================================
+
+typedef struct {
+    uint64_t state;
+} Rng;
+
+static uint64_t rngNext(Rng* rng) {
+    // xorshift64*
+    rng->state ^= rng->state >> 12;
+    rng->state ^= rng->state << 25;
+    rng->state ^= rng->state >> 27;
+    return rng->state * 0x2545F4914F6CDD1Dull;
+}
+
+static uint32_t rngBelow(Rng* rng, uint32_t n) {
+    return (uint32_t)((rngNext(rng) >> 32) % n);
+}
+
+static uint32_t randomLiteral(Rng* rng) {
+    switch (rngBelow(rng, 6)) {
+        case 0:  return rngBelow(rng, 4);
+        case 1:  return rngBelow(rng, 33);          // shift counts
+        case 2:  return rngBelow(rng, 256);
+        case 3:  return 1u << rngBelow(rng, 32);    // powers of two
+        case 4:  return 0xFFFFFFFFu - rngBelow(rng, 4);
+        default: return (uint32_t)rngNext(rng);
+    }
+}
+
+static uint16_t generateNode(RefTree* tree, Rng* rng, int depth) {
+    uint32_t roll = rngBelow(rng, 100);
+
+    if (depth <= 0 || roll < 25) {
+        return roll % 2 ? refNode(tree, REF_T, REF_NONE, REF_NONE, 0)
+                        : refNode(tree, REF_NUM, REF_NONE, REF_NONE, randomLiteral(rng));
+    }
+    if (roll < 37) {
+        uint16_t operand = generateNode(tree, rng, depth - 1);
+        if (operand == REF_NONE) return REF_NONE;
+        return refNode(tree, rngBelow(rng, 2) ? REF_NEG : REF_NOT, operand, REF_NONE, 0);
+    }
+
+    uint8_t op = REF_FIRST_BINARY + rngBelow(rng, REF_OP_COUNT - REF_FIRST_BINARY);
+    uint16_t lhs = generateNode(tree, rng, depth - 1);
+    uint16_t rhs = generateNode(tree, rng, depth - 1);
+    if (lhs == REF_NONE || rhs == REF_NONE) return REF_NONE;
+    return refNode(tree, op, lhs, rhs, 0);
+}
+
+typedef struct {
+    char* out;
+    size_t len;
+    bool overflow;
+    Rng* rng; // NULL prints the canonical form: minimal parentheses, decimal
+} Printer;
+
+static void emitText(Printer* p, const char* s) {
+    size_t n = strlen(s);
+    if (p->len + n > MAX_EXPR_LEN) {
+        p->overflow = true;
+        return;
+    }
+    memcpy(p->out + p->len, s, n);
+    p->len += n;
+    p->out[p->len] = '\0';
+}
+
+static bool chance(Printer* p, uint32_t percent) {
+    return p->rng && rngBelow(p->rng, 100) < percent;
+}
+
+static void printLiteral(Printer* p, uint32_t value) {
+    char buf[48];
+    if (!p->rng) {
+        snprintf(buf, sizeof(buf), "%u", value);
+        emitText(p, buf);
+        return;
+    }
+
+    switch (rngBelow(p->rng, 5)) {
+        case 0:
+            snprintf(buf, sizeof(buf), rngBelow(p->rng, 2) ? "0x%X" : "0X%x", value);
+            break;
+        case 1: {
+            // Binary with an optional leading zero
+            char* b = buf + snprintf(buf, sizeof(buf), rngBelow(p->rng, 2) ? "0b" : "0B");
+            int bit = 31;
+            while (bit > 0 && !(value >> bit)) bit--;
+            if (rngBelow(p->rng, 4) == 0) *b++ = '0';
+            for (; bit >= 0; bit--) *b++ = '0' + ((value >> bit) & 1);
+            *b = '\0';
+            break;
+        }
+        case 2:
+            snprintf(buf, sizeof(buf), "0%u", value); // leading zero is still decimal
+            break;
+        case 3:
+            // Decimal that wraps modulo 2^32 to value
+            snprintf(buf, sizeof(buf), "%llu", (unsigned long long)value + (1ull << 32));
+            break;
+        default:
+            snprintf(buf, sizeof(buf), "%u", value);
+            break;
+    }
+    emitText(p, buf);
+}
+
+static void printNode(Printer* p, const RefTree* tree, uint16_t n) {
+    const RefNode* node = &tree->nodes[n];
+
+    if (chance(p, 5)) emitText(p, "+");
+    if (chance(p, 10)) emitText(p, " ");
+
+    bool extraParens = chance(p, 8);
+    if (extraParens) emitText(p, "(");
+
+    if (node->op == REF_T) {
+        emitText(p, "t");
+    } else if (node->op == REF_NUM) {
+        printLiteral(p, node->value);
+    } else if (!isBinaryRef(node->op)) {
+        emitText(p, node->op == REF_NEG ? "-" : "~");
+        bool parens = isBinaryRef(tree->nodes[node->lhs].op);
+        if (parens) emitText(p, "(");
+        printNode(p, tree, node->lhs);
+        if (parens) emitText(p, ")");
+    } else {
+        int precedence = refBinary[node->op].precedence;
+        const RefNode* l = &tree->nodes[node->lhs];
+        const RefNode* r = &tree->nodes[node->rhs];
+        bool lhsParens = isBinaryRef(l->op) && refBinary[l->op].precedence < precedence;
+        bool rhsParens = isBinaryRef(r->op) && refBinary[r->op].precedence <= precedence;
+
+        if (lhsParens) emitText(p, "(");
+        printNode(p, tree, node->lhs);
+        if (lhsParens) emitText(p, ")");
+        if (chance(p, 15)) emitText(p, " ");
+        emitText(p, refBinary[node->op].symbol);
+        if (chance(p, 15)) emitText(p, " ");
+        if (rhsParens) emitText(p, "(");
+        printNode(p, tree, node->rhs);
+        if (rhsParens) emitText(p, ")");
+    }
+
+    if (extraParens) emitText(p, ")");
+}
+
+static bool printTree(const RefTree* tree, Rng* rng, char* out) {
+    Printer p = {out, 0, false, rng};
+    out[0] = '\0';
+    printNode(&p, tree, tree->root);
+    return !p.overflow;
+}
+
+// Turn a well-formed expression into a probably malformed one
+static void mutateText(char* text, Rng* rng) {
+    static const char alphabet[] = "t0123456789abxX()+-*/%&|^~<>= ";
+    int mutations = 1 + rngBelow(rng, 3);
+
+    for (int m = 0; m < mutations; m++) {
+        size_t len = strlen(text);
+        size_t at = len ? rngBelow(rng, len) : 0;
+        switch (rngBelow(rng, 4)) {
+            case 0: // delete
+                if (len) memmove(text + at, text + at + 1, len - at);
+                break;
+            case 1: // insert
+                if (len < MAX_EXPR_LEN) {
+                    memmove(text + at + 1, text + at, len - at + 1);
+                    text[at] = alphabet[rngBelow(rng, sizeof(alphabet) - 1)];
+                }
+                break;
+            case 2: // replace
+                if (len) text[at] = alphabet[rngBelow(rng, sizeof(alphabet) - 1)];
+                break;
+            default: // swap with the next character
+                if (at + 1 < len) {
+                    char c = text[at];
+                    text[at] = text[at + 1];
+                    text[at + 1] = c;
+                }
+                break;
+        }
+    }
+}
+
+// ============================================================================
+// Differential Check
+// ============================================================================
+
+typedef enum {
+    CHECK_OK,
+    CHECK_REJECTED,        // both sides reject the expression
+    CHECK_SKIPPED,         // valid, but over the VM's stack or length limits
+    CHECK_ACCEPTS_INVALID,
+    CHECK_REJECTS_VALID,
+    CHECK_VALUE
+} CheckResult;
+
+typedef struct {
+    CheckResult result;
+    int compileError;
+    uint32_t t;
+    uint32_t expected;
+    uint32_t checked;
+    uint32_t verified;
+    uint32_t mask; // result bits the program was compiled to preserve
+    int blockByte; // -1 if t was not in the block range
+    int jitByte;   // -1 if the program has no native code
+} Failure;
+
+static const char* const checkResultNames[] = {
+    "ok", "rejected", "skipped", "compiler accepts an invalid expression",
+    "compiler rejects a valid expression", "value mismatch"
+};
+
+static bool isFailure(CheckResult result) {
+    return result >= CHECK_ACCEPTS_INVALID;
+}
+
+// t values checked for every expression: the edges of the range, the failing
+// t of a previous run, a block of consecutive t and random ones
+static uint32_t sampleT(uint32_t i, uint32_t blockStart, uint32_t extraT, Rng* rng) {
+    static const uint32_t edges[] = {
+        0, 1, 2, 255, 256, 0x7FFFFFFF, 0x80000000, 0xFFFFFFFE, 0xFFFFFFFF
+    };
+    uint32_t nEdges = sizeof(edges) / sizeof(edges[0]);
+
+    if (i == 0) return extraT;
+    if (i <= nEdges) return edges[i - 1];
+    if (i <= nEdges + FUZZ_BLOCK) return blockStart + (i - nEdges - 1);
+    return (uint32_t)rngNext(rng);
+}
+
+static CheckResult checkExpression(const char* text, uint64_t seed, uint32_t extraT,
+                                   uint32_t samples, Failure* failure, uint64_t* sampleCount) {
+    static _Thread_local RefTree tree;
+    bool valid = refParse(text, &tree);
+
+    // Half of the seeds compile for the full 32-bit value, so constant
+    // folding is still checked on every bit; the rest for the audio byte
+    uint32_t mask = seed & 2 ? 0xFFFFFFFF : RPN_OUTPUT_MASK;
+
+    // Every thread compiles with its own compiler
+    static _Thread_local struct RpnCompiler compiler;
+    struct RpnProgram program;
+    initRPNCompiler(&compiler, mask);
+    compileRPN(text, strlen(text), &program, &compiler);
+    int error = compiler.error;
+
+    memset(failure, 0, sizeof(*failure));
+    failure->compileError = error;
+    failure->mask = mask;
+    failure->blockByte = -1;
+    failure->jitByte = -1;
+
+    if (!valid) {
+        failure->result = error == ERR_NONE ? CHECK_ACCEPTS_INVALID : CHECK_REJECTED;
+        return failure->result;
+    }
+    if (error == ERR_STACK || error == ERR_PROGRAM_TOO_LONG) {
+        return failure->result = CHECK_SKIPPED;
+    }
+    if (error != ERR_NONE) return failure->result = CHECK_REJECTS_VALID;
+
+    Rng rng = {seed | 1};
+    uint32_t blockStart = (uint32_t)rngNext(&rng);
+    uint8_t block[FUZZ_BLOCK];
+    executeRPNBlock(blockStart, FUZZ_BLOCK, &program, block);
+
+    // Every thread keeps its code buffer across expressions
+    static _Thread_local struct RpnJit jit;
+    uint8_t jitBlock[FUZZ_BLOCK];
+    if (jitCompileRPN(&program, &jit)) jit.fn(blockStart, FUZZ_BLOCK, jitBlock);
+
+    uint32_t i = 0;
+    for (; i < samples; i++) {
+        uint32_t t = sampleT(i, blockStart, extraT, &rng);
+        uint32_t expected = refEval(&tree, tree.root, t);
+        uint32_t checked = executeRPN(t, &program);
+        uint32_t verified = executeRPNVerified(t, &program);
+        uint32_t offset = t - blockStart;
+        int blockByte = offset < FUZZ_BLOCK ? block[offset] : -1;
+        int jitByte = -1;
+        if (jit.fn && offset < FUZZ_BLOCK) {
+            jitByte = jitBlock[offset];
+        } else if (jit.fn) {
+            uint8_t byte;
+            jit.fn(t, 1, &byte);
+            jitByte = byte;
+        }
+
+        if (((checked ^ expected) & mask) || ((verified ^ expected) & mask) ||
+            (blockByte >= 0 && blockByte != (uint8_t)expected) ||
+            (jitByte >= 0 && jitByte != (uint8_t)expected)) {
+            failure->result = CHECK_VALUE;
+            failure->t = t;
+            failure->expected = expected;
+            failure->checked = checked;
+            failure->verified = verified;
+            failure->blockByte = blockByte;
+            failure->jitByte = jitByte;
+            break;
+        }
+    }
+
+    if (sampleCount) *sampleCount += i + FUZZ_BLOCK;
+    return failure->result;
+}
+
+// ============================================================================
+// Shrinker
+// ============================================================================
+
+static bool stillFails(const char* text, uint64_t seed, const Failure* original, uint32_t samples) {
+    Failure f;
+    if (strlen(text) == 0) return false;
+    return checkExpression(text, seed, original->t, samples, &f, NULL) == original->result;
+}
+
+// Replace subtrees by their operands, t or small constants while the
+// expression keeps failing the same way
+static bool shrinkTree(char* text, uint64_t seed, const Failure* failure, uint32_t samples) {
+    static _Thread_local RefTree tree;
+    static _Thread_local RefTree candidate;
+    char buf[MAX_EXPR_LEN + 1];
+    bool progress = false;
+
+    if (!refParse(text, &tree)) return false;
+
+    for (uint16_t n = 0; n < tree.count; n++) {
+        const RefNode node = tree.nodes[n];
+        RefNode options[8];
+        int count = 0;
+
+        if (node.lhs != REF_NONE) options[count++] = tree.nodes[node.lhs];
+        if (node.rhs != REF_NONE) options[count++] = tree.nodes[node.rhs];
+        if (node.op != REF_T) options[count++] = (RefNode){REF_T, REF_NONE, REF_NONE, 0};
+        if (node.op != REF_NUM || node.value > 1) {
+            options[count++] = (RefNode){REF_NUM, REF_NONE, REF_NONE, 0};
+            options[count++] = (RefNode){REF_NUM, REF_NONE, REF_NONE, 1};
+        }
+        if (node.op == REF_NUM && node.value > 1) {
+            options[count++] = (RefNode){REF_NUM, REF_NONE, REF_NONE, node.value >> 1};
+            options[count++] = (RefNode){REF_NUM, REF_NONE, REF_NONE, node.value >> 8};
+        }
+
+        for (int i = 0; i < count; i++) {
+            candidate = tree;
+            candidate.nodes[n] = options[i];
+            if (!printTree(&candidate, NULL, buf) || strlen(buf) >= strlen(text)) continue;
+            if (stillFails(buf, seed, failure, samples)) {
+                strcpy(text, buf);
+                if (!refParse(text, &tree)) return true;
+                progress = true;
+                n = (uint16_t)-1; // start over on the smaller tree
+                break;
+            }
+        }
+    }
+    return progress;
+}
+
+// Delete ever smaller runs of characters while the expression keeps failing
+static bool shrinkText(char* text, uint64_t seed, const Failure* failure, uint32_t samples) {
+    char buf[MAX_EXPR_LEN + 1];
+    bool progress = false;
+
+    for (size_t chunk = strlen(text) / 2; chunk >= 1; chunk /= 2) {
+        for (size_t at = 0; at + chunk <= strlen(text);) {
+            size_t len = strlen(text);
+            memcpy(buf, text, at);
+            memcpy(buf + at, text + at + chunk, len - at - chunk + 1);
+            if (stillFails(buf, seed, failure, samples)) {
+                strcpy(text, buf);
+                progress = true;
+            } else {
+                at++;
+            }
+        }
+    }
+    return progress;
+}
+
+static void shrink(char* text, uint64_t seed, const Failure* failure, uint32_t samples) {
+    while (shrinkTree(text, seed, failure, samples) || shrinkText(text, seed, failure, samples)) {
+    }
+}
+
+// ============================================================================
+// Driver
+// ============================================================================
+
+typedef struct {
+    uint64_t seed;
+    uint32_t samples;
+    uint64_t maxExpressions;
+    atomic_bool stop;
+    atomic_uint_fast64_t expressions;
+    atomic_uint_fast64_t samplesChecked;
+    atomic_uint_fast64_t results[CHECK_VALUE + 1];
+    pthread_mutex_t reportLock;
+    bool failed;
+} FuzzJob;
+
+typedef struct {
+    FuzzJob* job;
+    uint32_t index;
+} FuzzWorker;
+
+static void report(const char* original, const char* shrunk, const Failure* f) {
+    printf("\nFAILURE: %s\n", checkResultNames[f->result]);
+    printf("  expression: %s\n", original);
+    printf("  shrunk to:  %s\n", shrunk);
+    if (f->result == CHECK_VALUE) {
+        printf("  t=%u (0x%08X) mask=0x%08X: reference=0x%08X executeRPN=0x%08X executeRPNVerified=0x%08X",
+               f->t, f->t, f->mask, f->expected, f->checked, f->verified);
+        if (f->blockByte >= 0) printf(" block=0x%02X", f->blockByte);
+        if (f->jitByte >= 0) printf(" jit=0x%02X", f->jitByte);
+        printf("\n");
+    } else {
+        printf("  compileError=%d\n", f->compileError);
+    }
+    fflush(stdout);
+}
+
+static void* fuzzWorker(void* arg) {
+    FuzzWorker* worker = arg;
+    FuzzJob* job = worker->job;
+    Rng rng = {(job->seed + 0x9E3779B97F4A7C15ull * (worker->index + 1)) | 1};
+    static _Thread_local RefTree tree;
+    char text[MAX_EXPR_LEN + 1];
+
+    while (!atomic_load(&job->stop)) {
+        uint64_t n = atomic_fetch_add(&job->expressions, 1);
+        if (job->maxExpressions && n >= job->maxExpressions) break;
+
+        tree.count = 0;
+        tree.root = generateNode(&tree, &rng, 1 + rngBelow(&rng, 6));
+        if (tree.root == REF_NONE || !printTree(&tree, &rng, text)) continue;
+        if (rngBelow(&rng, 100) < MALFORMED_PERCENT) mutateText(text, &rng);
+
+        uint64_t seed = rngNext(&rng);
+        uint64_t sampled = 0;
+        Failure failure;
+        CheckResult result = checkExpression(text, seed, 0, job->samples, &failure, &sampled);
+        atomic_fetch_add(&job->results[result], 1);
+        atomic_fetch_add(&job->samplesChecked, sampled);
+
+        if (isFailure(result)) {
+            // Only the first failure gets shrunk and reported
+            pthread_mutex_lock(&job->reportLock);
+            bool first = !job->failed;
+            job->failed = true;
+            atomic_store(&job->stop, true);
+            pthread_mutex_unlock(&job->reportLock);
+
+            if (first) {
+                char shrunk[MAX_EXPR_LEN + 1];
+                strcpy(shrunk, text);
+                shrink(shrunk, seed, &failure, job->samples);
+                report(text, shrunk, &failure);
+            }
+            break;
+        }
+    }
+    return NULL;
+}
+
+static double nowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void printUsage(const char* name) {
+    printf("Usage: %s [options] [expression]\n", name);
+    printf("  -s <seconds>  Stop after this long (default 10, 0 = until a failure)\n");
+    printf("  -n <count>    Stop after this many expressions\n");
+    printf("  -j <threads>  Worker threads (default: online CPUs)\n");
+    printf("  -S <samples>  t values checked per expression (default %d)\n", DEFAULT_SAMPLES_PER_EXPR);
+    printf("  -r <seed>     Random seed (default: time)\n");
+    printf("With an expression, only that expression is checked and shrunk on failure.\n");
+}
+
+int main(int argc, char* argv[]) {
+    double seconds = 10;
+    uint64_t maxExpressions = 0;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t samples = DEFAULT_SAMPLES_PER_EXPR;
+    uint64_t seed = (uint64_t)time(NULL);
+    const char* expression = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-' && argv[i][1] && !argv[i][2] && i + 1 < argc) {
+            const char* value = argv[++i];
+            switch (argv[i - 1][1]) {
+                case 's': seconds = strtod(value, NULL); break;
+                case 'n': maxExpressions = strtoull(value, NULL, 0); break;
+                case 'j': threads = strtol(value, NULL, 0); break;
+                case 'S': samples = strtoul(value, NULL, 0); break;
+                case 'r': seed = strtoull(value, NULL, 0); break;
+                default: printUsage(argv[0]); return 1;
+            }
+        } else if (!expression) {
+            expression = argv[i];
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (threads < 1) threads = 1;
+    if (threads > MAX_FUZZ_THREADS) threads = MAX_FUZZ_THREADS;
+    if (samples < 1) samples = 1;
+
+    if (expression) {
+        if (strlen(expression) > MAX_EXPR_LEN) {
+            fprintf(stderr, "Expression longer than %d characters\n", MAX_EXPR_LEN);
+            return 1;
+        }
+        Failure failure;
+        CheckResult result = checkExpression(expression, seed, 0, samples, &failure, NULL);
+        if (!isFailure(result)) {
+            printf("%s: %s\n", expression, checkResultNames[result]);
+            return 0;
+        }
+        char shrunk[MAX_EXPR_LEN + 1];
+        strcpy(shrunk, expression);
+        shrink(shrunk, seed, &failure, samples);
+        report(expression, shrunk, &failure);
+        return 1;
+    }
+
+    printf("Fuzzing with seed %llu, %ld threads, %u samples per expression\n",
+           (unsigned long long)seed, threads, samples);
+
+    static FuzzJob job;
+    job.seed = seed;
+    job.samples = samples;
+    job.maxExpressions = maxExpressions;
+    pthread_mutex_init(&job.reportLock, NULL);
+
+    FuzzWorker workers[MAX_FUZZ_THREADS];
+    pthread_t handles[MAX_FUZZ_THREADS];
+    long started = 0;
+    for (; started < threads; started++) {
+        workers[started] = (FuzzWorker){&job, (uint32_t)started};
+        if (pthread_create(&handles[started], NULL, fuzzWorker, &workers[started]) != 0) break;
+    }
+    if (started == 0) {
+        fprintf(stderr, "Could not start worker threads\n");
+        return 1;
+    }
+
+    // Progress once a second until done, out of time or failed
+    double start = nowSeconds();
+    double lastPrint = start;
+    while (!atomic_load(&job.stop)) {
+        nanosleep(&(struct timespec){0, 50000000}, NULL);
+        double now = nowSeconds();
+        if (seconds > 0 && now - start >= seconds) atomic_store(&job.stop, true);
+        if (maxExpressions && atomic_load(&job.expressions) >= maxExpressions) break;
+        if (now - lastPrint >= 1.0) {
+            lastPrint = now;
+            printf("  %6.0f s  %10llu expressions  %8.2f M samples/s\n", now - start,
+                   (unsigned long long)atomic_load(&job.expressions),
+                   atomic_load(&job.samplesChecked) / (now - start) / 1e6);
+            fflush(stdout);
+        }
+    }
+    for (long i = 0; i < started; i++) {
+        pthread_join(handles[i], NULL);
+    }
+
+    double elapsed = nowSeconds() - start;
+    printf("\n%llu expressions, %llu samples in %.1f s (%.2f M samples/s, %ld threads)\n",
+           (unsigned long long)(atomic_load(&job.results[CHECK_OK]) + atomic_load(&job.results[CHECK_REJECTED]) +
+                                atomic_load(&job.results[CHECK_SKIPPED])),
+           (unsigned long long)atomic_load(&job.samplesChecked), elapsed,
+           atomic_load(&job.samplesChecked) / elapsed / 1e6, started);
+    printf("  evaluated: %llu  rejected by both: %llu  over VM limits: %llu\n",
+           (unsigned long long)atomic_load(&job.results[CHECK_OK]),
+           (unsigned long long)atomic_load(&job.results[CHECK_REJECTED]),
+           (unsigned long long)atomic_load(&job.results[CHECK_SKIPPED]));
+    printf(job.failed ? "\nFUZZING FOUND A FAILURE\n" : "\nNO FAILURES FOUND\n");
+    return job.failed ? 1 : 0;
+}
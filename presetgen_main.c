@@ -0,0 +1,228 @@
+/**
+ * Compile the factory presets to C at build time.
+ *
+ * Every non-empty entry of factoryPresets[] goes through the real
+ * compileRPN() with the device's output mask; the optimized bytecode is
+ * then turned back into one C expression per preset and written out as a
+ * block renderer, together with the bytecode it was generated from.
+ * findNativePreset() (src/preset_native.c) matches compiled programs
+ * against that bytecode, so a preset only runs natively if the firmware
+ * compiles it to exactly the same program.
+ *
+ * Build: make -f Makefile.test preset_native_gen.c (CMake runs it for the
+ * firmware)
+ * Usage: presetgen <output.c>
+ */
+
+#include "rpn_vm.h"
+#include "rpn_compile.h"
+#include "preset.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define MAX_C_EXPR 4096 // characters per stack slot expression
+
+typedef struct {
+    char expr[RPN_STACK_SIZE][MAX_C_EXPR];
+    uint8_t depth;
+    uint8_t temps;               // sN variables declared so far
+    int reg[RPN_REG_COUNT];      // sN holding each scratch register
+    FILE* out;
+} CWriter;
+
+static void setSlot(CWriter* w, uint8_t slot, const char* format, const char* a, const char* b) {
+    char text[MAX_C_EXPR];
+    int len = snprintf(text, sizeof(text), format, a, b);
+    if (len < 0 || len >= MAX_C_EXPR) {
+        fprintf(stderr, "presetgen: expression too long\n");
+        exit(1);
+    }
+    memcpy(w->expr[slot], text, len + 1);
+}
+
+// Move the top of stack into a fresh variable so it is only computed once
+static void spillTop(CWriter* w) {
+    char name[8];
+    snprintf(name, sizeof(name), "s%u", w->temps++);
+    fprintf(w->out, "        uint32_t %s = %s;\n", name, w->expr[w->depth - 1]);
+    setSlot(w, w->depth - 1, "%s", name, NULL);
+}
+
+static const char* binaryFormat(uint8_t opcode) {
+    switch (opcode) {
+        case RPN_ADD: return "(%s + %s)";
+        case RPN_SUB: return "(%s - %s)";
+        case RPN_MUL: return "(%s * %s)";
+        case RPN_DIV: return "presetDiv(%s, %s)";
+        case RPN_MOD: return "presetMod(%s, %s)";
+        case RPN_AND: return "(%s & %s)";
+        case RPN_OR:  return "(%s | %s)";
+        case RPN_XOR: return "(%s ^ %s)";
+        case RPN_SHL: return "(%s << (%s & 31))";
+        case RPN_SHR: return "(%s >> (%s & 31))";
+        case RPN_LT:  return "(uint32_t)(%s < %s)";
+        case RPN_GT:  return "(uint32_t)(%s > %s)";
+        case RPN_EQ:  return "(uint32_t)(%s == %s)";
+        case RPN_LE:  return "(uint32_t)(%s <= %s)";
+        case RPN_GE:  return "(uint32_t)(%s >= %s)";
+        case RPN_NE:  return "(uint32_t)(%s != %s)";
+        default: return NULL;
+    }
+}
+
+// Write the loop body of one program; false if it uses an unknown opcode
+static bool writeBody(const struct RpnProgram* program, FILE* out) {
+    static CWriter w;
+    memset(&w, 0, sizeof(w));
+    w.out = out;
+    const uint8_t* code = program->code;
+    char literal[16];
+
+    for (uint16_t pc = 0; pc < program->length;) {
+        uint8_t opcode = code[pc++];
+        uint8_t top = w.depth - 1;
+
+        switch (opcode) {
+            case RPN_PUSH_T:
+                setSlot(&w, w.depth++, "t", NULL, NULL);
+                break;
+            case RPN_PUSH_NUM:
+            case RPN_PUSH_CONST: {
+                uint32_t value = opcode == RPN_PUSH_NUM ? code[pc] : program->pool[code[pc]];
+                pc++;
+                snprintf(literal, sizeof(literal), "0x%Xu", value);
+                setSlot(&w, w.depth++, "%s", literal, NULL);
+                break;
+            }
+            case RPN_NOT:
+                setSlot(&w, top, "(~%s)", w.expr[top], NULL);
+                break;
+            case RPN_NEG:
+                setSlot(&w, top, "(0u - %s)", w.expr[top], NULL);
+                break;
+            case RPN_DUP:
+                spillTop(&w);
+                setSlot(&w, w.depth++, "%s", w.expr[top], NULL);
+                break;
+            case RPN_SWAP: {
+                char held[MAX_C_EXPR];
+                memcpy(held, w.expr[top], sizeof(held));
+                setSlot(&w, top, "%s", w.expr[top - 1], NULL);
+                setSlot(&w, top - 1, "%s", held, NULL);
+                break;
+            }
+            case RPN_STORE:
+                spillTop(&w);
+                w.reg[code[pc++]] = w.temps - 1;
+                break;
+            case RPN_LOAD:
+                snprintf(literal, sizeof(literal), "s%d", w.reg[code[pc++]]);
+                setSlot(&w, w.depth++, "%s", literal, NULL);
+                break;
+            case RPN_CACHE:
+                // The C compiler sees the whole loop; no runtime cache
+                pc += 2;
+                break;
+            case RPN_DIVC:
+            case RPN_MODC: {
+                // The magic multiplier on the stack is dropped; the C compiler
+                // derives its own from the divisor
+                snprintf(literal, sizeof(literal), "%uu", program->pool[code[pc++]] >> 5);
+                w.depth--;
+                setSlot(&w, top - 1, opcode == RPN_DIVC ? "(%s / %s)" : "(%s %% %s)",
+                        w.expr[top - 1], literal);
+                break;
+            }
+            default: {
+                const char* format = binaryFormat(opcode);
+                if (!format) return false;
+                w.depth--;
+                setSlot(&w, top - 1, format, w.expr[top - 1], w.expr[top]);
+                break;
+            }
+        }
+    }
+
+    fprintf(out, "        *out++ = (uint8_t)%s;\n", w.depth ? w.expr[w.depth - 1] : "0");
+    return true;
+}
+
+static void writeBytes(FILE* out, const char* type, const char* name, int index,
+                       const void* data, unsigned count, unsigned size) {
+    fprintf(out, "static const %s %s%d[] = {", type, name, index);
+    for (unsigned i = 0; i < count; i++) {
+        uint32_t v = size == 1 ? ((const uint8_t*)data)[i] : ((const uint32_t*)data)[i];
+        fprintf(out, "%s%s0x%X", i ? "," : "", i % 12 ? " " : "\n    ", v);
+    }
+    // Empty initializers are not valid C
+    fprintf(out, "%s\n};\n", count ? "" : "\n    0");
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <output.c>\n", argv[0]);
+        return 1;
+    }
+    FILE* out = fopen(argv[1], "w");
+    if (!out) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    fprintf(out, "// Generated by presetgen_main.c from factoryPresets[]. Do not edit.\n\n");
+    fprintf(out, "#include \"preset_native.h\"\n\n");
+    fprintf(out, "static inline uint32_t presetDiv(uint32_t a, uint32_t b) { return b ? a / b : 0; }\n");
+    fprintf(out, "static inline uint32_t presetMod(uint32_t a, uint32_t b) { return b ? a %% b : 0; }\n");
+
+    static struct RpnCompiler compiler;
+    bool compiled[PRESET_COUNT] = {false};
+    struct RpnProgram programs[PRESET_COUNT];
+    int status = 0;
+
+    for (int i = 0; i < PRESET_COUNT; i++) {
+        if (!factoryPresets[i][0]) continue;
+
+        struct RpnProgram* program = &programs[i];
+        initRPNCompiler(&compiler, RPN_OUTPUT_MASK);
+        if (compileRPN(factoryPresets[i], strlen(factoryPresets[i]), program, &compiler) == 0) {
+            fprintf(stderr, "presetgen: P%d does not compile (error %d): %s\n",
+                    i + 1, compiler.error, factoryPresets[i]);
+            status = 1;
+            continue;
+        }
+
+        fprintf(out, "\n// P%d: %s\n", i + 1, factoryPresets[i]);
+        writeBytes(out, "uint8_t", "presetCode", i, program->code, program->length, 1);
+        writeBytes(out, "uint32_t", "presetPool", i, program->pool, program->poolSize, 4);
+        fprintf(out, "static void presetRender%d(uint32_t t0, uint32_t n, uint8_t* out) {\n", i);
+        fprintf(out, "    for (; n; n--, t0++) {\n");
+        fprintf(out, "        uint32_t t = t0;\n");
+        if (!writeBody(program, out)) {
+            fprintf(stderr, "presetgen: P%d uses an opcode without a C form\n", i + 1);
+            fclose(out);
+            remove(argv[1]);
+            return 1;
+        }
+        fprintf(out, "    }\n}\n");
+        compiled[i] = true;
+    }
+
+    uint8_t count = 0;
+    fprintf(out, "\nconst struct NativePreset nativePresets[] = {\n");
+    for (int i = 0; i < PRESET_COUNT; i++) {
+        if (!compiled[i]) continue;
+        fprintf(out, "    {%d, %u, %u, presetCode%d, presetPool%d, presetRender%d},\n",
+                i, programs[i].length, programs[i].poolSize, i, i, i);
+        count++;
+    }
+    if (count == 0) fprintf(out, "    {0, 0, 0, 0, 0, 0},\n");
+    fprintf(out, "};\n\nconst uint8_t nativePresetCount = %u;\n", count);
+
+    if (fclose(out) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (status) remove(argv[1]);
+    return status;
+}
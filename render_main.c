@@ -0,0 +1,218 @@
+/**
+ * Render a bytebeat expression to an 8-bit mono WAV file on the host.
+ *
+ * Uses the real src/rpn_vm.c: the expression is compiled once (to native code
+ * by src/rpn_jit.c where the host has a backend), then the sample range is
+ * split into chunks that a pool of threads renders straight into a
+ * memory-mapped output file.
+ *
+ * Build: make -f Makefile.test render (POSIX: Linux, macOS)
+ */
+
+#include "rpn_vm.h"
+#include "rpn_compile.h"
+#include "rpn_jit.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#define DEFAULT_SAMPLE_RATE 8000
+#define DEFAULT_SECONDS 60
+#define RENDER_CHUNK_SAMPLES (1u << 20) // samples claimed per thread at a time
+#define MAX_RENDER_THREADS 256
+#define WAV_HEADER_SIZE 44
+
+typedef struct {
+    const struct RpnProgram* program;
+    const struct RpnJit* jit;
+    uint8_t* data;        // mapped sample data, one byte per sample
+    uint64_t samples;
+    uint32_t startT;
+    atomic_uint_fast64_t nextChunk;
+} RenderJob;
+
+// Too big for the stack of some platforms' main thread
+static struct RpnCompiler compiler;
+
+static void putLE16(uint8_t* p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static void putLE32(uint8_t* p, uint32_t v) {
+    putLE16(p, v & 0xFFFF);
+    putLE16(p + 2, v >> 16);
+}
+
+static void writeWavHeader(uint8_t* p, uint32_t sampleRate, uint32_t dataSize) {
+    memcpy(p, "RIFF", 4);
+    putLE32(p + 4, 36 + dataSize);
+    memcpy(p + 8, "WAVEfmt ", 8);
+    putLE32(p + 16, 16);          // fmt chunk size
+    putLE16(p + 20, 1);           // PCM
+    putLE16(p + 22, 1);           // mono
+    putLE32(p + 24, sampleRate);
+    putLE32(p + 28, sampleRate);  // byte rate
+    putLE16(p + 32, 1);           // block align
+    putLE16(p + 34, 8);           // bits per sample, unsigned like the PWM output
+    memcpy(p + 36, "data", 4);
+    putLE32(p + 40, dataSize);
+}
+
+// Claim chunks until the range is done. Every thread has its own RpnCache;
+// the program and its native code are only read.
+static void* renderWorker(void* arg) {
+    RenderJob* job = arg;
+    struct RpnCache cache;
+    resetRPNCache(&cache);
+
+    for (;;) {
+        uint64_t chunk = atomic_fetch_add(&job->nextChunk, 1);
+        uint64_t offset = chunk * RENDER_CHUNK_SAMPLES;
+        if (offset >= job->samples) break;
+
+        uint64_t count = job->samples - offset;
+        if (count > RENDER_CHUNK_SAMPLES) count = RENDER_CHUNK_SAMPLES;
+        executeRPNBlockJit(job->startT + (uint32_t)offset, (uint32_t)count,
+                           job->program, job->jit, &cache, job->data + offset);
+    }
+    return NULL;
+}
+
+static double secondsSince(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+static void printUsage(const char* name) {
+    printf("Usage: %s [options] <expression>\n", name);
+    printf("  -o <file>     Output WAV file (default out.wav)\n");
+    printf("  -r <rate>     Sample rate in Hz (default %d)\n", DEFAULT_SAMPLE_RATE);
+    printf("  -s <seconds>  Length in seconds (default %d)\n", DEFAULT_SECONDS);
+    printf("  -t <t0>       First value of t (default 0)\n");
+    printf("  -j <threads>  Render threads (default: online CPUs)\n");
+}
+
+int main(int argc, char* argv[]) {
+    const char* outPath = "out.wav";
+    uint32_t sampleRate = DEFAULT_SAMPLE_RATE;
+    double seconds = DEFAULT_SECONDS;
+    uint32_t startT = 0;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char* expression = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-' && argv[i][1] && !argv[i][2] && i + 1 < argc) {
+            const char* value = argv[++i];
+            switch (argv[i - 1][1]) {
+                case 'o': outPath = value; break;
+                case 'r': sampleRate = strtoul(value, NULL, 0); break;
+                case 's': seconds = strtod(value, NULL); break;
+                case 't': startT = strtoul(value, NULL, 0); break;
+                case 'j': threads = strtol(value, NULL, 0); break;
+                default: printUsage(argv[0]); return 1;
+            }
+        } else if (!expression) {
+            expression = argv[i];
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!expression || sampleRate == 0 || seconds <= 0) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    if (threads < 1) threads = 1;
+    if (threads > MAX_RENDER_THREADS) threads = MAX_RENDER_THREADS;
+
+    // WAV sizes are 32-bit
+    uint64_t samples = (uint64_t)(seconds * sampleRate);
+    if (samples == 0 || samples > 0xFFFFFFFFull - 36 - WAV_HEADER_SIZE) {
+        fprintf(stderr, "Length out of range for a WAV file: %llu samples\n",
+                (unsigned long long)samples);
+        return 1;
+    }
+
+    // Same output mask as the firmware
+    initRPNCompiler(&compiler, RPN_OUTPUT_MASK);
+    struct RpnProgram program;
+    uint16_t length = compileRPN(expression, strlen(expression), &program, &compiler);
+    if (compiler.error != ERR_NONE) {
+        fprintf(stderr, "COMPILE ERROR: %d\n", compiler.error);
+        return 1;
+    }
+    struct RpnJit jit = {0};
+    bool native = jitCompileRPN(&program, &jit);
+    printf("Compiled: %d RPN instructions -> %d bytes, %d constants%s\n",
+           compiler.rawLength, length, program.poolSize, native ? ", native code" : "");
+
+    size_t fileSize = WAV_HEADER_SIZE + samples;
+    int fd = open(outPath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(outPath);
+        return 1;
+    }
+    if (ftruncate(fd, fileSize) != 0) {
+        perror("ftruncate");
+        close(fd);
+        return 1;
+    }
+    uint8_t* map = mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return 1;
+    }
+    writeWavHeader(map, sampleRate, (uint32_t)samples);
+
+    RenderJob job = {
+        .program = &program,
+        .jit = &jit,
+        .data = map + WAV_HEADER_SIZE,
+        .samples = samples,
+        .startT = startT,
+    };
+    atomic_init(&job.nextChunk, 0);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_t workers[MAX_RENDER_THREADS];
+    long started = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(&workers[started], NULL, renderWorker, &job) != 0) break;
+    }
+    // Render on this thread too if no worker could be started
+    if (started == 0) renderWorker(&job);
+    for (long i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    double elapsed = secondsSince(&start);
+    releaseRPNJit(&jit);
+
+    int status = 0;
+    if (munmap(map, fileSize) != 0) {
+        perror("munmap");
+        status = 1;
+    }
+    if (close(fd) != 0) {
+        perror(outPath);
+        status = 1;
+    }
+
+    double audioSeconds = (double)samples / sampleRate;
+    printf("Rendered %.1f s (%llu samples at %u Hz) to %s with %ld threads in %.3f s (%.0fx real-time)\n",
+           audioSeconds, (unsigned long long)samples, sampleRate, outPath,
+           started ? started : 1, elapsed, elapsed > 0 ? audioSeconds / elapsed : 0.0);
+    return status;
+}
@@ -1,37 +1,577 @@
 #include "audio.h"
 #include "hardware/pwm.h"
 #include "hardware/irq.h"
+#include "hardware/dma.h"
+#include "hardware/clocks.h"
+#include "hardware/timer.h"
+#include "hardware/sync.h"
 #include "pico/stdlib.h"
+#include <string.h>
 
 #define AUDIO_PIN 0
+// Spare slice with no pin attached, used only as the DMA sample clock
+#define AUDIO_PACER_SLICE (NUM_PWM_SLICES - 1)
+
+const uint32_t audio_sample_rates[AUDIO_RATE_COUNT] = {
+    8000, 11025, 16000, 22050, 32000, 44100
+};
 
 static uint slice;
-static bool audio_enabled = false;
+static volatile uint32_t sample_rate = AUDIO_DEFAULT_SAMPLE_RATE; // as played
+static volatile bool audio_started = false;
+static volatile uint32_t underruns;
+// Recent render cost in ns per sample: follows slower blocks at once and
+// faster ones gradually, so a program's heavy passages are not missed
+static volatile uint32_t render_ns;
+static audio_render_cb_t render_cb;
+
+// Settings as last requested by core 0; the engine catches up with them
+// through the command ring
+static uint32_t requested_rate = AUDIO_DEFAULT_SAMPLE_RATE;
+static bool requested_parallel = false;
+
+// Engine state, only ever touched by the engine
+static uint32_t engine_t;
+static volatile uint32_t engine_frame; // samples rendered since boot
+static bool playing = false;
+static uint32_t gain = AUDIO_UNITY_GAIN;
+static bool parallel = false;
+static uint32_t block_rate; // AUDIO_CMD_RATE met in the block being rendered
+
+// Command ring from core 0 (the only producer) to the engine (the only
+// consumer), free-running counters like the render-ahead queue. The engine
+// applies commands in ring order, each right before the frame it is due at.
+static struct AudioCommand commands[AUDIO_COMMAND_SLOTS];
+static volatile uint32_t command_head;
+static volatile uint32_t command_tail;
+
+// Triple-buffered program hand-off. Each slot belongs to one side at a
+// time: core 0 fills its write slot, the engine renders from its read
+// slot, and the third is parked in the shared middle word together with
+// the generation it was published as. Publishing swaps the write slot with
+// the middle; on AUDIO_CMD_PROGRAM the engine swaps its read slot with the
+// middle when it holds a generation it has not seen. Neither side ever
+// touches the other's slot, so no buffer is rewritten while it can still be
+// read, however fast programs are published.
+#define SLOT_BITS 2
+#define SLOT_MASK 3
+static void* slots[3];
+static uint32_t write_slot = 1; // core 0 only
+static uint32_t read_slot = 0;  // engine only
+static uint32_t published_generation; // written by core 0 only
+static volatile uint32_t seen_generation; // written by the engine only
+static volatile uint32_t middle = 2; // slot | generation << SLOT_BITS
+
+// Parallel mode: the engine posts every other block for core 0, which
+// renders it from its main loop (audio_help()). The job goes IDLE -> POSTED
+// (engine) -> TAKEN -> DONE (core 0) -> IDLE (engine); a job core 0 has not
+// taken by the time the engine finishes its own block is taken back, so a
+// busy core 0 never holds up the audio. The SIO FIFOs are not used because
+// multicore_lockout (flash_safe_execute()) owns them.
+enum { JOB_IDLE, JOB_POSTED, JOB_TAKEN, JOB_DONE };
+static void* volatile job_program;
+static uint8_t* volatile job_dst;
+static volatile uint32_t job_t0;
+static volatile uint32_t job_state = JOB_IDLE;
+
+// Render-ahead queue between the engine loop (the only producer) and the
+// output interrupt (the only consumer). The counters run freely and each
+// is written by one side only; head - tail blocks are ready to play. A
+// block may carry a sample rate to switch to as it starts playing.
+static uint8_t queue[AUDIO_QUEUE_BLOCKS][AUDIO_BLOCK_SIZE];
+static uint32_t queue_rate[AUDIO_QUEUE_BLOCKS];
+static volatile uint32_t queue_head;
+static volatile uint32_t queue_tail;
+
+#if AUDIO_USE_DMA
+// Pacer period for each of audio_sample_rates[] in 1/16 sysclock cycles (the
+// PWM divider has 4 fraction bits), worked out by audio_init() so that a
+// rate change only has to look it up
+static uint32_t pacer_div16s[AUDIO_RATE_COUNT];
+static uint32_t pacer_tops[AUDIO_RATE_COUNT];
+// Current pacer period, kept for audio_get_actual_rate()
+static uint32_t pacer_div16 = 16;
+static uint32_t pacer_top = 1;
+
+// Divider and wrap of the pacer slice that come closest to one wrap per
+// sample at the actual sysclock
+static void plan_pacer(int index) {
+    uint32_t rate = audio_sample_rates[index];
+    uint32_t target = (uint32_t)(((uint64_t)clock_get_hz(clk_sys) * 16 + rate / 2) / rate);
+    uint32_t best_error = UINT32_MAX;
+    for (uint32_t div16 = 16; div16 < 256 * 16 && best_error; div16++) {
+        uint32_t top = (target + div16 / 2) / div16;
+        if (top > 65536) continue;
+        if (top < 2) break;
+        uint32_t period = top * div16;
+        uint32_t error = period > target ? period - target : target - period;
+        if (error < best_error) {
+            best_error = error;
+            pacer_div16s[index] = div16;
+            pacer_tops[index] = top;
+        }
+    }
+}
+#endif
 
 void audio_init() {
     gpio_set_function(AUDIO_PIN, GPIO_FUNC_PWM);
     slice = pwm_gpio_to_slice_num(AUDIO_PIN);
 
+    // 8-bit carrier at the full sysclock: 488 kHz at 125 MHz, far above
+    // the highest sample rate
     pwm_config cfg = pwm_get_default_config();
     pwm_config_set_clkdiv(&cfg, 1.0f);
-    pwm_config_set_wrap(&cfg, 255); // ~977 kHz PWM (250MHz / 256)
+    pwm_config_set_wrap(&cfg, 255);
 
     pwm_init(slice, &cfg, true);
 
     // Start with silence (0 = no PWM switching = no carrier noise)
     pwm_set_gpio_level(AUDIO_PIN, 0);
+
+#if AUDIO_USE_DMA
+    for (int i = 0; i < AUDIO_RATE_COUNT; i++) plan_pacer(i);
+#endif
+}
+
+inline void audio_write(uint8_t v) {
+    pwm_set_gpio_level(AUDIO_PIN, v);
 }
 
-void audio_enable(bool enable) {
-    audio_enabled = enable;
-    if (!enable) {
-        // Set to silence when disabled
-        pwm_set_gpio_level(AUDIO_PIN, 0);
+// Consumer side: the oldest ready block, or NULL if the engine fell behind
+static const uint8_t* queue_front(void) {
+    uint32_t tail = queue_tail;
+    if (__atomic_load_n(&queue_head, __ATOMIC_ACQUIRE) == tail) {
+        underruns++;
+        return NULL;
     }
+    return queue[tail % AUDIO_QUEUE_BLOCKS];
 }
 
-inline void audio_write(uint8_t v) {
-    if (audio_enabled) {
-        pwm_set_gpio_level(AUDIO_PIN, v);
+// Consumer side: take the front block's rate change, 0 if it has none
+static uint32_t queue_front_rate(void) {
+    uint32_t* rate = &queue_rate[queue_tail % AUDIO_QUEUE_BLOCKS];
+    uint32_t value = *rate;
+    *rate = 0;
+    return value;
+}
+
+// Consumer side: hand the front block back to the engine
+static void queue_pop(void) {
+    __atomic_store_n(&queue_tail, queue_tail + 1, __ATOMIC_RELEASE);
+    __sev();
+}
+
+// Engine side: the front command if it is due at frame
+static const struct AudioCommand* command_due(uint32_t frame) {
+    uint32_t tail = command_tail;
+    if (__atomic_load_n(&command_head, __ATOMIC_ACQUIRE) == tail) return NULL;
+    const struct AudioCommand* c = &commands[tail % AUDIO_COMMAND_SLOTS];
+    return (int32_t)(c->at - frame) <= 0 ? c : NULL;
+}
+
+// Engine side: samples from frame on that can be rendered before the front
+// command is due, at most limit
+static uint32_t frames_before_command(uint32_t frame, uint32_t limit) {
+    uint32_t tail = command_tail;
+    if (__atomic_load_n(&command_head, __ATOMIC_ACQUIRE) == tail) return limit;
+    int32_t ahead = (int32_t)(commands[tail % AUDIO_COMMAND_SLOTS].at - frame);
+    if (ahead <= 0) return 0;
+    return (uint32_t)ahead < limit ? (uint32_t)ahead : limit;
+}
+
+// Engine side: switch to the newest published program, if there is one
+static void adopt_program(void) {
+    uint32_t m = __atomic_load_n(&middle, __ATOMIC_ACQUIRE);
+    while ((m >> SLOT_BITS) != seen_generation) {
+        // Park the old read slot under the generation being adopted, so it
+        // does not look new itself
+        uint32_t parked = read_slot | (m & ~(uint32_t)SLOT_MASK);
+        if (__atomic_compare_exchange_n(&middle, &m, parked, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            read_slot = m & SLOT_MASK;
+            seen_generation = m >> SLOT_BITS;
+            break;
+        }
+    }
+}
+
+// Engine side: apply the front command and hand its slot back to core 0
+static void apply_command(const struct AudioCommand* c) {
+    switch (c->type) {
+        case AUDIO_CMD_PROGRAM: adopt_program(); break;
+        case AUDIO_CMD_SEEK: engine_t = c->value; break;
+        case AUDIO_CMD_PLAY: playing = true; break;
+        case AUDIO_CMD_STOP: playing = false; break;
+        case AUDIO_CMD_RATE: block_rate = c->value; break;
+        case AUDIO_CMD_GAIN:
+            gain = c->value < AUDIO_UNITY_GAIN ? c->value : AUDIO_UNITY_GAIN;
+            break;
+        case AUDIO_CMD_CORES: parallel = c->value > 1; break;
+    }
+    __atomic_store_n(&command_tail, command_tail + 1, __ATOMIC_RELEASE);
+}
+
+// Stop and gain act on rendered samples, so they land on their frame even
+// in blocks core 0 rendered
+static void shape(uint8_t* dst, uint32_t n) {
+    if (!playing) {
+        memset(dst, 0, n);
+    } else if (gain != AUDIO_UNITY_GAIN) {
+        for (uint32_t i = 0; i < n; i++) {
+            dst[i] = (uint8_t)(128 + (((int32_t)dst[i] - 128) * (int32_t)gain >> 8));
+        }
     }
 }
+
+// Render one block on the engine core, split where commands fall due unless
+// they are held, and track what a sample costs. The program keeps running
+// while stopped, so the load stays known.
+static void render_block(uint8_t* dst, bool hold_commands) {
+    uint32_t start = time_us_32();
+    for (uint32_t done = 0; done < AUDIO_BLOCK_SIZE;) {
+        uint32_t n = AUDIO_BLOCK_SIZE - done;
+        if (!hold_commands) {
+            const struct AudioCommand* c;
+            while ((c = command_due(engine_frame + done))) apply_command(c);
+            n = frames_before_command(engine_frame + done, n);
+        }
+        render_cb(slots[read_slot], engine_t, dst + done, n, 0);
+        shape(dst + done, n);
+        engine_t += n;
+        done += n;
+    }
+    engine_frame += AUDIO_BLOCK_SIZE;
+
+    uint32_t ns = (time_us_32() - start) * 1000 / AUDIO_BLOCK_SIZE;
+    uint32_t recent = render_ns;
+    render_ns = ns >= recent ? ns : recent - (recent - ns) / 16;
+}
+
+// Producer side: render the next block, or the next two with core 0's help
+// in parallel mode, if the queue has room
+static bool render_ahead(void) {
+    uint32_t head = queue_head;
+    uint32_t used = head - __atomic_load_n(&queue_tail, __ATOMIC_ACQUIRE);
+    if (used >= AUDIO_QUEUE_BLOCKS) return false;
+
+    // Core 0 only gets a block no command falls into, so it never needs
+    // the engine state. Commands sent while the pair is being rendered wait
+    // until after it: both blocks have to use the same program and t, and
+    // the program slot must not be parked (and handed back to core 0 for
+    // recompiling) while the job can still read it.
+    uint32_t blocks = 1;
+    if (parallel && used + 2 <= AUDIO_QUEUE_BLOCKS &&
+        frames_before_command(engine_frame, 2 * AUDIO_BLOCK_SIZE) == 2 * AUDIO_BLOCK_SIZE) {
+        job_program = slots[read_slot];
+        job_dst = queue[(head + 1) % AUDIO_QUEUE_BLOCKS];
+        job_t0 = engine_t + AUDIO_BLOCK_SIZE;
+        __atomic_store_n(&job_state, JOB_POSTED, __ATOMIC_RELEASE);
+        __sev();
+        blocks = 2;
+    }
+
+    block_rate = 0;
+    render_block(queue[head % AUDIO_QUEUE_BLOCKS], blocks == 2);
+    queue_rate[head % AUDIO_QUEUE_BLOCKS] = block_rate;
+
+    if (blocks == 2) {
+        uint32_t expected = JOB_POSTED;
+        if (__atomic_compare_exchange_n(&job_state, &expected, JOB_IDLE, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            render_cb(job_program, job_t0, job_dst, AUDIO_BLOCK_SIZE, 0);
+        } else {
+            while (__atomic_load_n(&job_state, __ATOMIC_ACQUIRE) != JOB_DONE) __wfe();
+            job_state = JOB_IDLE;
+        }
+        shape(job_dst, AUDIO_BLOCK_SIZE);
+        queue_rate[(head + 1) % AUDIO_QUEUE_BLOCKS] = 0;
+        engine_t += AUDIO_BLOCK_SIZE;
+        engine_frame += AUDIO_BLOCK_SIZE;
+    }
+
+    __atomic_store_n(&queue_head, head + blocks, __ATOMIC_RELEASE);
+    return true;
+}
+
+void audio_help(void) {
+    uint32_t expected = JOB_POSTED;
+    if (!__atomic_compare_exchange_n(&job_state, &expected, JOB_TAKEN, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    render_cb(job_program, job_t0, job_dst, AUDIO_BLOCK_SIZE, 1);
+    __atomic_store_n(&job_state, JOB_DONE, __ATOMIC_RELEASE);
+    __sev();
+}
+
+bool audio_send(const struct AudioCommand* batch, uint32_t count) {
+    uint32_t head = command_head;
+    uint32_t used = head - __atomic_load_n(&command_tail, __ATOMIC_ACQUIRE);
+    if (count > AUDIO_COMMAND_SLOTS - used) return false;
+
+    for (uint32_t i = 0; i < count; i++) {
+        commands[(head + i) % AUDIO_COMMAND_SLOTS] = batch[i];
+    }
+    // One release for the whole batch: the engine sees all of it or none
+    __atomic_store_n(&command_head, head + count, __ATOMIC_RELEASE);
+    return true;
+}
+
+void audio_send_now(const struct AudioCommand* batch, uint32_t count) {
+    struct AudioCommand now[AUDIO_COMMAND_SLOTS];
+    if (count > AUDIO_COMMAND_SLOTS) return;
+
+    uint32_t frame = audio_get_frame();
+    for (uint32_t i = 0; i < count; i++) {
+        now[i] = batch[i];
+        now[i].at = frame;
+    }
+    // The engine drains the ring every block; keep helping it in parallel
+    // mode while waiting for room
+    while (!audio_send(now, count)) audio_help();
+}
+
+void audio_command(uint8_t type, uint32_t value) {
+    struct AudioCommand c = {type, value, 0};
+    audio_send_now(&c, 1);
+}
+
+uint32_t audio_get_frame(void) {
+    return engine_frame;
+}
+
+void audio_init_programs(void* current, void* spare1, void* spare2) {
+    slots[read_slot] = current;
+    slots[write_slot] = spare1;
+    slots[middle & SLOT_MASK] = spare2;
+}
+
+void* audio_program_buffer(void) {
+    return slots[write_slot];
+}
+
+void audio_publish_program(void) {
+    published_generation = (published_generation + 1) & (UINT32_MAX >> SLOT_BITS);
+    uint32_t old = __atomic_exchange_n(&middle, write_slot | published_generation << SLOT_BITS,
+                                       __ATOMIC_ACQ_REL);
+    write_slot = old & SLOT_MASK;
+}
+
+bool audio_program_pending(void) {
+    return (__atomic_load_n(&middle, __ATOMIC_ACQUIRE) >> SLOT_BITS) != seen_generation;
+}
+
+void audio_set_parallel(bool enable) {
+    requested_parallel = enable;
+    audio_command(AUDIO_CMD_CORES, enable ? 2 : 1);
+}
+
+bool audio_get_parallel(void) {
+    return requested_parallel;
+}
+
+#if AUDIO_USE_DMA
+// Ping-pong buffers: each DMA channel plays one half and chains to the other.
+// Each half is an aligned read ring of its own, so a half the interrupt does
+// not re-arm in time (while flash_safe_execute() holds this core with
+// interrupts off) plays itself again instead of running on into the memory
+// behind it.
+#define DMA_RING_BITS 9
+#if (1 << DMA_RING_BITS) != AUDIO_BLOCK_SIZE * 4
+#error "A DMA buffer half must be exactly one read ring"
+#endif
+static uint32_t dma_buffers[2][AUDIO_BLOCK_SIZE] __attribute__((aligned(1 << DMA_RING_BITS)));
+static uint32_t dma_rates[2]; // rate to switch to as each half starts, or 0
+static int dma_channels[2];
+static uint32_t level_shift;
+
+// Move the next queued block into one half of the ping-pong buffer as CC
+// values; silence if the engine fell behind
+static void fill_dma_buffer(int half) {
+    uint32_t* dst = dma_buffers[half];
+    const uint8_t* block = queue_front();
+
+    if (block) {
+        for (uint32_t i = 0; i < AUDIO_BLOCK_SIZE; i++) {
+            dst[i] = (uint32_t)block[i] << level_shift;
+        }
+        dma_rates[half] = queue_front_rate();
+        queue_pop();
+    } else {
+        for (uint32_t i = 0; i < AUDIO_BLOCK_SIZE; i++) {
+            dst[i] = 0;
+        }
+        dma_rates[half] = 0;
+    }
+}
+
+static void configure_pacer(uint32_t rate) {
+    int i = 0;
+    while (i < AUDIO_RATE_COUNT - 1 && audio_sample_rates[i] != rate) i++;
+    pacer_div16 = pacer_div16s[i];
+    pacer_top = pacer_tops[i];
+    // The wrap is double-buffered, so a live change takes effect cleanly
+    // at the end of the current sample
+    pwm_set_clkdiv_int_frac(AUDIO_PACER_SLICE, pacer_div16 >> 4, pacer_div16 & 15);
+    pwm_set_wrap(AUDIO_PACER_SLICE, pacer_top - 1);
+    sample_rate = rate;
+}
+
+static void audio_dma_irq_handler(void) {
+    for (int i = 0; i < 2; i++) {
+        uint ch = dma_channels[i];
+        if (dma_channel_get_irq0_status(ch)) {
+            dma_channel_acknowledge_irq0(ch);
+            // This half has finished playing and the other one is running
+            // now: switch to the other half's rate if it brought one, then
+            // refill this half and re-arm it for the next chain trigger
+            if (dma_rates[i ^ 1]) {
+                configure_pacer(dma_rates[i ^ 1]);
+                dma_rates[i ^ 1] = 0;
+            }
+            fill_dma_buffer(i);
+            dma_channel_set_read_addr(ch, dma_buffers[i], false);
+        }
+    }
+}
+
+// The DMA IRQ is enabled on the calling core
+static void start_output(void) {
+    level_shift = (pwm_gpio_to_channel(AUDIO_PIN) == PWM_CHAN_B) ? 16 : 0;
+
+    dma_channels[0] = dma_claim_unused_channel(true);
+    dma_channels[1] = dma_claim_unused_channel(true);
+    for (int i = 0; i < 2; i++) fill_dma_buffer(i);
+
+    // Pacer slice wraps once per sample, at the first block's rate
+    pwm_config pacer = pwm_get_default_config();
+    pwm_init(AUDIO_PACER_SLICE, &pacer, false);
+    configure_pacer(dma_rates[0] ? dma_rates[0] : sample_rate);
+    dma_rates[0] = 0;
+
+    for (int i = 0; i < 2; i++) {
+        dma_channel_config c = dma_channel_get_default_config(dma_channels[i]);
+        channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+        channel_config_set_read_increment(&c, true);
+        channel_config_set_ring(&c, false, DMA_RING_BITS);
+        channel_config_set_write_increment(&c, false);
+        channel_config_set_dreq(&c, pwm_get_dreq(AUDIO_PACER_SLICE));
+        channel_config_set_chain_to(&c, dma_channels[i ^ 1]);
+        dma_channel_configure(dma_channels[i], &c, &pwm_hw->slice[slice].cc,
+                              dma_buffers[i], AUDIO_BLOCK_SIZE, false);
+        dma_channel_set_irq0_enabled(dma_channels[i], true);
+    }
+
+    irq_set_exclusive_handler(DMA_IRQ_0, audio_dma_irq_handler);
+    irq_set_enabled(DMA_IRQ_0, true);
+
+    dma_channel_start(dma_channels[0]);
+    pwm_set_enabled(AUDIO_PACER_SLICE, true);
+}
+#else
+// Per-sample timer: period in whole microseconds plus a Bresenham
+// remainder, so the average rate is exact (44.1 kHz is 22.68 us)
+static uint32_t timer_period_us;
+static uint32_t timer_extra_us; // 1000000 % rate
+static uint32_t timer_phase;
+
+// Queued block being played out one sample per timer tick
+static const uint8_t* timer_block;
+static uint32_t timer_block_pos;
+
+static void configure_timer(uint32_t rate) {
+    timer_extra_us = 1000000 % rate;
+    timer_period_us = 1000000 / rate;
+    timer_phase = 0;
+    sample_rate = rate;
+}
+
+static bool audio_timer_cb(struct repeating_timer* t) {
+    if (!timer_block) {
+        timer_block = queue_front();
+        uint32_t rate = timer_block ? queue_front_rate() : 0;
+        if (rate) configure_timer(rate);
+    }
+    if (timer_block) {
+        audio_write(timer_block[timer_block_pos++]);
+        if (timer_block_pos == AUDIO_BLOCK_SIZE) {
+            timer_block = NULL;
+            timer_block_pos = 0;
+            queue_pop();
+        }
+    } else {
+        audio_write(0);
+    }
+
+    uint32_t us = timer_period_us;
+    timer_phase += timer_extra_us;
+    if (timer_phase >= sample_rate) {
+        timer_phase -= sample_rate;
+        us++;
+    }
+    t->delay_us = -(int64_t)us;
+    return true;
+}
+
+// The timer fires from an alarm pool of the calling core; the default pool
+// belongs to core 0
+static void start_output(void) {
+    static struct repeating_timer timer;
+    alarm_pool_t* pool = alarm_pool_create_with_unused_hardware_alarm(4);
+    configure_timer(sample_rate);
+    alarm_pool_add_repeating_timer_us(pool, -(int64_t)timer_period_us, audio_timer_cb, NULL,
+                                      &timer);
+}
+#endif
+
+void audio_run(audio_render_cb_t render) {
+    render_cb = render;
+
+    // Fill the queue before the output starts pulling from it
+    while (render_ahead()) {
+    }
+    start_output();
+    audio_started = true;
+
+    // The consumer signals an event whenever it frees a block
+    while (true) {
+        if (!render_ahead()) __wfe();
+    }
+}
+
+uint32_t audio_get_sample_rate(void) {
+    return requested_rate;
+}
+
+float audio_get_actual_rate(void) {
+#if AUDIO_USE_DMA
+    if (audio_started) {
+        return (float)clock_get_hz(clk_sys) * 16.0f / (float)(pacer_div16 * pacer_top);
+    }
+#endif
+    return (float)sample_rate;
+}
+
+uint32_t audio_get_underruns(void) {
+    return underruns;
+}
+
+uint32_t audio_load_at(uint32_t rate) {
+    uint32_t load = (uint32_t)(((uint64_t)render_ns * rate + 5000000) / 10000000);
+    return requested_parallel ? (load + 1) / 2 : load;
+}
+
+bool audio_set_sample_rate(uint32_t rate) {
+    bool known = false;
+    for (int i = 0; i < AUDIO_RATE_COUNT; i++) {
+        if (audio_sample_rates[i] == rate) known = true;
+    }
+    if (!known) return false;
+    // Slowing down always fits; speeding up needs the headroom
+    if (rate > requested_rate && audio_load_at(rate) > AUDIO_LOAD_LIMIT_PERCENT) return false;
+
+    requested_rate = rate;
+    audio_command(AUDIO_CMD_RATE, rate);
+    return true;
+}
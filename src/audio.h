@@ -2,6 +2,103 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+// The audio engine owns one core: it renders blocks ahead into a queue,
+// and an output interrupt on the same core plays them out. Output mode:
+// 1 = DMA streams queued blocks to the PWM, paced by a PWM wrap DREQ;
+// 0 = one repeating-timer interrupt per sample (audio_write)
+#ifndef AUDIO_USE_DMA
+#define AUDIO_USE_DMA 1
+#endif
+
+#define AUDIO_DEFAULT_SAMPLE_RATE 8000
+#define AUDIO_RATE_COUNT 6
+#define AUDIO_BLOCK_SIZE 128 // samples per queued block and per DMA transfer
+#define AUDIO_QUEUE_BLOCKS 4 // blocks rendered ahead of the output
+#define AUDIO_WORKERS 2 // render workers: the audio core and core 0
+// Share of the audio core a program may need at a rate before
+// audio_set_sample_rate() refuses it
+#define AUDIO_LOAD_LIMIT_PERCENT 80
+#define AUDIO_COMMAND_SLOTS 16 // commands in flight from core 0 to the engine
+#define AUDIO_UNITY_GAIN 256
+
+// Sample rates selectable at runtime, in Hz, ascending
+extern const uint32_t audio_sample_rates[AUDIO_RATE_COUNT];
+
+// Fills dst with the n unsigned 8-bit samples of program from t0 on.
+// worker is 0 on the audio core and 1 for the blocks core 0 renders in
+// parallel mode; the two may run at the same time, so each needs its own
+// mutable state.
+typedef void (*audio_render_cb_t)(void* program, uint32_t t0, uint8_t* dst, uint32_t n,
+                                  uint8_t worker);
+
+// Call once the sysclock is final: the sample clock is derived from it
 void audio_init(void);
-void audio_enable(bool enable);
 void audio_write(uint8_t v);
+// Run the audio engine on the calling core: start the output at the
+// current rate and keep the queue filled from render. Never returns.
+void audio_run(audio_render_cb_t render);
+
+// Everything core 0 changes in the engine goes through a lock-free command
+// ring. The engine applies commands in the order sent, each right before
+// the sample frame it is due at (frames count the samples rendered since
+// boot, see audio_get_frame()); commands due in the past apply as soon as
+// the engine gets to them. Playback starts stopped, at unity gain.
+enum AudioCommandType {
+    AUDIO_CMD_PROGRAM, // switch to the newest published program
+    AUDIO_CMD_SEEK,    // continue rendering from t = value
+    AUDIO_CMD_PLAY,
+    AUDIO_CMD_STOP,    // silence; the program keeps running
+    AUDIO_CMD_RATE,    // sample rate in Hz, from the block holding the frame on
+    AUDIO_CMD_GAIN,    // 0..AUDIO_UNITY_GAIN
+    AUDIO_CMD_CORES,   // render cores, 1 or 2
+};
+
+struct AudioCommand {
+    uint8_t type; // AudioCommandType
+    uint32_t value;
+    uint32_t at;  // frame the command is due at
+};
+
+// Queue count commands as one batch, all or none: false if the ring has no
+// room for them. Core 0 only.
+bool audio_send(const struct AudioCommand* batch, uint32_t count);
+// Queue commands due at the current frame, waiting for room if needed
+void audio_send_now(const struct AudioCommand* batch, uint32_t count);
+void audio_command(uint8_t type, uint32_t value);
+// Frame of the next sample the engine renders; the output plays it up to
+// AUDIO_QUEUE_BLOCKS blocks later
+uint32_t audio_get_frame(void);
+
+// Program hand-off from core 0, triple-buffered: the engine renders
+// current until the first publish; core 0 fills audio_program_buffer() and
+// publishes it, after which audio_program_buffer() is another of the three
+// buffers, never one the engine can still read. The engine switches on
+// AUDIO_CMD_PROGRAM, to the newest program only; audio_program_pending()
+// is true until it has switched.
+void audio_init_programs(void* current, void* spare1, void* spare2);
+void* audio_program_buffer(void);
+void audio_publish_program(void);
+bool audio_program_pending(void);
+
+// Parallel mode: core 0 renders every other block, so programs up to twice
+// as slow keep up. Core 0 has to call audio_help() often (between UI
+// steps); blocks it does not pick up in time are rendered by the engine.
+// Sends AUDIO_CMD_CORES.
+void audio_set_parallel(bool enable);
+bool audio_get_parallel(void);
+void audio_help(void);
+
+// Requested and actual (sysclock-derived, as played) sample rate, in Hz
+uint32_t audio_get_sample_rate(void);
+float audio_get_actual_rate(void);
+// Output periods that found the queue empty since boot
+uint32_t audio_get_underruns(void);
+// Percent of the audio core the current program needs at rate, from the
+// recent render cost (0 until something has been rendered); halved in
+// parallel mode
+uint32_t audio_load_at(uint32_t rate);
+// Switch to one of audio_sample_rates[]; false if rate is not in the table
+// or the current program would need more than AUDIO_LOAD_LIMIT_PERCENT.
+// Sends AUDIO_CMD_RATE; the output switches with the first block rendered
+// at the new rate.
+bool audio_set_sample_rate(uint32_t rate);
@@ -82,14 +82,14 @@ const Action fn2Layer[KEY_COUNT] = {
 ├───┼───┼───┼───┼───┤
 │P1 │P2 │P3 │   │SAV│
 ├───┼───┼───┼───┼───┤
-│   │   │P- │P+ │ ▸ │
+│R- │R+ │P- │P+ │ ▸ │
 └───┴───┴───┴───┴───┘
 */
 const Action memLayer[KEY_COUNT] = {
     ACT_PRESET_7, ACT_PRESET_8, ACT_PRESET_9,   ACT_MEM,        ACT_DEL,
     ACT_PRESET_4, ACT_PRESET_5, ACT_PRESET_6,   ACT_FN1,        ACT_FN2,
     ACT_PRESET_1, ACT_PRESET_2, ACT_PRESET_3,   ACT_NONE,       ACT_SAVE,
-    ACT_NONE,     ACT_NONE,     ACT_PRESET_DEC, ACT_PRESET_INC, ACT_ENTER
+    ACT_RATE_DEC, ACT_RATE_INC, ACT_PRESET_DEC, ACT_PRESET_INC, ACT_ENTER
 };
 
 void keyboard_init(void) {
@@ -321,6 +321,12 @@ bool keyboard_execute_action(Action action) {
         case ACT_SAVE:
             return preset_save(current_slot, textBuffer);
             
+        // Sample rate
+        case ACT_RATE_DEC:
+            return ui_step_sample_rate(-1);
+        case ACT_RATE_INC:
+            return ui_step_sample_rate(1);
+            
         default:
             return false;
     }
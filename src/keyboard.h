@@ -62,7 +62,10 @@ typedef enum {
     ACT_PRESET_7, ACT_PRESET_8, ACT_PRESET_9,
     ACT_PRESET_DEC, ACT_PRESET_INC,
     
-    ACT_SAVE
+    ACT_SAVE,
+    
+    // Sample rate
+    ACT_RATE_DEC, ACT_RATE_INC
 } Action;
 
 // Function prototypes
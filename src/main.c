@@ -1,5 +1,6 @@
 #include "pico/stdlib.h"
 #include "pico/multicore.h"
+#include "pico/flash.h"
 #include "pico/sync.h"
 #include "hardware/sync.h"
 #include "hardware/timer.h"
@@ -11,13 +12,14 @@
 
 #include "audio.h"
 #include "rpn_vm.h"
+#include "rpn_jit.h"
+#include "preset_native.h"
 #include "ui.h"
 #include "display.h"
 #include "keyboard.h"
 #include "preset.h"
 #include "test_rpn.h"
 
-#define SAMPLE_US (1000000 / 8000)
 #define KEY_DEBOUNCE_MS 50
 #define KEY_REPEAT_DELAY_MS 500  // Initial delay before repeat starts
 #define KEY_REPEAT_RATE_MS 100   // Repeat rate once started
@@ -28,15 +30,15 @@
 char cmd_buffer[CMD_BUFFER_SIZE];
 uint8_t cmd_pos = 0;
 
-// Atomic pointer swap for lock-free program updates
+// Compiled program as handed to the audio engine (audio_publish_program())
 struct ProgramBuffer {
-    struct RpnInstruction program[RPN_PROGRAM_SIZE];
-    uint8_t length;
+    struct RpnProgram program;
+    struct RpnCache cache[AUDIO_WORKERS]; // owned by the audio side once published
+    struct RpnJit jit;     // native code in SRAM, interpreted if fn is NULL
+    const struct NativePreset* preset; // build-time C for a factory preset, or NULL
 };
 
-static struct ProgramBuffer program_buffers[2];
-static volatile struct ProgramBuffer* active_program = &program_buffers[0];
-volatile uint32_t t_audio = 0;
+static struct ProgramBuffer program_buffers[3];
 
 // I2C scanner for debugging
 void i2c_scan(void) {
@@ -82,17 +84,56 @@ void i2c_scan(void) {
     printf("\nI2C scan complete\n");
 }
 
-bool audio_cb(struct repeating_timer *t) {
-    struct ProgramBuffer* prog = (struct ProgramBuffer*)
-        __atomic_load_n(&active_program, __ATOMIC_ACQUIRE);
+// Compile textBuffer into buf and report what the optimizer saved
+static void compile_program(struct ProgramBuffer* buf) {
+    uint16_t len = compileToRPN(&buf->program);
+    for (int i = 0; i < AUDIO_WORKERS; i++) resetRPNCache(&buf->cache[i]);
+    buf->preset = findNativePreset(&buf->program);
+    bool native = buf->preset ? false : jitCompileRPN(&buf->program, &buf->jit);
+    if (compileError == ERR_NONE) {
+        printf("Compiled: %d RPN instructions -> %d bytes, %d constants",
+               compileRawLen, len, buf->program.poolSize);
+        if (buf->preset) {
+            printf(", factory preset P%d", buf->preset->slot + 1);
+        } else if (native) {
+            printf(", native code");
+        }
+        printf("\n");
+    }
+}
 
-    uint32_t tval = t_audio;
-    uint32_t result = executeRPN(tval, prog->program, prog->length);
-    __atomic_store_n(&t_audio, tval + 1, __ATOMIC_RELAXED);
+// Publish the compiled program; the engine switches to it and, for a new
+// expression, restarts t in the same command batch
+static void hand_over_program(void) {
+    struct AudioCommand batch[] = {{AUDIO_CMD_PROGRAM, 0, 0}, {AUDIO_CMD_SEEK, 0, 0}};
+    audio_publish_program();
+    audio_send_now(batch, needsResetT ? 2 : 1);
+    needsResetT = false;
+}
+
+// Render n samples of a published program from t0 on for the audio engine
+void audio_render(void* program, uint32_t t0, uint8_t* dst, uint32_t n, uint8_t worker) {
+    struct ProgramBuffer* prog = program;
+    if (prog->preset) {
+        prog->preset->render(t0, n, dst);
+    } else {
+        executeRPNBlockJit(t0, n, &prog->program, &prog->jit, &prog->cache[worker], dst);
+    }
+}
 
-    int8_t s = (int8_t)((result & 0xFF) ^ 0x80);
-    audio_write(s + 128);
-    return true;
+// Print the current rate and what the program needs at each rate
+static void print_sample_rates(void) {
+    printf("Sample rate: %lu Hz (%.1f Hz from a %lu Hz sysclock)\n",
+           (unsigned long)audio_get_sample_rate(), audio_get_actual_rate(),
+           (unsigned long)clock_get_hz(clk_sys));
+    for (int i = 0; i < AUDIO_RATE_COUNT; i++) {
+        uint32_t rate = audio_sample_rates[i];
+        uint32_t load = audio_load_at(rate);
+        printf("  %5lu Hz: %3lu%% CPU%s\n", (unsigned long)rate, (unsigned long)load,
+               load > AUDIO_LOAD_LIMIT_PERCENT ? " (too slow)" : "");
+    }
+    printf("Render cores: %d\n", audio_get_parallel() ? 2 : 1);
+    printf("Underruns: %lu\n", (unsigned long)audio_get_underruns());
 }
 
 void process_command(char* cmd) {
@@ -154,8 +195,32 @@ void process_command(char* cmd) {
         int testIndex = atoi(cmd + 9);
         printf("Running test case %d...\n", testIndex);
         runSingleTest(testIndex, 0, 10000, true);
+    } else if (strcmp(cmd, "bench") == 0) {
+        benchAllTests(100000);
+    } else if (strncmp(cmd, "bench ", 6) == 0) {
+        uint32_t samples = atoi(cmd + 6);
+        if (samples > 0 && samples <= 10000000) {
+            benchAllTests(samples);
+        } else {
+            printf("Invalid sample count. Use 1-10000000\n");
+        }
     } else if (strcmp(cmd, "testlist") == 0) {
         listTests();
+    } else if (strcmp(cmd, "rate") == 0) {
+        print_sample_rates();
+    } else if (strncmp(cmd, "rate ", 5) == 0) {
+        ui_set_sample_rate(strtoul(cmd + 5, NULL, 10));
+    } else if (strcmp(cmd, "cores 1") == 0 || strcmp(cmd, "cores 2") == 0) {
+        audio_set_parallel(cmd[6] == '2');
+        printf("Rendering on %c core%s\n", cmd[6], cmd[6] == '2' ? "s" : "");
+    } else if (strncmp(cmd, "gain ", 5) == 0) {
+        int percent = atoi(cmd + 5);
+        if (percent >= 0 && percent <= 100) {
+            audio_command(AUDIO_CMD_GAIN, (uint32_t)percent * AUDIO_UNITY_GAIN / 100);
+            printf("Gain: %d%%\n", percent);
+        } else {
+            printf("Invalid gain. Use 0-100\n");
+        }
     } else if (strcmp(cmd, "help") == 0) {
         printf("Commands:\n");
         printf("  play/start - Start audio playback\n");
@@ -164,11 +229,16 @@ void process_command(char* cmd) {
         printf("  load <n>   - Load preset 1-9\n");
         printf("  save <n>   - Save current expression to preset 1-9\n");
         printf("  clear      - Clear all presets\n");
+        printf("  rate [hz]  - Show or set the sample rate (8000, 11025, 16000,\n");
+        printf("               22050, 32000, 44100)\n");
+        printf("  cores <n>  - Render on 1 core or on 2 (for slow expressions)\n");
+        printf("  gain <n>   - Set the output level, 0-100%%\n");
         printf("  scan       - Scan I2C bus for devices\n");
         printf("  test       - Test display output\n");
         printf("  testall [n]- Run all RPN VM unit tests (optional: n samples)\n");
         printf("  testcase n - Run specific test case by index\n");
         printf("  testlist   - List all available test cases\n");
+        printf("  bench [n]  - Measure VM ns/sample per test case (default 100000)\n");
         printf("  slow       - Set I2C to 100kHz (for troubleshooting)\n");
         printf("  fast       - Set I2C to 400kHz (default)\n");
         printf("  pins       - Show alternative pin options\n");
@@ -180,6 +250,7 @@ void process_command(char* cmd) {
         printf("  expr t*(0xdeadbeef>>(t>>11)&15)/2|t>>3|t>>(t>>10)\n");
         printf("  load 1\n");
         printf("  save 3\n");
+        printf("  rate 11025\n");
         printf("  testall 5000\n");
         printf("  testcase 0\n");
     } else if (strncmp(cmd, "load ", 5) == 0) {
@@ -235,7 +306,9 @@ void check_serial_input() {
     }
 }
 
-void core1_main() {
+// Core 0: serial, keyboard, compilation, display and flash. Nothing here
+// can stall the audio, which runs on core 1 with its own interrupts.
+static void ui_main(void) {
     printf("\n=== Bytebeat Pocket for Raspberry Pico ===\n");
     printf("RPN VM Compiler and Audio System Ported\n");
     printf("Keyboard matrix enabled\n");
@@ -249,11 +322,15 @@ void core1_main() {
     static uint32_t lastRepeatTime = 0;
     static bool repeatStarted = false;
 
+    // In parallel mode the audio engine posts blocks for this core; pick
+    // them up between the UI steps
     while (true) {
         check_serial_input();
+        audio_help();
         
         // Scan keyboard matrix
         keyboard_scan();
+        audio_help();
         
         // Get currently pressed key
         uint8_t k = keyboard_get_pressed_key();
@@ -298,36 +375,32 @@ void core1_main() {
         
         // Handle recompilation when key is released
         if (k == 255 && needsRecompile) {
-            // Determine which buffer is inactive
-            struct ProgramBuffer* current = (struct ProgramBuffer*)active_program;
-            struct ProgramBuffer* next = (current == &program_buffers[0]) ? 
-                                          &program_buffers[1] : &program_buffers[0];
-            
-            // Compile to RPN
-            uint8_t len = compileToRPN(next->program);
-            next->length = (compileError == ERR_NONE) ? len : 0;
-            
-            if (needsResetT) {
-                t_audio = 0;
-                needsResetT = false;
-            }
-            
-            // Atomic pointer swap
-            __atomic_store_n(&active_program, next, __ATOMIC_RELEASE);
+            // Compile into the buffer the engine cannot be reading, then
+            // hand it over together with the t reset
+            compile_program(audio_program_buffer());
+            hand_over_program();
             
             needsRecompile = false;
             oledDirty = true;
+            audio_help();
         }
         
         ui_update();
-        tight_loop_contents();
+        audio_help();
     }
 }
 
+// Core 1: the audio engine. It renders blocks ahead and takes the output
+// interrupt; flash writes on core 0 pause it through flash_safe_execute().
+static void audio_core_main(void) {
+    flash_safe_execute_core_init();
+    audio_run(audio_render);
+}
+
 int main() {
-    // Initialize program buffers
-    program_buffers[0].length = 0;
-    program_buffers[1].length = 0;
+    // Initialize program buffers; the engine starts with the empty first one
+    for (int i = 0; i < 3; i++) program_buffers[i].program.length = 0;
+    audio_init_programs(&program_buffers[0], &program_buffers[1], &program_buffers[2]);
 
     set_sys_clock_khz(125000, true);
     stdio_init_all();
@@ -372,22 +445,13 @@ int main() {
     
     // Compile initial expression
     if (needsRecompile) {
-        uint8_t len = compileToRPN(program_buffers[0].program);
-        program_buffers[0].length = (compileError == ERR_NONE) ? len : 0;
-        if (needsResetT) {
-            t_audio = 0;
-            needsResetT = false;
-        }
+        struct ProgramBuffer* buf = audio_program_buffer();
+        compile_program(buf);
+        hand_over_program();
         needsRecompile = false;
-        printf("Initial expression compiled, length: %d\n", program_buffers[0].length);
+        printf("Initial expression compiled, length: %d\n", buf->program.length);
     }
 
-    static struct repeating_timer timer;
-    add_repeating_timer_us(-SAMPLE_US, audio_cb, NULL, &timer);
-
-    multicore_launch_core1(core1_main);
-    
-    while (true) {
-        tight_loop_contents();
-    }
+    multicore_launch_core1(audio_core_main);
+    ui_main();
 }
@@ -3,24 +3,11 @@
 #include "rpn_vm.h"
 #include "display.h"
 #include "hardware/flash.h"
-#include "hardware/sync.h"
+#include "pico/flash.h"
 #include "pico/stdlib.h"
 #include <string.h>
 #include <stdio.h>
 
-// Factory presets (same as Arduino version)
-const char* const factoryPresets[PRESET_COUNT] = {
-    "t*(42&t>>10)",
-    "t*((t>>12)|(t>>8))",
-    "t*(0xdeadbeef>>(t>>11)&15)/2|t>>3|t>>(t>>10)",
-    "",
-    "",
-    "",
-    "",
-    "",
-    ""
-};
-
 // Flash storage configuration
 // Store presets in the last sector of flash (2MB - 4KB)
 // Pico has 2MB flash, we'll use the last 4KB sector for presets
@@ -30,18 +17,30 @@ const char* const factoryPresets[PRESET_COUNT] = {
 // Marker to indicate empty slot
 #define EMPTY_MARKER 0xFF
 
+// Flash operations run through flash_safe_execute(), which parks the audio
+// core in RAM while the flash cannot be read. The output keeps repeating the
+// last two queued blocks meanwhile.
+static void erase_sector(void* param) {
+    (void)param;
+    flash_range_erase(FLASH_TARGET_OFFSET, FLASH_SECTOR_SIZE);
+}
+
+static void write_sector(void* buffer) {
+    flash_range_erase(FLASH_TARGET_OFFSET, FLASH_SECTOR_SIZE);
+    flash_range_program(FLASH_TARGET_OFFSET, buffer, FLASH_SECTOR_SIZE);
+}
+
 void preset_init(void) {
     printf("Preset system initialized (using flash storage)\n");
     printf("Flash offset: 0x%X\n", FLASH_TARGET_OFFSET);
 }
 
 void preset_clear_all(void) {
-    uint32_t ints = save_and_disable_interrupts();
-    
     // Erase the entire sector
-    flash_range_erase(FLASH_TARGET_OFFSET, FLASH_SECTOR_SIZE);
-    
-    restore_interrupts(ints);
+    if (flash_safe_execute(erase_sector, NULL, UINT32_MAX) != PICO_OK) {
+        printf("Could not clear presets\n");
+        return;
+    }
     
     printf("All presets cleared from flash\n");
 }
@@ -124,15 +123,10 @@ bool preset_save(uint8_t slot, const char* exprBuffer) {
     slot_ptr[len] = '\0';
     
     // Write back to flash
-    uint32_t ints = save_and_disable_interrupts();
-    
-    // Erase sector
-    flash_range_erase(FLASH_TARGET_OFFSET, FLASH_SECTOR_SIZE);
-    
-    // Program sector
-    flash_range_program(FLASH_TARGET_OFFSET, buffer, FLASH_SECTOR_SIZE);
-    
-    restore_interrupts(ints);
+    if (flash_safe_execute(write_sector, buffer, UINT32_MAX) != PICO_OK) {
+        printf("Could not save preset %d\n", slot + 1);
+        return false;
+    }
     
     current_slot = slot;
     printf("Saved preset %d to flash: %s\n", slot + 1, exprBuffer);
@@ -0,0 +1,15 @@
+#include "preset.h"
+
+// Factory presets (same as Arduino version). Kept apart from the flash code
+// in preset.c so host builds can use them.
+const char* const factoryPresets[PRESET_COUNT] = {
+    "t*(42&t>>10)",
+    "t*((t>>12)|(t>>8))",
+    "t*(0xdeadbeef>>(t>>11)&15)/2|t>>3|t>>(t>>10)",
+    "",
+    "",
+    "",
+    "",
+    "",
+    ""
+};
@@ -0,0 +1,14 @@
+#include "preset_native.h"
+#include <string.h>
+
+const struct NativePreset* findNativePreset(const struct RpnProgram* program) {
+  for (uint8_t i = 0; i < nativePresetCount; i++) {
+    const struct NativePreset* preset = &nativePresets[i];
+    if (preset->length == program->length && preset->poolSize == program->poolSize &&
+        memcmp(preset->code, program->code, program->length) == 0 &&
+        memcmp(preset->pool, program->pool, program->poolSize * sizeof(uint32_t)) == 0) {
+      return preset;
+    }
+  }
+  return NULL;
+}
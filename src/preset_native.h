@@ -0,0 +1,24 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "rpn_vm.h"
+#include "rpn_jit.h"
+
+// Factory presets compiled to C at build time by presetgen_main.c, keyed by
+// the bytecode compileToRPN() produced for them
+struct NativePreset {
+  uint8_t slot; // index into factoryPresets
+  uint16_t length;
+  uint8_t poolSize;
+  const uint8_t* code;
+  const uint32_t* pool;
+  RpnJitFn render; // renders like executeRPNBlock()
+};
+
+// Generated table (preset_native_gen.c)
+extern const struct NativePreset nativePresets[];
+extern const uint8_t nativePresetCount;
+
+// The factory preset that compiles to program, NULL if the program is not
+// one of them
+const struct NativePreset* findNativePreset(const struct RpnProgram* program);
@@ -0,0 +1,97 @@
+#include "rpn_batch.h"
+#include "rpn_compile.h"
+#include <string.h>
+
+#ifndef RPN_BATCH_THREADS
+#if defined(_MSC_VER)
+#define RPN_BATCH_THREADS 0
+#else
+#define RPN_BATCH_THREADS 1
+#endif
+#endif
+
+#if RPN_BATCH_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#define SHARED _Atomic
+#else
+#define SHARED
+#endif
+
+#define MAX_BATCH_THREADS 256
+
+// Workers claim expressions one at a time; every one has its own compiler
+struct BatchJob {
+  const char* const* texts;
+  uint32_t count;
+  uint32_t outputMask;
+  struct RpnProgram* programs;
+  struct RpnCompileResult* results;
+  SHARED uint32_t next;
+};
+
+static void* batchWorker(void* arg) {
+  struct BatchJob* job = arg;
+  struct RpnCompiler compiler;
+  initRPNCompiler(&compiler, job->outputMask);
+
+  for (uint32_t i = job->next++; i < job->count; i = job->next++) {
+    struct RpnCompileResult* result = &job->results[i];
+    size_t length = strlen(job->texts[i]);
+    if (length > UINT16_MAX) {
+      // Far past RPN_COMPILE_SIZE instructions anyway
+      job->programs[i].length = 0;
+      result->length = 0;
+      result->error = ERR_PROGRAM_TOO_LONG;
+      result->errorPos = UINT16_MAX;
+      result->rawLength = 0;
+      continue;
+    }
+
+    result->length = compileRPN(job->texts[i], (uint16_t)length, &job->programs[i], &compiler);
+    result->error = compiler.error;
+    result->errorPos = compiler.errorPos;
+    result->rawLength = compiler.rawLength;
+  }
+  return NULL;
+}
+
+void compileRPNBatch(const char* const* texts, uint32_t count, uint32_t outputMask,
+                     struct RpnProgram* programs, struct RpnCompileResult* results,
+                     uint32_t threads) {
+  struct BatchJob job = {
+    .texts = texts,
+    .count = count,
+    .outputMask = outputMask,
+    .programs = programs,
+    .results = results,
+    .next = 0,
+  };
+  uint32_t started = 0;
+
+#if RPN_BATCH_THREADS
+#ifdef _SC_NPROCESSORS_ONLN
+  if (threads == 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = online > 0 ? (uint32_t)online : 1;
+  }
+#endif
+  if (threads > MAX_BATCH_THREADS) threads = MAX_BATCH_THREADS;
+  if (threads > count) threads = count;
+
+  // A single worker runs on the calling thread
+  pthread_t workers[MAX_BATCH_THREADS];
+  while (threads > 1 && started < threads &&
+         pthread_create(&workers[started], NULL, batchWorker, &job) == 0) {
+    started++;
+  }
+#else
+  (void)threads;
+#endif
+  if (started == 0) batchWorker(&job);
+#if RPN_BATCH_THREADS
+  for (uint32_t i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+#endif
+}
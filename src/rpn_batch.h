@@ -0,0 +1,21 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "rpn_vm.h"
+
+// Host-only: compile many expressions on worker threads (POSIX threads; MSVC
+// builds compile on the calling thread)
+
+struct RpnCompileResult {
+  uint16_t length;         // bytecode length, 0 on error
+  enum CompileError error;
+  uint16_t errorPos;       // offset of the offending character on error
+  uint8_t rawLength;       // instructions before optimization
+};
+
+// Compile texts[0..count) (NUL-terminated) into programs[] and results[],
+// preserving the result bits in outputMask. threads == 0 uses one thread per
+// online CPU. Results do not depend on the thread count.
+void compileRPNBatch(const char* const* texts, uint32_t count, uint32_t outputMask,
+                     struct RpnProgram* programs, struct RpnCompileResult* results,
+                     uint32_t threads);
@@ -0,0 +1,27 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "rpn_vm.h"
+#include "rpn_ir.h"
+
+// Everything one compilation works on. compileRPN() touches no global state,
+// so threads can compile concurrently as long as each has its own
+// RpnCompiler. About 10 KB: keep it off small stacks.
+struct RpnCompiler {
+  uint32_t outputMask;      // result bits to preserve, set before compiling
+  // Results of the last compileRPN()
+  enum CompileError error;
+  uint16_t errorPos;        // offset of the offending character on error
+  uint8_t rawLength;        // instructions before optimization
+  // Scratch
+  struct RpnIr ir;
+  struct RpnInstruction code[RPN_COMPILE_SIZE];
+};
+
+// Set up a compiler that preserves the result bits in outputMask
+// (RPN_OUTPUT_MASK for audio, 0xFFFFFFFF for the full value)
+void initRPNCompiler(struct RpnCompiler* compiler, uint32_t outputMask);
+// Compile at most length characters of text (less if it has a NUL) like
+// compileToRPN(). Returns the bytecode length, 0 (and an empty dst) on error.
+uint16_t compileRPN(const char* text, uint16_t length, struct RpnProgram* dst,
+                    struct RpnCompiler* compiler);
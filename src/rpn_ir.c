@@ -0,0 +1,580 @@
+#include "rpn_ir.h"
+#include <string.h>
+
+// Builds the IR: node constructors that simplify as they go, the expression
+// parser, lifting of compiled RPN back to IR, and the RPN emitter.
+
+static bool isBinary(uint8_t opcode) {
+  return opcode != RPN_PUSH_T && opcode != RPN_PUSH_NUM &&
+         opcode != RPN_NOT && opcode != RPN_NEG;
+}
+
+bool irIsCommutative(uint8_t opcode) {
+  switch (opcode) {
+    case RPN_ADD: case RPN_MUL: case RPN_AND: case RPN_OR:
+    case RPN_XOR: case RPN_EQ:  case RPN_NE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+uint8_t irMirroredOpcode(uint8_t opcode) {
+  if (irIsCommutative(opcode)) return opcode;
+  switch (opcode) {
+    case RPN_LT: return RPN_GT;
+    case RPN_GT: return RPN_LT;
+    case RPN_LE: return RPN_GE;
+    case RPN_GE: return RPN_LE;
+    default:     return RPN_OPCODE_COUNT;
+  }
+}
+
+static bool isAssociative(uint8_t opcode) {
+  switch (opcode) {
+    case RPN_ADD: case RPN_MUL: case RPN_AND: case RPN_OR: case RPN_XOR:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Same semantics as executeRPN()
+static uint32_t foldBinary(uint8_t opcode, uint32_t a, uint32_t b) {
+  switch (opcode) {
+    case RPN_ADD: return a + b;
+    case RPN_SUB: return a - b;
+    case RPN_MUL: return a * b;
+    case RPN_DIV: return b ? a / b : 0;
+    case RPN_MOD: return b ? a % b : 0;
+    case RPN_AND: return a & b;
+    case RPN_OR:  return a | b;
+    case RPN_XOR: return a ^ b;
+    case RPN_SHL: return a << (b & 31);
+    case RPN_SHR: return a >> (b & 31);
+    case RPN_LT:  return a < b;
+    case RPN_GT:  return a > b;
+    case RPN_EQ:  return a == b;
+    case RPN_LE:  return a <= b;
+    case RPN_GE:  return a >= b;
+    case RPN_NE:  return a != b;
+    default:      return 0;
+  }
+}
+
+void resetIR(struct RpnIr* ir) {
+  ir->count = 0;
+  ir->root = RPN_IR_NONE;
+  ir->rawLength = 0;
+  ir->orderCount = 0;
+}
+
+uint8_t irNode(struct RpnIr* ir, uint8_t opcode, uint8_t lhs, uint8_t rhs, uint32_t value) {
+  if (ir->count >= RPN_IR_MAX_NODES) return RPN_IR_NONE;
+  struct RpnIrNode* node = &ir->nodes[ir->count];
+  memset(node, 0, sizeof(*node));
+  node->opcode = opcode;
+  node->lhs = lhs;
+  node->rhs = rhs;
+  node->value = value;
+  node->cacheSlot = RPN_IR_NONE;
+  node->reg = RPN_IR_NONE;
+  return ir->count++;
+}
+
+uint8_t irConst(struct RpnIr* ir, uint32_t value) {
+  return irNode(ir, RPN_PUSH_NUM, RPN_IR_NONE, RPN_IR_NONE, value);
+}
+
+bool irIsConst(const struct RpnIr* ir, uint8_t n) {
+  return ir->nodes[n].opcode == RPN_PUSH_NUM;
+}
+
+static bool nodesEqual(const struct RpnIr* ir, uint8_t a, uint8_t b) {
+  if (a == b) return true;
+  if (ir->nodes[a].opcode != ir->nodes[b].opcode) return false;
+  switch (ir->nodes[a].opcode) {
+    case RPN_PUSH_T:   return true;
+    case RPN_PUSH_NUM: return ir->nodes[a].value == ir->nodes[b].value;
+    case RPN_NOT:
+    case RPN_NEG:      return nodesEqual(ir, ir->nodes[a].lhs, ir->nodes[b].lhs);
+    default:
+      return nodesEqual(ir, ir->nodes[a].lhs, ir->nodes[b].lhs) &&
+             nodesEqual(ir, ir->nodes[a].rhs, ir->nodes[b].rhs);
+  }
+}
+
+uint8_t irUnary(struct RpnIr* ir, uint8_t opcode, uint8_t a) {
+  if (irIsConst(ir, a)) {
+    uint32_t v = ir->nodes[a].value;
+    return irConst(ir, opcode == RPN_NOT ? ~v : (uint32_t)(-(int32_t)v));
+  }
+
+  // ~~x and --x
+  if (ir->nodes[a].opcode == opcode) return ir->nodes[a].lhs;
+
+  return irNode(ir, opcode, a, RPN_IR_NONE, 0);
+}
+
+uint8_t irBinary(struct RpnIr* ir, uint8_t opcode, uint8_t l, uint8_t r) {
+  if (irIsConst(ir, l) && irIsConst(ir, r)) {
+    return irConst(ir, foldBinary(opcode, ir->nodes[l].value, ir->nodes[r].value));
+  }
+
+  // Keep constants on the right so the rules below only check one side
+  if (irIsConst(ir, l)) {
+    uint8_t swapped = opcode;
+    switch (opcode) {
+      case RPN_LT: swapped = RPN_GT; break;
+      case RPN_GT: swapped = RPN_LT; break;
+      case RPN_LE: swapped = RPN_GE; break;
+      case RPN_GE: swapped = RPN_LE; break;
+      default: if (!irIsCommutative(opcode)) swapped = 0xFF; break;
+    }
+    if (swapped != 0xFF) {
+      uint8_t tmp = l; l = r; r = tmp;
+      opcode = swapped;
+    }
+  }
+
+  if (irIsConst(ir, l)) {
+    uint32_t c = ir->nodes[l].value;
+    // 0 << x, 0 >> x, 0 / x, 0 % x
+    if (c == 0 && (opcode == RPN_SHL || opcode == RPN_SHR ||
+                   opcode == RPN_DIV || opcode == RPN_MOD)) {
+      return l;
+    }
+    if (c == 0 && opcode == RPN_SUB) return irUnary(ir, RPN_NEG, r);
+  }
+
+  if (irIsConst(ir, r)) {
+    uint32_t c = ir->nodes[r].value;
+
+    // x - c => x + (-c), so constant chains only need to reassociate ADD
+    if (opcode == RPN_SUB) {
+      opcode = RPN_ADD;
+      c = 0u - c;
+      r = irConst(ir, c);
+      if (r == RPN_IR_NONE) return RPN_IR_NONE;
+    }
+
+    if ((opcode == RPN_SHL || opcode == RPN_SHR) && c > 31) {
+      c &= 31;
+      r = irConst(ir, c);
+      if (r == RPN_IR_NONE) return RPN_IR_NONE;
+    }
+
+    switch (opcode) {
+      case RPN_ADD: case RPN_OR: case RPN_XOR: case RPN_SHL: case RPN_SHR:
+        if (c == 0) return l;
+        break;
+      case RPN_MUL:
+        if (c == 0) return r;
+        if (c == 1) return l;
+        break;
+      case RPN_DIV:
+        if (c == 0) return r;
+        if (c == 1) return l;
+        break;
+      case RPN_MOD:
+        if (c == 0) return r;
+        if (c == 1) return irConst(ir, 0);
+        break;
+      case RPN_AND:
+        if (c == 0) return r;
+        if (c == 0xFFFFFFFF) return l;
+        break;
+      default:
+        break;
+    }
+    if (opcode == RPN_OR && c == 0xFFFFFFFF) return r;
+
+    // (x op c1) op c2 => x op (c1 op c2)
+    if (isAssociative(opcode) && ir->nodes[l].opcode == opcode && irIsConst(ir, ir->nodes[l].rhs)) {
+      uint8_t folded = irConst(ir, foldBinary(opcode, ir->nodes[ir->nodes[l].rhs].value, c));
+      if (folded == RPN_IR_NONE) return RPN_IR_NONE;
+      return irBinary(ir, opcode, ir->nodes[l].lhs, folded);
+    }
+
+    // (x >> c1) >> c2 => x >> (c1 + c2), or 0 once every bit is shifted out
+    if ((opcode == RPN_SHL || opcode == RPN_SHR) &&
+        ir->nodes[l].opcode == opcode && irIsConst(ir, ir->nodes[l].rhs)) {
+      uint32_t total = (ir->nodes[ir->nodes[l].rhs].value & 31) + c;
+      if (total > 31) return irConst(ir, 0);
+      uint8_t amount = irConst(ir, total);
+      if (amount == RPN_IR_NONE) return RPN_IR_NONE;
+      return irBinary(ir, opcode, ir->nodes[l].lhs, amount);
+    }
+  }
+
+  if (nodesEqual(ir, l, r)) {
+    switch (opcode) {
+      case RPN_SUB: case RPN_XOR: case RPN_MOD:
+      case RPN_NE:  case RPN_LT:  case RPN_GT:
+        return irConst(ir, 0);
+      case RPN_EQ: case RPN_LE: case RPN_GE:
+        return irConst(ir, 1);
+      case RPN_AND: case RPN_OR:
+        return l;
+      default:
+        break;
+    }
+  }
+
+  return irNode(ir, opcode, l, r, 0);
+}
+
+#define MAX_OP_STACK_SIZE 64
+#define OP_PAREN_OPEN  255
+#define OP_PAREN_CLOSE 254
+
+struct Parser {
+  struct RpnIr* ir;
+  uint8_t operands[RPN_COMPILE_SIZE];
+  uint8_t operandCount;
+};
+
+// Append one instruction of the literal program: an operand, or an operator
+// applied to the operands below it
+static enum CompileError parserEmit(struct Parser* p, uint8_t opcode, uint32_t value) {
+  struct RpnIr* ir = p->ir;
+  if (ir->rawLength >= RPN_COMPILE_SIZE) return ERR_PROGRAM_TOO_LONG;
+  ir->rawLength++;
+
+  uint8_t n;
+  if (opcode == RPN_PUSH_T || opcode == RPN_PUSH_NUM) {
+    n = irNode(ir, opcode, RPN_IR_NONE, RPN_IR_NONE, value);
+  } else if (!isBinary(opcode)) {
+    if (p->operandCount < 1) return ERR_STACK;
+    n = irUnary(ir, opcode, p->operands[--p->operandCount]);
+  } else {
+    if (p->operandCount < 2) return ERR_STACK;
+    uint8_t r = p->operands[--p->operandCount];
+    uint8_t l = p->operands[--p->operandCount];
+    n = irBinary(ir, opcode, l, r);
+  }
+
+  if (n == RPN_IR_NONE) return ERR_PROGRAM_TOO_LONG;
+  p->operands[p->operandCount++] = n;
+  return ERR_NONE;
+}
+
+static char charAt(const char* text, uint16_t length, uint16_t i) {
+  return i < length ? text[i] : '\0';
+}
+
+// Shunting-yard: operands go straight to the IR, operators wait on opStack
+// until everything binding tighter has been applied
+enum CompileError parseExpression(const char* text, uint16_t length, struct RpnIr* ir,
+                                  uint16_t* errorPos) {
+  struct Parser parser;
+  parser.ir = ir;
+  parser.operandCount = 0;
+  resetIR(ir);
+
+  uint8_t opStack[MAX_OP_STACK_SIZE];
+  uint8_t opStackTop = 0;
+  uint8_t numParentheses = 0;
+  bool expectOperand = true;
+  enum CompileError error = ERR_NONE;
+  uint16_t i = 0;
+
+#define FAIL(ERROR) \
+  do { \
+    *errorPos = i; \
+    return (ERROR); \
+  } while (0)
+
+#define EMIT(OPCODE, VALUE) \
+  do { \
+    error = parserEmit(&parser, (OPCODE), (VALUE)); \
+    if (error != ERR_NONE) FAIL(error); \
+  } while (0)
+
+  while (charAt(text, length, i) != '\0') {
+    char c = text[i];
+
+    if (ir->rawLength >= RPN_COMPILE_SIZE) FAIL(ERR_PROGRAM_TOO_LONG);
+
+    // Skip whitespace
+    if (c == ' ') {
+      i++;
+      continue;
+    }
+
+    // Numbers: decimal, 0x hex or 0b binary
+    if (c >= '0' && c <= '9') {
+      if (!expectOperand) FAIL(ERR_TOKEN);
+
+      uint32_t num = 0;
+      char next = c == '0' ? charAt(text, length, i + 1) : '\0';
+      if (next == 'x' || next == 'X') {
+        i += 2;
+        if (!isHexDigit(charAt(text, length, i))) FAIL(ERR_TOKEN);
+        while (isHexDigit(c = charAt(text, length, i))) {
+          uint8_t digit = c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+          num = (num << 4) | digit;
+          i++;
+        }
+      } else if (next == 'b' || next == 'B') {
+        i += 2;
+        c = charAt(text, length, i);
+        if (c != '0' && c != '1') FAIL(ERR_TOKEN);
+        while ((c = charAt(text, length, i)) == '0' || c == '1') {
+          num = (num << 1) | (c - '0');
+          i++;
+        }
+      } else {
+        while ((c = charAt(text, length, i)) >= '0' && c <= '9') {
+          num = num * 10 + (c - '0');
+          i++;
+        }
+      }
+
+      EMIT(RPN_PUSH_NUM, num);
+      expectOperand = false;
+      continue;
+    }
+
+    // Variable t
+    if (c == 't') {
+      if (!expectOperand) FAIL(ERR_TOKEN);
+      EMIT(RPN_PUSH_T, 0);
+      expectOperand = false;
+      i++;
+      continue;
+    }
+
+    // Operators and parentheses
+    uint8_t precedence = 0;
+    uint8_t opcode = 0;
+    bool rightAssoc = false;
+    bool isBinaryOp = false;
+    char next = charAt(text, length, i + 1);
+
+    switch (c) {
+      case '(':
+        if (!expectOperand) FAIL(ERR_TOKEN);
+        opcode = OP_PAREN_OPEN;
+        numParentheses++;
+        break;
+      case ')':
+        if (expectOperand) FAIL(ERR_PAREN);
+        if (numParentheses == 0) FAIL(ERR_TOKEN);
+        opcode = OP_PAREN_CLOSE;
+        numParentheses--;
+        break;
+      case '~':
+        if (!expectOperand) FAIL(ERR_TOKEN);
+        opcode = RPN_NOT;
+        rightAssoc = true;
+        break;
+      case '*': opcode = RPN_MUL; isBinaryOp = true; break;
+      case '/': opcode = RPN_DIV; isBinaryOp = true; break;
+      case '%': opcode = RPN_MOD; isBinaryOp = true; break;
+      case '+':
+        if (expectOperand) {
+          // Unary plus - just skip it
+          i++;
+          continue;
+        }
+        opcode = RPN_ADD;
+        isBinaryOp = true;
+        break;
+      case '-':
+        if (expectOperand) {
+          opcode = RPN_NEG;
+          rightAssoc = true;
+        } else {
+          opcode = RPN_SUB;
+          isBinaryOp = true;
+        }
+        break;
+      case '&': opcode = RPN_AND; isBinaryOp = true; break;
+      case '|': opcode = RPN_OR;  isBinaryOp = true; break;
+      case '^': opcode = RPN_XOR; isBinaryOp = true; break;
+      case '<':
+        if (next == '<') { opcode = RPN_SHL; i++; }
+        else if (next == '=') { opcode = RPN_LE; i++; }
+        else { opcode = RPN_LT; }
+        isBinaryOp = true;
+        break;
+      case '>':
+        if (next == '=') { opcode = RPN_GE; i++; }
+        else if (next == '>') { opcode = RPN_SHR; i++; }
+        else { opcode = RPN_GT; }
+        isBinaryOp = true;
+        break;
+      case '=': opcode = RPN_EQ; isBinaryOp = true; break;
+      default:
+        FAIL(ERR_TOKEN);
+    }
+
+    if (isBinaryOp) {
+      if (expectOperand) FAIL(ERR_TOKEN);
+      expectOperand = true;
+    }
+
+    if (opcode == OP_PAREN_OPEN) {
+      if (opStackTop >= MAX_OP_STACK_SIZE) FAIL(ERR_PROGRAM_TOO_LONG);
+      opStack[opStackTop++] = opcode;
+    } else if (opcode == OP_PAREN_CLOSE) {
+      // Apply everything back to the matching '('
+      while (opStackTop > 0 && opStack[opStackTop - 1] != OP_PAREN_OPEN) {
+        EMIT(opStack[--opStackTop], 0);
+      }
+      if (opStackTop > 0) opStackTop--;
+      expectOperand = false;
+    } else {
+      // Apply operators that bind at least as tightly (tighter for the
+      // right-associative unary ones)
+      precedence = getPrecedence(opcode);
+      while (opStackTop > 0 && opStack[opStackTop - 1] != OP_PAREN_OPEN &&
+             ((!rightAssoc && precedence <= getPrecedence(opStack[opStackTop - 1])) ||
+              (rightAssoc && precedence < getPrecedence(opStack[opStackTop - 1])))) {
+        EMIT(opStack[--opStackTop], 0);
+      }
+      if (opStackTop >= MAX_OP_STACK_SIZE) FAIL(ERR_PROGRAM_TOO_LONG);
+      opStack[opStackTop++] = opcode;
+    }
+    i++;
+  }
+
+  // Missing operand or closing parenthesis
+  if (expectOperand) FAIL(ERR_TOKEN);
+  if (numParentheses > 0) FAIL(ERR_PAREN);
+
+  while (opStackTop > 0) {
+    EMIT(opStack[--opStackTop], 0);
+  }
+  if (parser.operandCount != 1) FAIL(ERR_STACK);
+
+#undef EMIT
+#undef FAIL
+
+  ir->root = parser.operands[0];
+  return ERR_NONE;
+}
+
+bool liftRPN(const struct RpnInstruction* program, uint8_t program_len, struct RpnIr* ir) {
+  uint8_t stack[255];
+  uint8_t stackTop = 0;
+  uint8_t regNodes[RPN_REG_COUNT];
+  memset(regNodes, RPN_IR_NONE, sizeof(regNodes));
+  resetIR(ir);
+  ir->rawLength = program_len;
+
+  for (uint8_t pc = 0; pc < program_len; pc++) {
+    uint8_t opcode = program[pc].opcode;
+    uint8_t n;
+
+    // Cache markers, registers and operand order are recomputed by the passes
+    if (opcode == RPN_CACHE) continue;
+    if (opcode == RPN_SWAP) {
+      if (stackTop < 2) return false;
+      n = stack[stackTop - 1];
+      stack[stackTop - 1] = stack[stackTop - 2];
+      stack[stackTop - 2] = n;
+      continue;
+    }
+    if (opcode == RPN_STORE) {
+      if (stackTop < 1 || program[pc].value >= RPN_REG_COUNT) return false;
+      regNodes[program[pc].value] = stack[stackTop - 1];
+      continue;
+    }
+
+    if (opcode == RPN_DUP || opcode == RPN_LOAD) {
+      if (opcode == RPN_DUP && stackTop < 1) return false;
+      if (opcode == RPN_LOAD && program[pc].value >= RPN_REG_COUNT) return false;
+      n = opcode == RPN_DUP ? stack[stackTop - 1] : regNodes[program[pc].value];
+    } else if (opcode == RPN_PUSH_T || opcode == RPN_PUSH_NUM) {
+      n = irNode(ir, opcode, RPN_IR_NONE, RPN_IR_NONE,
+                 opcode == RPN_PUSH_NUM ? program[pc].value : 0);
+    } else if (opcode == RPN_DIVC || opcode == RPN_MODC) {
+      // Lift back to a plain divide so the program can be optimized again
+      if (stackTop < 2) return false;
+      stackTop--; // magic multiplier
+      uint8_t l = stack[--stackTop];
+      uint8_t d = irConst(ir, program[pc].value >> 5);
+      if (d == RPN_IR_NONE) return false;
+      n = irBinary(ir, opcode == RPN_DIVC ? RPN_DIV : RPN_MOD, l, d);
+    } else if (opcode >= RPN_OPCODE_COUNT) {
+      return false;
+    } else if (!isBinary(opcode)) {
+      if (stackTop < 1) return false;
+      n = irUnary(ir, opcode, stack[--stackTop]);
+    } else {
+      if (stackTop < 2) return false;
+      uint8_t r = stack[--stackTop];
+      uint8_t l = stack[--stackTop];
+      n = irBinary(ir, opcode, l, r);
+    }
+
+    // Out of nodes, or a load of a register that was never stored
+    if (n == RPN_IR_NONE) return false;
+    stack[stackTop++] = n;
+  }
+
+  if (stackTop != 1) return false;
+  ir->root = stack[0];
+  return true;
+}
+
+static uint16_t emitNode(struct RpnIr* ir, uint8_t n, struct RpnInstruction* program,
+                         uint16_t pc, uint16_t limit) {
+  struct RpnIrNode* node = &ir->nodes[n];
+
+#define EMIT(OPCODE, VALUE) \
+  do { \
+    if (program && pc < limit) { \
+      program[pc].opcode = (OPCODE); \
+      program[pc].value = (VALUE); \
+    } \
+    pc++; \
+  } while (0)
+
+  if (node->reg != RPN_IR_NONE && node->emitted) {
+    EMIT(RPN_LOAD, node->reg);
+    return pc;
+  }
+
+  uint16_t markerPc = pc;
+  if (node->cacheSlot != RPN_IR_NONE) pc++;
+
+  if (node->rightFirst) {
+    pc = emitNode(ir, node->rhs, program, pc, limit);
+    pc = emitNode(ir, node->lhs, program, pc, limit);
+    uint8_t mirrored = irMirroredOpcode(node->opcode);
+    if (mirrored == RPN_OPCODE_COUNT) {
+      EMIT(RPN_SWAP, 0);
+      EMIT(node->opcode, node->value);
+    } else {
+      EMIT(mirrored, node->value);
+    }
+  } else {
+    if (node->lhs != RPN_IR_NONE) pc = emitNode(ir, node->lhs, program, pc, limit);
+    if (node->rhs != RPN_IR_NONE && node->rhs == node->lhs) {
+      EMIT(RPN_DUP, 0);
+    } else if (node->rhs != RPN_IR_NONE) {
+      pc = emitNode(ir, node->rhs, program, pc, limit);
+    }
+    EMIT(node->opcode, node->value);
+  }
+
+  if (node->cacheSlot != RPN_IR_NONE && program && markerPc < limit) {
+    program[markerPc].opcode = RPN_CACHE;
+    program[markerPc].value = node->cacheSlot | ((uint32_t)node->shift << 8) |
+                              ((uint32_t)(pc - markerPc - 1) << 16);
+  }
+  if (node->reg != RPN_IR_NONE) EMIT(RPN_STORE, node->reg);
+  node->emitted = true;
+  return pc;
+
+#undef EMIT
+}
+
+uint16_t emitIR(struct RpnIr* ir, struct RpnInstruction* program, uint16_t limit) {
+  if (ir->root == RPN_IR_NONE) return 0;
+  for (uint8_t i = 0; i < ir->count; i++) ir->nodes[i].emitted = false;
+  return emitNode(ir, ir->root, program, 0, limit);
+}
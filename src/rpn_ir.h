@@ -0,0 +1,79 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "rpn_vm.h"
+
+// Expression IR shared by the parser, the optimizer passes (rpn_opt.h) and
+// the RPN emitter. Nodes live in a fixed arena inside struct RpnIr, so an IR
+// needs no allocation and separate IRs can be built and optimized
+// concurrently. Operands are node indices; a node may be the operand of
+// several parents once subtrees are shared, which makes the IR a DAG.
+
+#define RPN_IR_MAX_NODES 255
+#define RPN_IR_NONE 255 // no node (missing operand, annotation not set)
+
+struct RpnIrNode {
+  uint8_t opcode;    // RpnOpcode; leaves are RPN_PUSH_T and RPN_PUSH_NUM
+  uint8_t lhs;       // operands, RPN_IR_NONE if absent
+  uint8_t rhs;
+  uint32_t value;    // RPN_PUSH_NUM literal, RPN_DIVC/RPN_MODC encoding
+
+  // Annotations written by the passes and read by the emitter
+  uint8_t shift;     // subtree depends on t only through t >> shift
+  uint8_t cacheSlot; // RPN_CACHE slot, or RPN_IR_NONE
+  uint8_t reg;       // scratch register holding the value, or RPN_IR_NONE
+  uint8_t refs;      // parent edges in the DAG
+  uint8_t dups;      // parents using this node as both operands (x op x)
+  uint8_t need;      // stack entries needed to evaluate the subtree, 0 = unknown
+  bool rightFirst;   // emit the right operand first
+  bool known;        // knownZero/knownOne are computed
+  bool emitted;
+  uint32_t demanded; // result bits some parent uses
+  uint32_t knownZero;
+  uint32_t knownOne;
+};
+
+struct RpnIr {
+  struct RpnIrNode nodes[RPN_IR_MAX_NODES];
+  uint8_t count;      // nodes allocated so far
+  uint8_t root;       // result node, RPN_IR_NONE while empty
+  uint8_t rawLength;  // instructions of the literal, unoptimized program
+  uint32_t outputMask; // result bits the passes have to preserve
+  uint8_t capacity;   // instructions the emitted program may take
+  // Distinct nodes in post-order, filled in when subtrees are shared
+  uint8_t order[RPN_IR_MAX_NODES];
+  uint8_t orderCount;
+};
+
+// Empty the arena
+void resetIR(struct RpnIr* ir);
+
+// Node constructors. irUnary() and irBinary() fold constants and apply
+// algebraic identities (x*1, x|0, x^x, ~~x, ...) and reassociate constant
+// chains such as (t*3)*5 as nodes are created, so they may return an
+// existing node or a constant instead of a new node. All return RPN_IR_NONE
+// once the arena is full.
+uint8_t irNode(struct RpnIr* ir, uint8_t opcode, uint8_t lhs, uint8_t rhs, uint32_t value);
+uint8_t irConst(struct RpnIr* ir, uint32_t value);
+uint8_t irUnary(struct RpnIr* ir, uint8_t opcode, uint8_t a);
+uint8_t irBinary(struct RpnIr* ir, uint8_t opcode, uint8_t l, uint8_t r);
+bool irIsConst(const struct RpnIr* ir, uint8_t n);
+bool irIsCommutative(uint8_t opcode);
+// Opcode computing l op r from the operands pushed as r, l without a
+// RPN_SWAP, or RPN_OPCODE_COUNT if there is none
+uint8_t irMirroredOpcode(uint8_t opcode);
+
+// Parse at most length characters of text (less if it has a NUL) into ir.
+// Uses no global state. On error the IR is incomplete and *errorPos receives
+// the offset of the offending character (length for a missing operand or
+// parenthesis at the end).
+enum CompileError parseExpression(const char* text, uint16_t length, struct RpnIr* ir,
+                                  uint16_t* errorPos);
+// Build the IR of a compiled RPN program (RPN_CACHE markers, registers and
+// RPN_SWAP are resolved to plain operands); false if it is malformed or
+// does not fit the arena
+bool liftRPN(const struct RpnInstruction* program, uint8_t program_len, struct RpnIr* ir);
+// Emit the DAG below the root as RPN, following the annotations of the
+// passes. With program == NULL only the length is computed; instructions
+// past limit are counted but not written.
+uint16_t emitIR(struct RpnIr* ir, struct RpnInstruction* program, uint16_t limit);
@@ -0,0 +1,604 @@
+// MAP_ANONYMOUS is not in strict C11 mode
+#define _DEFAULT_SOURCE
+#include "rpn_jit.h"
+#include <string.h>
+#include <stdlib.h>
+
+#if RPN_JIT != RPN_JIT_NONE && (defined(__unix__) || defined(__APPLE__))
+#include <sys/mman.h>
+#define JIT_MMAP 1
+#else
+#define JIT_MMAP 0
+#endif
+
+// Template JIT: every opcode becomes a fixed instruction sequence. A verified
+// program has a static stack depth at every instruction, so stack slot i
+// lives in register slotReg[i] and no stack memory is touched except for the
+// RPN_STORE/RPN_LOAD registers, which sit in the native stack frame. The
+// generated function loops over the block itself:
+//
+//   for (; n; n--, t0++) *out++ = (uint8_t)program(t0);
+
+#if RPN_JIT != RPN_JIT_NONE
+
+struct JitBuffer {
+  uint8_t* code;
+  uint32_t size;
+  bool overflow;
+};
+
+static void emit8(struct JitBuffer* b, uint8_t v) {
+  if (b->size >= RPN_JIT_CODE_SIZE) {
+    b->overflow = true;
+    return;
+  }
+  b->code[b->size++] = v;
+}
+
+#endif
+
+#if RPN_JIT == RPN_JIT_X86_64
+
+// ============================================================================
+// x86-64 (System V: t0 in edi, n in esi, out in rdx)
+// ============================================================================
+
+enum {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// eax, ecx and edx stay free for division and shift counts
+static const uint8_t slotReg[RPN_STACK_SIZE] = {RBX, RSI, RDI, R8, R9, R10, R11, R12};
+#define REG_T R14
+#define REG_OUT R15
+#define REG_COUNT RBP
+
+static void emit32(struct JitBuffer* b, uint32_t v) {
+  for (int i = 0; i < 4; i++) emit8(b, (uint8_t)(v >> (8 * i)));
+}
+
+// op with a register-direct ModRM; reg may be an opcode extension (/digit)
+static void x86Op(struct JitBuffer* b, uint8_t op, uint8_t reg, uint8_t rm) {
+  uint8_t rex = 0x40 | ((reg >> 3) & 1) << 2 | ((rm >> 3) & 1);
+  if (rex != 0x40) emit8(b, rex);
+  emit8(b, op);
+  emit8(b, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// Two-byte 0F xx opcode with a register-direct ModRM
+static void x86Op0F(struct JitBuffer* b, uint8_t op, uint8_t reg, uint8_t rm) {
+  uint8_t rex = 0x40 | ((reg >> 3) & 1) << 2 | ((rm >> 3) & 1);
+  if (rex != 0x40) emit8(b, rex);
+  emit8(b, 0x0F);
+  emit8(b, op);
+  emit8(b, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+static void x86MovImm(struct JitBuffer* b, uint8_t reg, uint32_t v) {
+  if (reg >= 8) emit8(b, 0x41);
+  emit8(b, 0xB8 + (reg & 7));
+  emit32(b, v);
+}
+
+// mov [rsp + disp], reg (op 0x89) or mov reg, [rsp + disp] (op 0x8B)
+static void x86StackSlot(struct JitBuffer* b, uint8_t op, uint8_t reg, uint8_t disp) {
+  if (reg >= 8) emit8(b, 0x44);
+  emit8(b, op);
+  emit8(b, 0x44 | (reg & 7) << 3);
+  emit8(b, 0x24);
+  emit8(b, disp);
+}
+
+static void patchRel8(struct JitBuffer* b, uint32_t at) {
+  if (!b->overflow) b->code[at - 1] = (uint8_t)(b->size - at);
+}
+
+static void patchRel32(struct JitBuffer* b, uint32_t at, uint32_t target) {
+  if (b->overflow) return;
+  uint32_t rel = target - at;
+  memcpy(b->code + at - 4, &rel, 4);
+}
+
+static uint32_t emitPrologue(struct JitBuffer* b, uint32_t* skipPatch) {
+  static const uint8_t prologue[] = {
+    0x53, 0x55, 0x41, 0x54, 0x41, 0x56, 0x41, 0x57, // push rbx, rbp, r12, r14, r15
+    0x48, 0x83, 0xEC, 0x18,                         // sub rsp, 24 (registers)
+    0x41, 0x89, 0xFE,                               // mov r14d, edi
+    0x89, 0xF5,                                     // mov ebp, esi
+    0x49, 0x89, 0xD7,                               // mov r15, rdx
+    0x85, 0xED,                                     // test ebp, ebp
+    0x0F, 0x84, 0, 0, 0, 0                          // jz end
+  };
+  for (uint32_t i = 0; i < sizeof(prologue); i++) emit8(b, prologue[i]);
+  *skipPatch = b->size;
+  return b->size;
+}
+
+static void emitEpilogue(struct JitBuffer* b, uint8_t depth, uint32_t loop, uint32_t skipPatch) {
+  if (depth > 0) {
+    x86Op(b, 0x89, slotReg[depth - 1], RAX);   // mov eax, result
+  } else {
+    x86Op(b, 0x31, RAX, RAX);                  // xor eax, eax
+  }
+  static const uint8_t next[] = {
+    0x41, 0x88, 0x07,                          // mov [r15], al
+    0x49, 0xFF, 0xC7,                          // inc r15
+    0x41, 0xFF, 0xC6,                          // inc r14d
+    0xFF, 0xCD,                                // dec ebp
+    0x0F, 0x85, 0, 0, 0, 0                     // jnz loop
+  };
+  for (uint32_t i = 0; i < sizeof(next); i++) emit8(b, next[i]);
+  patchRel32(b, b->size, loop);
+  patchRel32(b, skipPatch, b->size);
+
+  static const uint8_t epilogue[] = {
+    0x48, 0x83, 0xC4, 0x18,                   // add rsp, 24
+    0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5C, 0x5D, 0x5B, // pop r15, r14, r12, rbp, rbx
+    0xC3                                      // ret
+  };
+  for (uint32_t i = 0; i < sizeof(epilogue); i++) emit8(b, epilogue[i]);
+}
+
+// Quotient of a by the magic in b (see divideByMagic()) into eax
+static void emitMagicQuotient(struct JitBuffer* b, uint8_t a, uint8_t m, uint32_t encoded) {
+  x86Op(b, 0x89, a, RAX);       // mov eax, a
+  x86Op(b, 0xF7, 4, m);         // mul m: edx = high half
+  x86Op(b, 0x89, a, RAX);       // mov eax, a
+  x86Op(b, 0x29, RDX, RAX);     // sub eax, edx
+  x86Op(b, 0xD1, 5, RAX);       // shr eax, 1
+  x86Op(b, 0x01, RDX, RAX);     // add eax, edx
+  if (encoded & 31) {
+    x86Op(b, 0xC1, 5, RAX);     // shr eax, shift
+    emit8(b, encoded & 31);
+  }
+}
+
+static void emitOp(struct JitBuffer* b, uint8_t opcode, uint32_t value, uint8_t depth) {
+  uint8_t top = depth > 0 ? slotReg[depth - 1] : RAX;
+  uint8_t a = depth > 1 ? slotReg[depth - 2] : RAX; // binary: a op top -> a
+  uint8_t push = depth < RPN_STACK_SIZE ? slotReg[depth] : RAX;
+
+  switch (opcode) {
+    case RPN_PUSH_T:   x86Op(b, 0x89, REG_T, push); break;
+    case RPN_PUSH_NUM: x86MovImm(b, push, value); break;
+    case RPN_DUP:      x86Op(b, 0x89, top, push); break;
+    case RPN_SWAP:     x86Op(b, 0x87, top, a); break;
+    case RPN_STORE:    x86StackSlot(b, 0x89, top, 4 * value); break;
+    case RPN_LOAD:     x86StackSlot(b, 0x8B, push, 4 * value); break;
+    case RPN_NOT:      x86Op(b, 0xF7, 2, top); break;
+    case RPN_NEG:      x86Op(b, 0xF7, 3, top); break;
+    case RPN_ADD:      x86Op(b, 0x01, top, a); break;
+    case RPN_SUB:      x86Op(b, 0x29, top, a); break;
+    case RPN_AND:      x86Op(b, 0x21, top, a); break;
+    case RPN_OR:       x86Op(b, 0x09, top, a); break;
+    case RPN_XOR:      x86Op(b, 0x31, top, a); break;
+    case RPN_MUL:      x86Op0F(b, 0xAF, a, top); break;
+
+    case RPN_SHL:
+    case RPN_SHR:
+      // The count is masked to 5 bits by the CPU, as in the interpreters
+      x86Op(b, 0x89, top, RCX);                          // mov ecx, top
+      x86Op(b, 0xD3, opcode == RPN_SHL ? 4 : 5, a);      // shl/shr a, cl
+      break;
+
+    case RPN_DIV:
+    case RPN_MOD: {
+      x86Op(b, 0x85, top, top);                          // test top, top
+      emit8(b, 0x74); emit8(b, 0);                       // jz zero
+      uint32_t zero = b->size;
+      x86Op(b, 0x89, a, RAX);                            // mov eax, a
+      x86Op(b, 0x31, RDX, RDX);                          // xor edx, edx
+      x86Op(b, 0xF7, 6, top);                            // div top
+      x86Op(b, 0x89, opcode == RPN_DIV ? RAX : RDX, a);  // mov a, eax/edx
+      emit8(b, 0xEB); emit8(b, 0);                       // jmp done
+      uint32_t done = b->size;
+      patchRel8(b, zero);
+      x86Op(b, 0x31, a, a);                              // zero: xor a, a
+      patchRel8(b, done);
+      break;
+    }
+
+    case RPN_DIVC:
+      emitMagicQuotient(b, a, top, value);
+      x86Op(b, 0x89, RAX, a);                            // mov a, eax
+      break;
+
+    case RPN_MODC:
+      emitMagicQuotient(b, a, top, value);
+      x86Op(b, 0x69, RAX, RAX);                          // imul eax, eax, divisor
+      emit32(b, value >> 5);
+      x86Op(b, 0x29, RAX, a);                            // sub a, eax
+      break;
+
+    case RPN_LT: case RPN_GT: case RPN_EQ:
+    case RPN_LE: case RPN_GE: case RPN_NE: {
+      // Unsigned setcc: b, a, e, be, ae, ne
+      static const uint8_t setcc[] = {0x92, 0x97, 0x94, 0x96, 0x93, 0x95};
+      x86Op(b, 0x39, top, a);                            // cmp a, top
+      x86Op0F(b, setcc[opcode - RPN_LT], 0, RAX);        // setcc al
+      x86Op0F(b, 0xB6, a, RAX);                          // movzx a, al
+      break;
+    }
+  }
+}
+
+// top = top op imm for a constant second operand; false if opcode has no
+// immediate form
+static bool emitOpImm(struct JitBuffer* b, uint8_t opcode, uint32_t imm, uint8_t depth) {
+  uint8_t top = slotReg[depth - 1];
+
+  switch (opcode) {
+    // Group 1: 0x81 /digit id
+    case RPN_ADD: x86Op(b, 0x81, 0, top); emit32(b, imm); return true;
+    case RPN_OR:  x86Op(b, 0x81, 1, top); emit32(b, imm); return true;
+    case RPN_AND: x86Op(b, 0x81, 4, top); emit32(b, imm); return true;
+    case RPN_SUB: x86Op(b, 0x81, 5, top); emit32(b, imm); return true;
+    case RPN_XOR: x86Op(b, 0x81, 6, top); emit32(b, imm); return true;
+    case RPN_MUL:
+      x86Op(b, 0x69, top, top);                          // imul top, top, imm
+      emit32(b, imm);
+      return true;
+    case RPN_SHL:
+    case RPN_SHR:
+      if (imm & 31) {
+        x86Op(b, 0xC1, opcode == RPN_SHL ? 4 : 5, top);  // shl/shr top, imm
+        emit8(b, imm & 31);
+      }
+      return true;
+    default:
+      return false;
+  }
+}
+
+#elif RPN_JIT == RPN_JIT_THUMB2
+
+// ============================================================================
+// Thumb-2 (AAPCS: t0 in r0, n in r1, out in r2)
+// ============================================================================
+
+// ip (r12) and lr are scratch
+static const uint8_t slotReg[RPN_STACK_SIZE] = {3, 4, 5, 6, 7, 8, 9, 10};
+#define REG_IP 12
+#define REG_LR 14
+
+enum {
+  COND_EQ = 0, COND_NE = 1, COND_HS = 2, COND_LO = 3, COND_HI = 8, COND_LS = 9
+};
+
+static void t16(struct JitBuffer* b, uint16_t h) {
+  emit8(b, h & 0xFF);
+  emit8(b, h >> 8);
+}
+
+static void t32(struct JitBuffer* b, uint16_t hi, uint16_t lo) {
+  t16(b, hi);
+  t16(b, lo);
+}
+
+static void thumbMov(struct JitBuffer* b, uint8_t rd, uint8_t rm) {
+  t16(b, 0x4600 | (rd >> 3) << 7 | rm << 3 | (rd & 7));
+}
+
+// Data processing with a register operand: rd = rn op rm
+static void thumbDataReg(struct JitBuffer* b, uint16_t op, uint8_t rd, uint8_t rn, uint8_t rm) {
+  t32(b, op | rn, rd << 8 | rm);
+}
+#define THUMB_AND 0xEA00
+#define THUMB_ORR 0xEA40
+#define THUMB_EOR 0xEA80
+#define THUMB_ADD 0xEB00
+#define THUMB_SUB 0xEBA0
+
+// rd = rm << shift (type 0) or rm >> shift (type 1), 1 <= shift <= 31
+static void thumbShiftImm(struct JitBuffer* b, uint8_t type, uint8_t rd, uint8_t rm,
+                          uint8_t shift) {
+  t32(b, 0xEA4F, (shift >> 2) << 12 | rd << 8 | (shift & 3) << 6 | type << 4 | rm);
+}
+#define THUMB_LSL 0
+#define THUMB_LSR 1
+
+// MOV.W rd, #imm8 (flags unchanged)
+static void thumbMovSmall(struct JitBuffer* b, uint8_t rd, uint8_t imm) {
+  t32(b, 0xF04F, rd << 8 | imm);
+}
+
+// MOVW (op 0xF240) or MOVT (op 0xF2C0)
+static void thumbMovHalf(struct JitBuffer* b, uint16_t op, uint8_t rd, uint16_t imm) {
+  t32(b, op | ((imm >> 11) & 1) << 10 | imm >> 12,
+      ((imm >> 8) & 7) << 12 | rd << 8 | (imm & 0xFF));
+}
+
+static void thumbMovImm(struct JitBuffer* b, uint8_t rd, uint32_t v) {
+  thumbMovHalf(b, 0xF240, rd, v & 0xFFFF);
+  if (v >> 16) thumbMovHalf(b, 0xF2C0, rd, v >> 16);
+}
+
+// IT block covering the next instruction only
+static void thumbIt(struct JitBuffer* b, uint8_t cond) {
+  t16(b, 0xBF08 | cond << 4);
+}
+
+// Conditional branch B<cond>.W at pc to target
+static void thumbBranchAt(struct JitBuffer* b, uint32_t at, uint8_t cond, uint32_t target) {
+  if (b->overflow) return;
+  int32_t offset = (int32_t)target - (int32_t)(at + 4);
+  uint32_t imm = (uint32_t)offset;
+  uint16_t hi = 0xF000 | ((imm >> 20) & 1) << 10 | cond << 6 | ((imm >> 12) & 0x3F);
+  uint16_t lo = 0x8000 | ((imm >> 18) & 1) << 13 | ((imm >> 19) & 1) << 11 | ((imm >> 1) & 0x7FF);
+  b->code[at] = hi & 0xFF;
+  b->code[at + 1] = hi >> 8;
+  b->code[at + 2] = lo & 0xFF;
+  b->code[at + 3] = lo >> 8;
+}
+
+static uint32_t emitPrologue(struct JitBuffer* b, uint32_t* skipPatch) {
+  t32(b, 0xE92D, 0x4FF0);        // push {r4-r11, lr}
+  t16(b, 0xB084);                // sub sp, #16 (registers)
+  t16(b, 0x2900);                // cmp r1, #0
+  *skipPatch = b->size;
+  t32(b, 0, 0);                  // beq end
+  return b->size;
+}
+
+static void emitEpilogue(struct JitBuffer* b, uint8_t depth, uint32_t loop, uint32_t skipPatch) {
+  uint8_t result = REG_IP;
+  if (depth > 0) {
+    result = slotReg[depth - 1];
+  } else {
+    thumbMovSmall(b, REG_IP, 0);
+  }
+  t32(b, 0xF802, result << 12 | 0x0B01); // strb result, [r2], #1
+  t16(b, 0x3001);                         // adds r0, #1
+  t16(b, 0x3901);                         // subs r1, #1
+  uint32_t branch = b->size;
+  t32(b, 0, 0);                           // bne loop
+  thumbBranchAt(b, branch, COND_NE, loop);
+  thumbBranchAt(b, skipPatch, COND_EQ, b->size);
+
+  t16(b, 0xB004);                         // add sp, #16
+  t32(b, 0xE8BD, 0x8FF0);                 // pop {r4-r11, pc}
+}
+
+// Quotient of a by the magic in m (see divideByMagic()) into rd
+static void emitMagicQuotient(struct JitBuffer* b, uint8_t rd, uint8_t a, uint8_t m,
+                              uint32_t encoded) {
+  t32(b, 0xFBA0 | a, REG_IP << 12 | REG_LR << 8 | m);        // umull ip, lr, a, m
+  thumbDataReg(b, THUMB_SUB, REG_IP, a, REG_LR);              // ip = a - hi
+  t32(b, THUMB_ADD | REG_LR, 1 << 6 | REG_IP << 8 | 1 << 4 | REG_IP); // ip = hi + (ip >> 1)
+  if (encoded & 31) {
+    thumbShiftImm(b, THUMB_LSR, rd, REG_IP, encoded & 31);
+  } else if (rd != REG_IP) {
+    thumbMov(b, rd, REG_IP);
+  }
+}
+
+static void emitOp(struct JitBuffer* b, uint8_t opcode, uint32_t value, uint8_t depth) {
+  uint8_t top = depth > 0 ? slotReg[depth - 1] : REG_IP;
+  uint8_t a = depth > 1 ? slotReg[depth - 2] : REG_IP; // binary: a op top -> a
+  uint8_t push = depth < RPN_STACK_SIZE ? slotReg[depth] : REG_IP;
+
+  switch (opcode) {
+    case RPN_PUSH_T:   thumbMov(b, push, 0); break;
+    case RPN_PUSH_NUM: thumbMovImm(b, push, value); break;
+    case RPN_DUP:      thumbMov(b, push, top); break;
+    case RPN_SWAP:
+      thumbMov(b, REG_IP, top);
+      thumbMov(b, top, a);
+      thumbMov(b, a, REG_IP);
+      break;
+    case RPN_STORE:    t32(b, 0xF8CD, top << 12 | 4 * value); break;  // str top, [sp, #4r]
+    case RPN_LOAD:     t32(b, 0xF8DD, push << 12 | 4 * value); break; // ldr push, [sp, #4r]
+    case RPN_NOT:      t32(b, 0xEA6F, top << 8 | top); break;         // mvn
+    case RPN_NEG:      t32(b, 0xF1C0 | top, top << 8); break;         // rsb top, top, #0
+    case RPN_ADD:      thumbDataReg(b, THUMB_ADD, a, a, top); break;
+    case RPN_SUB:      thumbDataReg(b, THUMB_SUB, a, a, top); break;
+    case RPN_AND:      thumbDataReg(b, THUMB_AND, a, a, top); break;
+    case RPN_OR:       thumbDataReg(b, THUMB_ORR, a, a, top); break;
+    case RPN_XOR:      thumbDataReg(b, THUMB_EOR, a, a, top); break;
+    case RPN_MUL:      t32(b, 0xFB00 | a, 0xF000 | a << 8 | top); break;
+
+    case RPN_SHL:
+    case RPN_SHR:
+      // Register shifts use the whole low byte of the count; mask it first
+      t32(b, 0xF000 | top, REG_IP << 8 | 31);                              // and ip, top, #31
+      t32(b, (opcode == RPN_SHL ? 0xFA00 : 0xFA20) | a, 0xF000 | a << 8 | REG_IP); // lsl/lsr
+      break;
+
+    // UDIV returns 0 for a zero divisor unless the core is set to trap
+    // (DIV_0_TRP, off after reset)
+    case RPN_DIV:
+      t32(b, 0xFBB0 | a, 0xF0F0 | a << 8 | top);                 // udiv a, a, top
+      break;
+
+    case RPN_MOD:
+      t32(b, 0xFBB0 | a, 0xF0F0 | REG_IP << 8 | top);            // udiv ip, a, top
+      t32(b, 0xFB00 | REG_IP, a << 12 | REG_IP << 8 | 0x10 | top); // mls ip, ip, top, a
+      t32(b, 0xF1B0 | top, 0x0F00);                              // cmp top, #0
+      thumbIt(b, COND_EQ);
+      thumbMovSmall(b, REG_IP, 0);                               // moveq ip, #0
+      thumbMov(b, a, REG_IP);
+      break;
+
+    case RPN_DIVC:
+      emitMagicQuotient(b, a, a, top, value);
+      break;
+
+    case RPN_MODC:
+      emitMagicQuotient(b, REG_IP, a, top, value);
+      thumbMovImm(b, REG_LR, value >> 5);
+      t32(b, 0xFB00 | REG_IP, a << 12 | a << 8 | 0x10 | REG_LR); // mls a, ip, lr, a
+      break;
+
+    case RPN_LT: case RPN_GT: case RPN_EQ:
+    case RPN_LE: case RPN_GE: case RPN_NE: {
+      static const uint8_t cond[] = {COND_LO, COND_HI, COND_EQ, COND_LS, COND_HS, COND_NE};
+      t32(b, 0xEBB0 | a, 0x0F00 | top);                          // cmp a, top
+      thumbMovSmall(b, a, 0);
+      thumbIt(b, cond[opcode - RPN_LT]);
+      thumbMovSmall(b, a, 1);
+      break;
+    }
+  }
+}
+
+// top = top op imm for a constant second operand; false if opcode has no
+// immediate form. Only shifts: other constants cost a MOVW either way.
+static bool emitOpImm(struct JitBuffer* b, uint8_t opcode, uint32_t imm, uint8_t depth) {
+  uint8_t top = slotReg[depth - 1];
+  if (opcode != RPN_SHL && opcode != RPN_SHR) return false;
+  if (imm & 31) {
+    thumbShiftImm(b, opcode == RPN_SHL ? THUMB_LSL : THUMB_LSR, top, top, imm & 31);
+  }
+  return true;
+}
+
+#endif
+
+#if RPN_JIT != RPN_JIT_NONE
+
+// Stack depth change of each opcode
+static int8_t stackEffect(uint8_t opcode) {
+  switch (opcode) {
+    case RPN_PUSH_T:
+    case RPN_PUSH_NUM:
+    case RPN_DUP:
+    case RPN_LOAD:
+      return 1;
+    case RPN_NOT:
+    case RPN_NEG:
+    case RPN_STORE:
+    case RPN_CACHE:
+    case RPN_SWAP:
+      return 0;
+    default:
+      return -1;
+  }
+}
+
+// Translate the whole program; false if it does not fit
+static bool emitProgram(const struct RpnProgram* program, struct JitBuffer* b) {
+  const uint8_t* code = program->code;
+  uint8_t depth = 0;
+  uint32_t skipPatch;
+  uint32_t loop = emitPrologue(b, &skipPatch);
+
+  for (uint16_t pc = 0; pc < program->length;) {
+    uint8_t opcode = code[pc++];
+    uint32_t value = 0;
+
+    switch (opcode) {
+      case RPN_PUSH_NUM:
+      case RPN_STORE:
+      case RPN_LOAD:
+        value = code[pc++];
+        break;
+      case RPN_PUSH_CONST:
+        opcode = RPN_PUSH_NUM;
+        value = program->pool[code[pc++]];
+        break;
+      case RPN_DIVC:
+      case RPN_MODC:
+        value = program->pool[code[pc++]];
+        break;
+      case RPN_CACHE:
+        pc += 2;
+        continue;
+    }
+
+    // A constant followed by a binary opcode becomes one instruction with an
+    // immediate operand where the backend has one
+    if (opcode == RPN_PUSH_NUM && depth > 0 && pc < program->length &&
+        emitOpImm(b, code[pc], value, depth)) {
+      pc++;
+      continue;
+    }
+
+    emitOp(b, opcode, value, depth);
+    depth += stackEffect(opcode);
+  }
+
+  emitEpilogue(b, depth, loop, skipPatch);
+  return !b->overflow;
+}
+
+static bool allocateCode(struct RpnJit* jit) {
+  if (jit->code) return true;
+#if JIT_MMAP
+  void* p = mmap(NULL, RPN_JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  jit->code = p == MAP_FAILED ? NULL : p;
+#else
+  // SRAM is executable on the RP2350
+  jit->code = malloc(RPN_JIT_CODE_SIZE);
+#endif
+  return jit->code != NULL;
+}
+
+static bool setWritable(struct RpnJit* jit, bool writable) {
+#if JIT_MMAP
+  int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC;
+  return mprotect(jit->code, RPN_JIT_CODE_SIZE, prot) == 0;
+#else
+  (void)jit;
+  (void)writable;
+  return true;
+#endif
+}
+
+static void syncInstructions(uint8_t* code, uint32_t size) {
+#if RPN_JIT == RPN_JIT_THUMB2 && defined(__linux__)
+  __builtin___clear_cache((char*)code, (char*)code + size);
+#elif RPN_JIT == RPN_JIT_THUMB2 && defined(__arm__)
+  (void)code;
+  (void)size;
+  __asm volatile("dsb\n\tisb" ::: "memory");
+#else
+  (void)code; // x86 keeps instruction fetch coherent
+  (void)size;
+#endif
+}
+
+#endif
+
+bool jitCompileRPN(const struct RpnProgram* program, struct RpnJit* jit) {
+  jit->fn = NULL;
+#if RPN_JIT == RPN_JIT_NONE
+  (void)program;
+  return false;
+#else
+  uint8_t depth;
+  if (!verifyRPN(program, &depth) || depth > RPN_STACK_SIZE) return false;
+  if (!allocateCode(jit) || !setWritable(jit, true)) return false;
+
+  struct JitBuffer b = {jit->code, 0, false};
+  bool ok = emitProgram(program, &b);
+  if (!setWritable(jit, false) || !ok) return false;
+  syncInstructions(jit->code, b.size);
+
+#if RPN_JIT == RPN_JIT_THUMB2
+  jit->fn = (RpnJitFn)((uintptr_t)jit->code | 1);
+#else
+  jit->fn = (RpnJitFn)(uintptr_t)jit->code;
+#endif
+  return true;
+#endif
+}
+
+void releaseRPNJit(struct RpnJit* jit) {
+  jit->fn = NULL;
+  if (!jit->code) return;
+#if JIT_MMAP
+  munmap(jit->code, RPN_JIT_CODE_SIZE);
+#else
+  free(jit->code);
+#endif
+  jit->code = NULL;
+}
+
+void executeRPNBlockJit(uint32_t t0, uint32_t n, const struct RpnProgram* program,
+                        const struct RpnJit* jit, struct RpnCache* cache, uint8_t* out) {
+  if (jit->fn) {
+    jit->fn(t0, n, out);
+  } else {
+    executeRPNBlockCached(t0, n, program, cache, out);
+  }
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "rpn_vm.h"
+
+#define RPN_JIT_NONE 0
+#define RPN_JIT_X86_64 1 // System V hosts (Linux, macOS)
+#define RPN_JIT_THUMB2 2 // Cortex-M33 and other Thumb-2 cores with UDIV
+
+// Native code backend behind executeRPNBlockJit(); RPN_JIT_NONE always
+// interprets. RPN_JIT_THUMB2 has not run on the device yet, so it is only
+// built when asked for (-DRPN_JIT=2, as make test-thumb does).
+#ifndef RPN_JIT
+#if defined(__x86_64__) && !defined(_WIN32)
+#define RPN_JIT RPN_JIT_X86_64
+#else
+#define RPN_JIT RPN_JIT_NONE
+#endif
+#endif
+
+#if RPN_JIT == RPN_JIT_THUMB2 && \
+    !(defined(__ARM_ARCH_ISA_THUMB) && __ARM_ARCH_ISA_THUMB >= 2 && defined(__ARM_FEATURE_IDIV))
+#error "RPN_JIT_THUMB2 needs a Thumb-2 target with UDIV"
+#endif
+
+#define RPN_JIT_CODE_SIZE 4096 // bytes of machine code per program
+
+// Render n consecutive samples from t0, like executeRPNBlock()
+typedef void (*RpnJitFn)(uint32_t t0, uint32_t n, uint8_t* out);
+
+struct RpnJit {
+  RpnJitFn fn;   // NULL: no native code, executeRPNBlockJit() interprets
+  uint8_t* code; // RPN_JIT_CODE_SIZE bytes, allocated by the first compile
+};
+
+// Translate a program into straight-line native code, one register per stack
+// slot. RPN_CACHE markers are ignored: the code recomputes every subtree.
+// Returns false and clears jit->fn if there is no backend, the program fails
+// verifyRPN() or the code does not fit. A zeroed RpnJit is ready for use.
+bool jitCompileRPN(const struct RpnProgram* program, struct RpnJit* jit);
+void releaseRPNJit(struct RpnJit* jit);
+// jit->fn if the program was compiled, executeRPNBlockCached() otherwise
+void executeRPNBlockJit(uint32_t t0, uint32_t n, const struct RpnProgram* program,
+                        const struct RpnJit* jit, struct RpnCache* cache, uint8_t* out);
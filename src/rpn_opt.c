@@ -0,0 +1,533 @@
+#include "rpn_opt.h"
+#include <string.h>
+
+// Optimizer passes over the expression IR. Each pass rewrites or annotates
+// the DAG below ir->root in place; the emitter in rpn_ir.c turns the
+// annotations (operand order, registers, cache slots) into instructions.
+
+// Shift of a subtree that does not depend on t at all
+#define SHIFT_CONSTANT 0xFF
+
+// Mask of bit h and every bit below it, where h is the highest bit of mask.
+// Bits of a sum, difference or product only depend on operand bits at or
+// below them.
+static uint32_t lowBitsThrough(uint32_t mask) {
+  mask |= mask >> 1;
+  mask |= mask >> 2;
+  mask |= mask >> 4;
+  mask |= mask >> 8;
+  mask |= mask >> 16;
+  return mask;
+}
+
+static uint8_t countTrailingZeros(uint32_t v) {
+  uint8_t k = 0;
+  while (k < 32 && !(v >> k & 1)) k++;
+  return k;
+}
+
+// Bits of a node that are the same for every t (known bits analysis)
+static void computeKnown(struct RpnIr* ir, uint8_t n) {
+  struct RpnIrNode* node = &ir->nodes[n];
+  if (node->known) return;
+
+  uint32_t zero = 0, one = 0;
+  uint32_t zl = 0, ol = 0, zr = 0, orr = 0;
+  if (node->lhs != RPN_IR_NONE) {
+    computeKnown(ir, node->lhs);
+    zl = ir->nodes[node->lhs].knownZero;
+    ol = ir->nodes[node->lhs].knownOne;
+  }
+  if (node->rhs != RPN_IR_NONE) {
+    computeKnown(ir, node->rhs);
+    zr = ir->nodes[node->rhs].knownZero;
+    orr = ir->nodes[node->rhs].knownOne;
+  }
+  bool constCount = node->rhs != RPN_IR_NONE && irIsConst(ir, node->rhs);
+  uint8_t k = constCount ? ir->nodes[node->rhs].value & 31 : 0;
+
+  switch (node->opcode) {
+    case RPN_PUSH_NUM:
+      zero = ~node->value;
+      one = node->value;
+      break;
+    case RPN_NOT:
+      zero = ol;
+      one = zl;
+      break;
+    case RPN_AND:
+      zero = zl | zr;
+      one = ol & orr;
+      break;
+    case RPN_OR:
+      zero = zl & zr;
+      one = ol | orr;
+      break;
+    case RPN_XOR:
+      zero = (zl & zr) | (ol & orr);
+      one = (zl & orr) | (ol & zr);
+      break;
+    case RPN_SHL:
+      if (constCount) {
+        zero = zl << k | ((1u << k) - 1);
+        one = ol << k;
+      }
+      break;
+    case RPN_SHR:
+      if (constCount) {
+        zero = zl >> k | ~(0xFFFFFFFFu >> k);
+        one = ol >> k;
+      }
+      break;
+    case RPN_ADD:
+    case RPN_SUB: {
+      // Trailing zeros of both operands stay zero
+      uint8_t tz = countTrailingZeros(~zl);
+      uint8_t tzr = countTrailingZeros(~zr);
+      if (tzr < tz) tz = tzr;
+      zero = tz >= 32 ? 0xFFFFFFFF : (1u << tz) - 1;
+      break;
+    }
+    case RPN_MUL: {
+      uint16_t tz = countTrailingZeros(~zl) + countTrailingZeros(~zr);
+      zero = tz >= 32 ? 0xFFFFFFFF : (1u << tz) - 1;
+      break;
+    }
+    case RPN_DIV:
+      // No larger than the dividend
+      zero = ~lowBitsThrough(~zl);
+      break;
+    case RPN_MOD:
+      // No larger than either operand
+      zero = ~(lowBitsThrough(~zl) & lowBitsThrough(~zr));
+      break;
+    case RPN_LT: case RPN_GT: case RPN_EQ:
+    case RPN_LE: case RPN_GE: case RPN_NE:
+      zero = ~1u;
+      break;
+    default:
+      break;
+  }
+
+  node->knownZero = zero;
+  node->knownOne = one;
+  node->known = true;
+}
+
+// Pass the bits a node's parents use on to its operands. Indices are a
+// topological order (operands are always created before the node using
+// them), so walking down from the root gives every node the union of its
+// parents' demands before it is visited.
+static void propagateDemanded(struct RpnIr* ir, uint8_t root, uint32_t demanded) {
+  ir->nodes[root].demanded = demanded;
+
+  for (uint8_t n = root + 1; n-- > 0;) {
+    struct RpnIrNode* node = &ir->nodes[n];
+    uint32_t d = node->demanded;
+    if (d == 0 || node->lhs == RPN_IR_NONE) continue;
+
+    uint32_t dl = 0xFFFFFFFF, dr = 0xFFFFFFFF;
+    bool constRhs = node->rhs != RPN_IR_NONE && irIsConst(ir, node->rhs);
+    uint32_t c = constRhs ? ir->nodes[node->rhs].value : 0;
+
+    switch (node->opcode) {
+      case RPN_NOT:
+        dl = d;
+        break;
+      case RPN_NEG:
+      case RPN_ADD:
+      case RPN_SUB:
+      case RPN_MUL:
+        dl = dr = lowBitsThrough(d);
+        break;
+      case RPN_AND:
+        dl = constRhs ? d & c : d;
+        dr = d;
+        break;
+      case RPN_OR:
+        dl = constRhs ? d & ~c : d;
+        dr = d;
+        break;
+      case RPN_XOR:
+        dl = dr = d;
+        break;
+      case RPN_SHL:
+      case RPN_SHR:
+        if (constRhs) {
+          dl = node->opcode == RPN_SHL ? d >> (c & 31) : d << (c & 31);
+        }
+        dr = 31; // the count is masked
+        break;
+      default:
+        break;
+    }
+
+    ir->nodes[node->lhs].demanded |= dl;
+    if (node->rhs != RPN_IR_NONE) ir->nodes[node->rhs].demanded |= dr;
+  }
+}
+
+// Rebuild node n so that it only has to be right in its demanded bits.
+// rebuilt[] holds the nodes already rebuilt, RPN_IR_NONE for the rest.
+static uint8_t simplifyDemanded(struct RpnIr* ir, uint8_t n, uint8_t* rebuilt) {
+  if (rebuilt[n] != RPN_IR_NONE) return rebuilt[n];
+
+  struct RpnIrNode* node = &ir->nodes[n];
+  uint32_t d = node->demanded;
+  uint8_t result;
+
+  if (node->lhs == RPN_IR_NONE) {
+    result = n;
+  } else {
+    // Operands nobody looks at are replaced by 0 so they fold away
+    uint8_t l = ir->nodes[node->lhs].demanded ? simplifyDemanded(ir, node->lhs, rebuilt)
+                                              : irConst(ir, 0);
+    if (l == RPN_IR_NONE) return RPN_IR_NONE;
+    if (node->rhs == RPN_IR_NONE) {
+      result = irUnary(ir, node->opcode, l);
+    } else {
+      uint8_t r = ir->nodes[node->rhs].demanded ? simplifyDemanded(ir, node->rhs, rebuilt)
+                                                : irConst(ir, 0);
+      if (r == RPN_IR_NONE) return RPN_IR_NONE;
+      result = irBinary(ir, node->opcode, l, r);
+    }
+  }
+  if (result == RPN_IR_NONE) return RPN_IR_NONE;
+
+  computeKnown(ir, result);
+  struct RpnIrNode* res = &ir->nodes[result];
+
+  // Every demanded bit is known: the node is a constant
+  if (((res->knownZero | res->knownOne) & d) == d) {
+    result = irIsConst(ir, result) ? result : irConst(ir, res->knownOne & d);
+  } else if (res->rhs != RPN_IR_NONE && irIsConst(ir, res->rhs)) {
+    // Masks that do not change a demanded bit are dropped, constants only
+    // keep the bits that matter (small constants encode in one byte)
+    uint8_t l = res->lhs;
+    uint32_t c = ir->nodes[res->rhs].value;
+    uint32_t trimmed = c;
+    switch (res->opcode) {
+      case RPN_AND:
+        if ((d & ~c & ~ir->nodes[l].knownZero) == 0) result = l;
+        trimmed = c & d;
+        break;
+      case RPN_OR:
+        if ((d & c & ~ir->nodes[l].knownOne) == 0) result = l;
+        trimmed = c & d;
+        break;
+      case RPN_XOR:
+        trimmed = c & d;
+        break;
+      case RPN_ADD:
+      case RPN_MUL:
+        trimmed = c & lowBitsThrough(d);
+        break;
+      default:
+        break;
+    }
+    if (result != l && trimmed != c) {
+      uint8_t k = irConst(ir, trimmed);
+      if (k == RPN_IR_NONE) return RPN_IR_NONE;
+      result = irBinary(ir, res->opcode, l, k);
+    }
+  }
+
+  if (result != RPN_IR_NONE) computeKnown(ir, result);
+  rebuilt[n] = result;
+  return result;
+}
+
+// Magic multiplier for unsigned division by a constant d that is not a power
+// of two (Granlund & Montgomery, "round-up" variant with the add fixup):
+// q = (hi + ((x - hi) >> 1)) >> (l - 1) with hi = mulhi(x, m), l = ceil(log2 d)
+static uint32_t divisionMagic(uint32_t d, uint8_t* shift) {
+  uint8_t l = 0;
+  while (((uint64_t)1 << l) < d) l++;
+  *shift = l - 1;
+  return (uint32_t)((((uint64_t)1 << 32) * (((uint64_t)1 << l) - d)) / d + 1);
+}
+
+static uint8_t log2Exact(uint32_t c) {
+  uint8_t k = 0;
+  while ((c >> k) != 1) k++;
+  return k;
+}
+
+// Rewrite multiply, divide and modulo by constants into cheaper opcodes:
+// powers of two become shifts and masks, other divisors become RPN_DIVC /
+// RPN_MODC. Runs once on the final tree, after all folding is done.
+static void strengthReduce(struct RpnIr* ir, uint8_t n) {
+  if (ir->nodes[n].lhs != RPN_IR_NONE) strengthReduce(ir, ir->nodes[n].lhs);
+  if (ir->nodes[n].rhs != RPN_IR_NONE) strengthReduce(ir, ir->nodes[n].rhs);
+
+  uint8_t opcode = ir->nodes[n].opcode;
+  if (opcode != RPN_MUL && opcode != RPN_DIV && opcode != RPN_MOD) return;
+
+  uint8_t r = ir->nodes[n].rhs;
+  if (!irIsConst(ir, r)) return;
+  uint32_t c = ir->nodes[r].value;
+  if (c < 2) return;
+
+  // The operand gets a fresh constant node: a program lifted from DUP/LOAD
+  // may share it with other parents
+  if ((c & (c - 1)) == 0) {
+    uint8_t k = irConst(ir, opcode == RPN_MOD ? c - 1 : log2Exact(c));
+    if (k == RPN_IR_NONE) return;
+    switch (opcode) {
+      case RPN_MUL: ir->nodes[n].opcode = RPN_SHL; break;
+      case RPN_DIV: ir->nodes[n].opcode = RPN_SHR; break;
+      case RPN_MOD: ir->nodes[n].opcode = RPN_AND; break;
+    }
+    ir->nodes[n].rhs = k;
+    return;
+  }
+
+  // The divisor has to fit next to the shift in the instruction value
+  if (opcode == RPN_MUL || c >= (1u << 27)) return;
+
+  uint8_t shift;
+  uint8_t m = irConst(ir, divisionMagic(c, &shift));
+  if (m == RPN_IR_NONE) return;
+  ir->nodes[n].rhs = m;
+  ir->nodes[n].opcode = (opcode == RPN_DIV) ? RPN_DIVC : RPN_MODC;
+  ir->nodes[n].value = (c << 5) | shift;
+}
+
+// Merge equal subtrees. Children are canonical before their parent is looked
+// up, so two nodes are equal exactly when opcode, value and child indices match.
+static uint8_t shareSubtrees(struct RpnIr* ir, uint8_t n, uint8_t* canonical) {
+  if (canonical[n] != RPN_IR_NONE) return canonical[n];
+
+  struct RpnIrNode* node = &ir->nodes[n];
+  if (node->lhs != RPN_IR_NONE) node->lhs = shareSubtrees(ir, node->lhs, canonical);
+  if (node->rhs != RPN_IR_NONE) node->rhs = shareSubtrees(ir, node->rhs, canonical);
+
+  for (uint8_t i = 0; i < ir->orderCount; i++) {
+    struct RpnIrNode* other = &ir->nodes[ir->order[i]];
+    if (other->opcode == node->opcode && other->value == node->value &&
+        other->lhs == node->lhs && other->rhs == node->rhs) {
+      canonical[n] = ir->order[i];
+      return ir->order[i];
+    }
+  }
+
+  ir->order[ir->orderCount++] = n;
+  canonical[n] = n;
+  return n;
+}
+
+static void countRefs(struct RpnIr* ir, uint8_t n) {
+  // Children of a shared node are only referenced once through it
+  if (ir->nodes[n].refs++ > 0) return;
+
+  uint8_t l = ir->nodes[n].lhs, r = ir->nodes[n].rhs;
+  if (l != RPN_IR_NONE && l == r) ir->nodes[l].dups++;
+  if (l != RPN_IR_NONE) countRefs(ir, l);
+  if (r != RPN_IR_NONE) countRefs(ir, r);
+}
+
+static uint8_t treeSize(struct RpnIr* ir, uint8_t n) {
+  uint8_t size = 1;
+  if (ir->nodes[n].lhs != RPN_IR_NONE) size += treeSize(ir, ir->nodes[n].lhs);
+  if (ir->nodes[n].rhs != RPN_IR_NONE) size += treeSize(ir, ir->nodes[n].rhs);
+  return size;
+}
+
+// Compute for every node the smallest k such that it depends on t only
+// through t >> k: 0 for anything using t directly, SHIFT_CONSTANT for none
+static uint8_t computeShift(struct RpnIr* ir, uint8_t n) {
+  uint8_t shift = SHIFT_CONSTANT;
+
+  if (ir->nodes[n].lhs != RPN_IR_NONE) {
+    uint8_t s = computeShift(ir, ir->nodes[n].lhs);
+    if (s < shift) shift = s;
+  }
+  if (ir->nodes[n].rhs != RPN_IR_NONE) {
+    uint8_t s = computeShift(ir, ir->nodes[n].rhs);
+    if (s < shift) shift = s;
+  }
+
+  if (ir->nodes[n].opcode == RPN_PUSH_T) {
+    shift = 0;
+  } else if (ir->nodes[n].opcode == RPN_SHR &&
+             ir->nodes[ir->nodes[n].lhs].opcode == RPN_PUSH_T && irIsConst(ir, ir->nodes[n].rhs)) {
+    shift = ir->nodes[ir->nodes[n].rhs].value & 31;
+  }
+
+  ir->nodes[n].shift = shift;
+  return shift;
+}
+
+// Keep a shared node in a scratch register when that saves instructions: the
+// first use costs an extra STORE, every further use a LOAD instead of the
+// whole subtree. Uses as both operands of one parent are served by DUP.
+// Larger subtrees come later in post-order, so they get registers first.
+static void assignRegisters(struct RpnIr* ir) {
+  uint8_t regs = 0;
+
+  for (uint8_t i = ir->orderCount; i-- > 0 && regs < RPN_REG_COUNT;) {
+    uint8_t n = ir->order[i];
+    uint8_t uses = ir->nodes[n].refs - ir->nodes[n].dups;
+    if (uses < 2 || ir->nodes[n].lhs == RPN_IR_NONE) continue;
+    if ((uses - 1) * (treeSize(ir, n) - 1) > 1) ir->nodes[n].reg = regs++;
+  }
+}
+
+static bool usesRegister(struct RpnIr* ir, uint8_t n) {
+  struct RpnIrNode* node = &ir->nodes[n];
+  if (node->reg != RPN_IR_NONE) return true;
+  if (node->lhs != RPN_IR_NONE && usesRegister(ir, node->lhs)) return true;
+  return node->rhs != RPN_IR_NONE && node->rhs != node->lhs && usesRegister(ir, node->rhs);
+}
+
+// Give cache slots to the largest subtrees that only change every
+// 2^RPN_CACHE_MIN_SHIFT samples or slower. A bare t >> k is as cheap as the
+// cache lookup itself, so only subtrees with more work than that qualify.
+// A cache hit skips the subtree, so it must not contain register stores or
+// loads; the node's own STORE is emitted after the subtree and still runs.
+static void markCached(struct RpnIr* ir, uint8_t n, uint8_t* slots) {
+  if (*slots >= RPN_CACHE_SLOTS || ir->nodes[n].cacheSlot != RPN_IR_NONE) return;
+
+  uint8_t l = ir->nodes[n].lhs, r = ir->nodes[n].rhs;
+  uint8_t shift = ir->nodes[n].shift;
+  if (shift >= RPN_CACHE_MIN_SHIFT && shift != SHIFT_CONSTANT && treeSize(ir, n) > 3 &&
+      !(l != RPN_IR_NONE && usesRegister(ir, l)) &&
+      !(r != RPN_IR_NONE && usesRegister(ir, r))) {
+    ir->nodes[n].cacheSlot = (*slots)++;
+    return;
+  }
+
+  if (l != RPN_IR_NONE) markCached(ir, l, slots);
+  if (r != RPN_IR_NONE) markCached(ir, r, slots);
+}
+
+// Sethi-Ullman number: the stack depth evaluating n takes. Evaluating the
+// operand that needs more first keeps the other one's single result below
+// it, so a binary node needs max(first, second + 1). Commutative operators
+// and comparisons can be reordered for free; with swap, SUB, DIV, MOD and
+// the shifts can too, at the cost of a RPN_SWAP. RPN_DIVC/RPN_MODC are never
+// reordered: their right operand is a constant. Register loads need less
+// than the subtree they replace, so this is an upper bound.
+static uint8_t stackNeed(struct RpnIr* ir, uint8_t n, bool swap) {
+  struct RpnIrNode* node = &ir->nodes[n];
+  if (node->need) return node->need;
+
+  uint8_t need = 1;
+  node->rightFirst = false;
+  if (node->rhs != RPN_IR_NONE && node->rhs == node->lhs) {
+    need = stackNeed(ir, node->lhs, swap);
+    if (need < 2) need = 2;
+  } else if (node->rhs != RPN_IR_NONE) {
+    uint8_t first = stackNeed(ir, node->lhs, swap), second = stackNeed(ir, node->rhs, swap);
+    bool reorderable = irMirroredOpcode(node->opcode) != RPN_OPCODE_COUNT ||
+                       (swap && node->opcode != RPN_DIVC && node->opcode != RPN_MODC);
+    if (reorderable && second > first) {
+      node->rightFirst = true;
+      first = second;
+      second = stackNeed(ir, node->lhs, swap);
+    }
+    need = first > second ? first : second + 1;
+  } else if (node->lhs != RPN_IR_NONE) {
+    need = stackNeed(ir, node->lhs, swap);
+  }
+
+  node->need = need;
+  return need;
+}
+
+// Pass: demanded bits. Only the result bits in ir->outputMask have to be
+// right: operations and masks that cannot change those bits are removed, and
+// constants are trimmed to the bits that matter. Needs node indices in
+// topological order, so it runs before the passes that rewire operands. If
+// the arena runs out the old tree stays.
+static void passDemanded(struct RpnIr* ir) {
+  uint8_t rebuilt[RPN_IR_MAX_NODES];
+  memset(rebuilt, RPN_IR_NONE, sizeof(rebuilt));
+  propagateDemanded(ir, ir->root, ir->outputMask);
+  uint8_t narrowed = simplifyDemanded(ir, ir->root, rebuilt);
+  if (narrowed != RPN_IR_NONE) ir->root = narrowed;
+}
+
+// Pass: multiply/divide/modulo by constants become shifts, masks and
+// multiply-high division (RPN_DIVC/RPN_MODC)
+static void passStrength(struct RpnIr* ir) {
+  strengthReduce(ir, ir->root);
+}
+
+// Pass: merge repeated subexpressions into shared nodes and count the uses
+// of each
+static void passShare(struct RpnIr* ir) {
+  uint8_t canonical[RPN_IR_MAX_NODES];
+  memset(canonical, RPN_IR_NONE, sizeof(canonical));
+  ir->orderCount = 0;
+  ir->root = shareSubtrees(ir, ir->root, canonical);
+  for (uint8_t i = 0; i < ir->count; i++) ir->nodes[i].refs = ir->nodes[i].dups = 0;
+  countRefs(ir, ir->root);
+}
+
+// Pass: shared nodes worth it go to the RPN_STORE/RPN_LOAD scratch
+// registers; the rest are served by RPN_DUP or recomputed. Runs after
+// passShare.
+static void passRegisters(struct RpnIr* ir) {
+  assignRegisters(ir);
+}
+
+// Pass: evaluation order of every binary node, deeper operand first.
+// RPN_SWAP costs an instruction, so it is only used when the program would
+// not fit RPN_STACK_SIZE without it.
+static void passOrder(struct RpnIr* ir) {
+  for (uint8_t i = 0; i < ir->count; i++) ir->nodes[i].need = 0;
+  if (stackNeed(ir, ir->root, false) <= RPN_STACK_SIZE) return;
+
+  for (uint8_t i = 0; i < ir->count; i++) ir->nodes[i].need = 0;
+  stackNeed(ir, ir->root, true);
+}
+
+// Pass: RPN_CACHE markers on subtrees that only change every
+// 2^RPN_CACHE_MIN_SHIFT samples or slower, dropped again newest first until
+// the program fits ir->capacity
+static void passCache(struct RpnIr* ir) {
+  uint8_t slots = 0;
+  computeShift(ir, ir->root);
+  markCached(ir, ir->root, &slots);
+  while (slots > 0 && emitIR(ir, NULL, ir->capacity) > ir->capacity) {
+    slots--;
+    for (uint8_t i = 0; i < ir->count; i++) {
+      if (ir->nodes[i].cacheSlot == slots) ir->nodes[i].cacheSlot = RPN_IR_NONE;
+    }
+  }
+}
+
+const struct RpnPass rpnDefaultPasses[] = {
+  {"demanded", passDemanded},
+  {"strength", passStrength},
+  {"share", passShare},
+  {"registers", passRegisters},
+  {"order", passOrder},
+  {"cache", passCache}
+};
+
+const uint8_t rpnDefaultPassCount = sizeof(rpnDefaultPasses) / sizeof(rpnDefaultPasses[0]);
+
+void runPasses(struct RpnIr* ir, const struct RpnPass* passes, uint8_t count) {
+  if (ir->root == RPN_IR_NONE) return;
+  for (uint8_t i = 0; i < count; i++) passes[i].run(ir);
+}
+
+void optimizeIR(struct RpnIr* ir, uint32_t demanded, uint8_t capacity) {
+  ir->outputMask = demanded;
+  ir->capacity = capacity;
+  runPasses(ir, rpnDefaultPasses, rpnDefaultPassCount);
+}
+
+uint8_t optimizeRPN(struct RpnInstruction* program, uint8_t program_len, uint8_t capacity,
+                    uint32_t demanded) {
+  static struct RpnIr ir;
+  if (!liftRPN(program, program_len, &ir)) return program_len;
+  optimizeIR(&ir, demanded, capacity);
+
+  // The program has room for the larger of its old length and capacity
+  uint16_t limit = program_len > capacity ? program_len : capacity;
+  if (emitIR(&ir, NULL, limit) > limit) return program_len;
+  return emitIR(&ir, program, limit);
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "rpn_vm.h"
+#include "rpn_ir.h"
+
+// An optimizer pass rewrites or annotates the DAG below ir->root in place.
+// Passes never leave the IR invalid: one that runs out of arena space keeps
+// the part it could not rewrite.
+typedef void (*RpnPassFn)(struct RpnIr* ir);
+
+struct RpnPass {
+  const char* name;
+  RpnPassFn run;
+};
+
+// The pipeline optimizeIR() runs, in order:
+//   demanded  - drop operations and masks that cannot change a bit in
+//               ir->outputMask and trim constants to the bits that matter
+//   strength  - multiply/divide/modulo by constants become shifts, masks and
+//               multiply-high division (RPN_DIVC/RPN_MODC)
+//   share     - merge repeated subexpressions into shared nodes
+//   registers - keep shared nodes in the RPN_STORE/RPN_LOAD scratch
+//               registers where that saves instructions (after share)
+//   order     - emit the operand that needs more stack first: commutative
+//               operators and comparisons are reordered for free, the others
+//               through RPN_SWAP only when the program would not fit
+//               RPN_STACK_SIZE otherwise
+//   cache     - RPN_CACHE markers on subtrees that only change every
+//               2^RPN_CACHE_MIN_SHIFT samples or slower, as long as the
+//               program stays within ir->capacity instructions
+// Constant folding, algebraic identities (x*1, x|0, x^x, ...) and
+// reassociation of constant chains such as (t*3)*5 happen as nodes are
+// created (irBinary()), so they need no pass.
+extern const struct RpnPass rpnDefaultPasses[];
+extern const uint8_t rpnDefaultPassCount;
+
+void runPasses(struct RpnIr* ir, const struct RpnPass* passes, uint8_t count);
+// Run the default pipeline. Only the result bits set in demanded have to be
+// preserved (RPN_OUTPUT_MASK for audio, 0xFFFFFFFF for the full value); the
+// result computes the same demanded bits as the input for every t.
+void optimizeIR(struct RpnIr* ir, uint32_t demanded, uint8_t capacity);
+
+// Optimize a compiled RPN program in place and return its new length:
+// liftRPN(), optimizeIR() and emitIR() on an internal IR (not reentrant).
+// program must have room for capacity instructions. Malformed programs are
+// returned as is.
+uint8_t optimizeRPN(struct RpnInstruction* program, uint8_t program_len, uint8_t capacity,
+                    uint32_t demanded);
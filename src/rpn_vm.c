@@ -1,20 +1,27 @@
 #include "rpn_vm.h"
+#include "rpn_compile.h"
+#include "rpn_opt.h"
 #include <string.h>
 #include <stdio.h>
 
-#define MAX_OP_STACK_SIZE 64
-#define OP_PAREN_OPEN  255
-#define OP_PAREN_CLOSE 254
-
 // Global variables
-struct Token expr[MAX_TOKENS];
 volatile enum CompileError compileError = ERR_NONE;
-uint8_t expr_len = 0;
 char textBuffer[TEXT_BUFFER_SIZE];
 uint8_t text_len = 0;
 uint8_t cursor = 0;
 bool needsRecompile = false;
 bool needsResetT = false;
+uint8_t compileRawLen = 0;
+uint32_t compileOutputMask = RPN_OUTPUT_MASK;
+
+// Compiler behind compileToRPN()
+static struct RpnCompiler sharedCompiler;
+
+// Operand bytes following each opcode in bytecode
+static const uint8_t operandBytes[RPN_OPCODE_COUNT] = {
+  [RPN_PUSH_NUM] = 1, [RPN_PUSH_CONST] = 1, [RPN_DIVC] = 1, [RPN_MODC] = 1,
+  [RPN_CACHE] = 2, [RPN_STORE] = 1, [RPN_LOAD] = 1
+};
 
 // Helper function to check if character is a hex digit
 bool isHexDigit(char c) {
@@ -54,301 +61,179 @@ uint8_t getPrecedence(uint8_t opcode) {
   }
 }
 
-// Compile text to RPN using shunting-yard algorithm
-uint8_t compileToRPN(struct RpnInstruction *dst) {
-  compileError = ERR_NONE;
-  uint8_t rpnProgramLen = 0;
-  
-  // Operator stack for shunting-yard
-  uint8_t opStack[MAX_OP_STACK_SIZE];
-  uint8_t opStackTop = 0;
-  uint8_t numParentheses = 0;
+// Pool index of value, adding it if needed; RPN_POOL_SIZE if the pool is full
+static uint8_t poolIndex(struct RpnProgram* dst, uint32_t value) {
+  for (uint8_t i = 0; i < dst->poolSize; i++) {
+    if (dst->pool[i] == value) return i;
+  }
+  if (dst->poolSize >= RPN_POOL_SIZE) return RPN_POOL_SIZE;
+  dst->pool[dst->poolSize] = value;
+  return dst->poolSize++;
+}
 
-  bool expectOperand = true;
-  
-  uint8_t i = 0;
+bool encodeRPN(const struct RpnInstruction* program, uint8_t program_len, struct RpnProgram* dst) {
+  dst->length = 0;
+  dst->poolSize = 0;
 
-  while (textBuffer[i] != '\0') {
-    char c = textBuffer[i];
+  for (uint8_t pc = 0; pc < program_len; pc++) {
+    uint8_t opcode = program[pc].opcode;
+    uint32_t value = program[pc].value;
+    if (opcode >= RPN_PUSH_CONST) return false;
 
-    if (rpnProgramLen >= RPN_PROGRAM_SIZE || i >= TEXT_BUFFER_SIZE) {
-      compileError = ERR_PROGRAM_TOO_LONG;
-      return 0;
-    }
-    
-    // Skip whitespace
-    if (c == ' ') {
-      i++;
-      continue;
+    uint8_t operands[2] = {(uint8_t)value, 0};
+    if (opcode == RPN_PUSH_NUM && value > 0xFF) opcode = RPN_PUSH_CONST;
+    if (opcode == RPN_PUSH_CONST || opcode == RPN_DIVC || opcode == RPN_MODC) {
+      operands[0] = poolIndex(dst, value);
+      if (operands[0] >= RPN_POOL_SIZE) return false;
     }
-    
-    // Numbers
-    if (c >= '0' && c <= '9') {
-      if (!expectOperand) {
-        compileError = ERR_TOKEN;
-        return 0;
-      }
 
-      uint32_t num = 0;
-      
-      // Check for hex or binary prefix
-      if (c == '0' && i + 2 < TEXT_BUFFER_SIZE) {
-        char next = textBuffer[i + 1];
-        if (next == 'x' || next == 'X') {
-          // Hex number: 0x...
-          i += 2; // skip '0x'
-          if (i >= TEXT_BUFFER_SIZE || !isHexDigit(textBuffer[i])) {
-            compileError = ERR_TOKEN;
-            return 0;
-          }
-          while (i < TEXT_BUFFER_SIZE) {
-            char hexChar = textBuffer[i];
-            uint8_t digit;
-            if (hexChar >= '0' && hexChar <= '9') {
-              digit = hexChar - '0';
-            } else if (hexChar >= 'a' && hexChar <= 'f') {
-              digit = hexChar - 'a' + 10;
-            } else if (hexChar >= 'A' && hexChar <= 'F') {
-              digit = hexChar - 'A' + 10;
-            } else {
-              break; // not a hex digit
-            }
-            num = (num << 4) | digit;
-            i++;
-            c = textBuffer[i];
-          }
-        } else if (next == 'b' || next == 'B') {
-          // Binary number: 0b...
-          i += 2; // skip '0b'
-          if (i >= TEXT_BUFFER_SIZE || (textBuffer[i] != '0' && textBuffer[i] != '1')) {
-            compileError = ERR_TOKEN;
-            return 0;
-          }
-          while (i < TEXT_BUFFER_SIZE && (textBuffer[i] == '0' || textBuffer[i] == '1')) {
-            num = (num << 1) | (textBuffer[i] - '0');
-            i++;
-            c = textBuffer[i];
-          }
-        } else {
-          // Decimal number
-          while (c >= '0' && c <= '9' && i < TEXT_BUFFER_SIZE) {
-            num = num * 10 + (c - '0');
-            i++;
-            c = textBuffer[i];
-          }
-        }
-      } else {
-        // Decimal number (no leading 0)
-        while (c >= '0' && c <= '9' && i < TEXT_BUFFER_SIZE) {
-          num = num * 10 + (c - '0');
-          i++;
-          c = textBuffer[i];
-        }
-      }
+    if (opcode == RPN_CACHE) {
+      uint8_t slot = value & 0xFF;
+      uint8_t length = (value >> 16) & 0xFF;
+      if (slot >= RPN_CACHE_SLOTS || pc + length >= program_len) return false;
 
-      if (rpnProgramLen >= RPN_PROGRAM_SIZE) {
-        compileError = ERR_PROGRAM_TOO_LONG;
-        return 0;
+      // Marker lengths count bytes; a subtree too long to skip loses its marker
+      uint16_t bytes = 0;
+      for (uint8_t i = pc + 1; i <= pc + length; i++) {
+        bytes += 1 + (program[i].opcode < RPN_OPCODE_COUNT ? operandBytes[program[i].opcode] : 0);
       }
-      
-      dst[rpnProgramLen].opcode = RPN_PUSH_NUM;
-      dst[rpnProgramLen].value = num;
-      rpnProgramLen++;
-      expectOperand = false;
-      continue;
+      if (bytes > 0xFF) continue;
+      operands[0] = ((value >> 8) & 31) | (slot << 5);
+      operands[1] = bytes;
     }
-    
-    // Variable t
-    if (c == 't') {
-      if (!expectOperand) {
-        compileError = ERR_TOKEN;
-        return 0;
-      }
 
-      if (rpnProgramLen >= RPN_PROGRAM_SIZE) {
-        compileError = ERR_PROGRAM_TOO_LONG;
-        return 0;
-      }
+    uint8_t size = 1 + operandBytes[opcode];
+    if (dst->length + size > RPN_PROGRAM_SIZE) return false;
+    dst->code[dst->length] = opcode;
+    memcpy(&dst->code[dst->length + 1], operands, size - 1);
+    dst->length += size;
+  }
 
-      dst[rpnProgramLen].opcode = RPN_PUSH_T;
-      dst[rpnProgramLen].value = 0;
-      rpnProgramLen++;
-      expectOperand = false;
-      i++;
-      continue;
-    }
-    
-    // Operators and parentheses
-    uint8_t precedence = 0;
-    uint8_t opcode = 0;
-    bool rightAssoc = false;
-    bool isBinaryOp = false;
-    
-    switch (c) {
-      case '(':
-        if (!expectOperand) {
-          compileError = ERR_TOKEN;
-          return 0;
-        }
-        opcode = OP_PAREN_OPEN;
-        numParentheses++;
-        expectOperand = true;
-        break;
-      case ')':
-        if (expectOperand) {
-          compileError = ERR_PAREN;
-          return 0;
-        }
-        if (numParentheses <= 0) {
-          compileError = ERR_TOKEN;
-          return 0;
-        }
-        precedence = 0;
-        opcode = OP_PAREN_CLOSE;
-        numParentheses--;
-        expectOperand = false;
-        break;
-      case '~':
-        if (!expectOperand) {
-          compileError = ERR_TOKEN;
-          return 0;
-        }
-        precedence = getPrecedence(RPN_NOT);
-        opcode = RPN_NOT;
-        rightAssoc = true;
-        break;
-      case '*': case '/': case '%': precedence = getPrecedence(RPN_MUL); opcode = (c == '*') ? RPN_MUL : (c == '/') ? RPN_DIV : RPN_MOD; isBinaryOp = true; break;
-      case '+': 
-        if (expectOperand) {
-          // Unary plus - just skip it
-          i++;
-          continue;
-        }
-        precedence = getPrecedence(RPN_ADD);
-        opcode = RPN_ADD;
-        isBinaryOp = true;
-        break;
-      case '-':
-        if (expectOperand) {
-          // Unary minus
-          precedence = getPrecedence(RPN_NEG);
-          opcode = RPN_NEG;
-          rightAssoc = true;
-          break;
-        }
-        precedence = getPrecedence(RPN_SUB);
-        opcode = RPN_SUB;
-        isBinaryOp = true;
-        break;
-      case '&': precedence = getPrecedence(RPN_AND); opcode = RPN_AND; isBinaryOp = true; break;
-      case '|': precedence = getPrecedence(RPN_OR); opcode = RPN_OR; isBinaryOp = true; break;
-      case '^': precedence = getPrecedence(RPN_XOR); opcode = RPN_XOR; isBinaryOp = true; break;
-      case '<': 
-        if (textBuffer[i+1] == '<') { precedence = getPrecedence(RPN_SHL); opcode = RPN_SHL; i++; }
-        else if (textBuffer[i+1] == '=') { precedence = getPrecedence(RPN_LE); opcode = RPN_LE; i++; }
-        else { precedence = getPrecedence(RPN_LT); opcode = RPN_LT; }
-        isBinaryOp = true;
-        break;
-      case '>': 
-        if (textBuffer[i+1] == '=') { precedence = getPrecedence(RPN_GE); opcode = RPN_GE; i++; }
-        else if (textBuffer[i+1] == '>') { precedence = getPrecedence(RPN_SHR); opcode = RPN_SHR; i++; }
-        else { precedence = getPrecedence(RPN_GT); opcode = RPN_GT; }
-        isBinaryOp = true;
-        break;
-      case '=': precedence = getPrecedence(RPN_EQ); opcode = RPN_EQ; isBinaryOp = true; break;
-      default: {
-        compileError = ERR_TOKEN;
-        return 0;
-      }
-    }
+  return true;
+}
 
-    if (isBinaryOp) {
-      if (expectOperand) {
-        compileError = ERR_TOKEN;
-        return 0;
-      }
-      expectOperand = true;
-    }
-    
-    if (opcode == OP_PAREN_OPEN) { // '('
-      if (opStackTop >= MAX_OP_STACK_SIZE) {
-        compileError = ERR_PROGRAM_TOO_LONG;
-        return 0;
-      }
-      opStack[opStackTop++] = opcode;
-      i++;
-    } else if (opcode == OP_PAREN_CLOSE) { // ')'
-      // Pop until '('
-      while (opStackTop > 0 && opStack[opStackTop-1] != OP_PAREN_OPEN) {
-        if (rpnProgramLen >= RPN_PROGRAM_SIZE) {
-          compileError = ERR_PROGRAM_TOO_LONG;
-          return 0;
-        }
-
-        dst[rpnProgramLen].opcode = opStack[--opStackTop];
-        dst[rpnProgramLen].value = 0;
-        rpnProgramLen++;
-        }
-      if (opStackTop > 0) opStackTop--; // remove '('
-      i++;
-      } else {
-      // Pop higher precedence operators
-      while (opStackTop > 0 && opStack[opStackTop-1] != OP_PAREN_OPEN && 
-             (!rightAssoc && precedence <= getPrecedence(opStack[opStackTop-1]) ||
-              rightAssoc && precedence < getPrecedence(opStack[opStackTop-1]))) {
-        if (rpnProgramLen >= RPN_PROGRAM_SIZE) {
-          compileError = ERR_PROGRAM_TOO_LONG;
-          return 0;
-        }
-        dst[rpnProgramLen].opcode = opStack[--opStackTop];
-        dst[rpnProgramLen].value = 0;
-        rpnProgramLen++;
-      }
+// Decode the instruction at *pc back to opcode and value (RPN_PUSH_CONST
+// reads as RPN_PUSH_NUM) and advance *pc past it. A truncated instruction
+// ends the program; bad pool indices read as 0.
+static uint8_t decodeRPN(const struct RpnProgram* program, uint16_t* pc, uint32_t* value) {
+  const uint8_t* code = program->code;
+  uint8_t opcode = code[*pc];
+  uint16_t at = *pc + 1;
+  uint8_t size = opcode < RPN_OPCODE_COUNT ? operandBytes[opcode] : 0;
 
-      if (opStackTop >= MAX_OP_STACK_SIZE) {
-        compileError = ERR_PROGRAM_TOO_LONG;
-        return 0;
-      }
+  *value = 0;
+  if (at + size > program->length) {
+    *pc = program->length;
+    return RPN_OPCODE_COUNT;
+  }
+  *pc = at + size;
 
-      opStack[opStackTop++] = opcode;
-      i++;
-    }
+  switch (opcode) {
+    case RPN_PUSH_NUM:
+    case RPN_STORE:
+    case RPN_LOAD:
+      *value = code[at];
+      break;
+
+    case RPN_PUSH_CONST:
+    case RPN_DIVC:
+    case RPN_MODC:
+      if (code[at] < program->poolSize) *value = program->pool[code[at]];
+      if (opcode == RPN_PUSH_CONST) opcode = RPN_PUSH_NUM;
+      break;
+
+    case RPN_CACHE:
+      *value = (code[at] >> 5) | ((uint32_t)(code[at] & 31) << 8) | ((uint32_t)code[at + 1] << 16);
+      break;
   }
 
-  // Missing operand
-  if (expectOperand) {
-    compileError = ERR_TOKEN;
-    return 0;
+  return opcode;
+}
+
+// Remove all RPN_CACHE markers; they never nest, so the others stay valid
+static uint8_t stripCacheMarkers(struct RpnInstruction* program, uint8_t program_len) {
+  uint8_t len = 0;
+  for (uint8_t pc = 0; pc < program_len; pc++) {
+    if (program[pc].opcode != RPN_CACHE) program[len++] = program[pc];
   }
+  return len;
+}
+
+void initRPNCompiler(struct RpnCompiler* compiler, uint32_t outputMask) {
+  compiler->outputMask = outputMask;
+  compiler->error = ERR_NONE;
+  compiler->errorPos = 0;
+  compiler->rawLength = 0;
+}
+
+// Parse, optimize and emit, then encode and verify: an optimized program of
+// at most RPN_PROGRAM_SIZE bytecode bytes that needs at most RPN_STACK_SIZE
+// stack entries. Only the result bits in outputMask are guaranteed to be
+// right.
+uint16_t compileRPN(const char* text, uint16_t length, struct RpnProgram* dst,
+                    struct RpnCompiler* compiler) {
+  struct RpnIr* ir = &compiler->ir;
+  dst->length = 0;
+  dst->poolSize = 0;
+  compiler->rawLength = 0;
+  compiler->errorPos = 0;
+  compiler->error = parseExpression(text, length, ir, &compiler->errorPos);
+  if (compiler->error != ERR_NONE) return 0;
 
-  // Missing closing parenthesis
-  if (numParentheses > 0) {
-    compileError = ERR_PAREN;
+  compiler->rawLength = ir->rawLength;
+  optimizeIR(ir, compiler->outputMask, RPN_COMPILE_SIZE);
+  if (emitIR(ir, NULL, RPN_COMPILE_SIZE) > RPN_COMPILE_SIZE) {
+    compiler->error = ERR_PROGRAM_TOO_LONG;
     return 0;
   }
-  
-  // Pop remaining operators
-  while (opStackTop > 0) {
-    if (rpnProgramLen >= RPN_PROGRAM_SIZE) {
-      compileError = ERR_PROGRAM_TOO_LONG;
+  uint8_t len = emitIR(ir, compiler->code, RPN_COMPILE_SIZE);
+
+  // Cache markers are optional, drop them before giving up on the length
+  if (!encodeRPN(compiler->code, len, dst)) {
+    len = stripCacheMarkers(compiler->code, len);
+    if (!encodeRPN(compiler->code, len, dst)) {
+      compiler->error = ERR_PROGRAM_TOO_LONG;
+      dst->length = 0;
       return 0;
     }
+  }
 
-    dst[rpnProgramLen].opcode = opStack[--opStackTop];
-    dst[rpnProgramLen].value = 0;
-    rpnProgramLen++;
+  // Reject programs the fixed-size VM stack cannot hold
+  uint8_t depth;
+  if (!verifyRPN(dst, &depth) || depth > RPN_STACK_SIZE) {
+    compiler->error = ERR_STACK;
+    dst->length = 0;
+    return 0;
   }
-  
-  return rpnProgramLen;
+
+  return dst->length;
+}
+
+// Compile textBuffer with compileOutputMask. compileRawLen receives the
+// instruction count before optimization.
+uint16_t compileToRPN(struct RpnProgram *dst) {
+  initRPNCompiler(&sharedCompiler, compileOutputMask);
+  uint16_t length = compileRPN(textBuffer, TEXT_BUFFER_SIZE, dst, &sharedCompiler);
+  compileRawLen = sharedCompiler.rawLength;
+  compileError = sharedCompiler.error;
+  return length;
+}
+
+// Quotient of x by the constant encoded in a RPN_DIVC/RPN_MODC instruction
+static inline uint32_t divideByMagic(uint32_t x, uint32_t m, uint32_t encoded) {
+  uint32_t hi = (uint32_t)(((uint64_t)x * m) >> 32);
+  return (hi + ((x - hi) >> 1)) >> (encoded & 31);
 }
 
 // Execute RPN program
-uint32_t executeRPN(uint32_t tval, const struct RpnInstruction* program, uint8_t program_len) {
+uint32_t executeRPN(uint32_t tval, const struct RpnProgram* program) {
   uint32_t stack[RPN_STACK_SIZE];
+  uint32_t regs[RPN_REG_COUNT] = {0};
   uint8_t stackTop = 0;
   
-  for (uint8_t pc = 0; pc < program_len; pc++) {
-    uint8_t opcode = program[pc].opcode;
+  for (uint16_t pc = 0; pc < program->length;) {
+    uint32_t value;
+    uint8_t opcode = decodeRPN(program, &pc, &value);
     
     switch (opcode) {
       case RPN_PUSH_T:
@@ -356,7 +241,7 @@ uint32_t executeRPN(uint32_t tval, const struct RpnInstruction* program, uint8_t
         break;
         
       case RPN_PUSH_NUM:
-        if (stackTop < RPN_STACK_SIZE) stack[stackTop++] = program[pc].value;
+        if (stackTop < RPN_STACK_SIZE) stack[stackTop++] = value;
         break;
         
       case RPN_ADD:
@@ -399,6 +284,22 @@ uint32_t executeRPN(uint32_t tval, const struct RpnInstruction* program, uint8_t
         }
         break;
         
+      case RPN_DIVC:
+        if (stackTop >= 2) {
+          uint32_t m = stack[--stackTop];
+          uint32_t a = stack[--stackTop];
+          stack[stackTop++] = divideByMagic(a, m, value);
+        }
+        break;
+
+      case RPN_MODC:
+        if (stackTop >= 2) {
+          uint32_t m = stack[--stackTop];
+          uint32_t a = stack[--stackTop];
+          stack[stackTop++] = a - divideByMagic(a, m, value) * (value >> 5);
+        }
+        break;
+        
       case RPN_AND:
         if (stackTop >= 2) {
           uint32_t b = stack[--stackTop];
@@ -502,8 +403,599 @@ uint32_t executeRPN(uint32_t tval, const struct RpnInstruction* program, uint8_t
           stack[stackTop++] = a != b;
         }
         break;
+
+      case RPN_CACHE:
+        // Only block renderers with a RpnCache use the marker
+        break;
+
+      case RPN_DUP:
+        if (stackTop >= 1 && stackTop < RPN_STACK_SIZE) {
+          stack[stackTop] = stack[stackTop - 1];
+          stackTop++;
+        }
+        break;
+
+      case RPN_STORE:
+        if (stackTop >= 1 && value < RPN_REG_COUNT) {
+          regs[value] = stack[stackTop - 1];
+        }
+        break;
+
+      case RPN_LOAD:
+        if (stackTop < RPN_STACK_SIZE && value < RPN_REG_COUNT) {
+          stack[stackTop++] = regs[value];
+        }
+        break;
+
+      case RPN_SWAP:
+        if (stackTop >= 2) {
+          uint32_t b = stack[stackTop - 1];
+          stack[stackTop - 1] = stack[stackTop - 2];
+          stack[stackTop - 2] = b;
+        }
+        break;
     }
   }
   
   return stackTop > 0 ? stack[stackTop - 1] : 0;
 }
+
+// Check that a program never pops an empty stack, leaves exactly one result,
+// only uses known opcodes with complete operands and valid pool indices and
+// never loads a register before storing it. max_depth receives the deepest
+// stack reached.
+bool verifyRPN(const struct RpnProgram* program, uint8_t* max_depth) {
+  uint8_t depth = 0;
+  uint8_t deepest = 0;
+  // End offset and expected depth after the current RPN_CACHE subtree
+  int32_t cacheEnd = -1;
+  uint8_t cacheDepth = 0;
+  // Registers stored so far. Stores inside a cached subtree are skipped on a
+  // cache hit, so they only count until the end of that subtree.
+  uint8_t stored = 0;
+  uint8_t storedInCache = 0;
+
+  if (program->length > RPN_PROGRAM_SIZE || program->poolSize > RPN_POOL_SIZE) return false;
+
+  for (uint16_t pc = 0; pc < program->length;) {
+    uint8_t opcode = program->code[pc];
+    if (opcode >= RPN_OPCODE_COUNT || pc + 1 + operandBytes[opcode] > program->length) return false;
+    if ((opcode == RPN_PUSH_CONST || opcode == RPN_DIVC || opcode == RPN_MODC) &&
+        program->code[pc + 1] >= program->poolSize) {
+      return false;
+    }
+
+    uint32_t value;
+    decodeRPN(program, &pc, &value);
+
+    switch (opcode) {
+      case RPN_CACHE: {
+        uint32_t length = (value >> 16) & 0xFF;
+        if (cacheEnd >= 0 || (value & 0xFF) >= RPN_CACHE_SLOTS || length == 0 ||
+            pc + length > program->length) {
+          return false;
+        }
+        cacheEnd = pc + length;
+        cacheDepth = depth + 1;
+        continue;
+      }
+
+      case RPN_PUSH_T:
+      case RPN_PUSH_NUM:
+      case RPN_PUSH_CONST:
+        depth++;
+        if (depth > deepest) deepest = depth;
+        break;
+
+      case RPN_NOT:
+      case RPN_NEG:
+        if (depth < 1) return false;
+        break;
+
+      case RPN_SWAP:
+        if (depth < 2) return false;
+        break;
+
+      case RPN_DUP:
+        if (depth < 1) return false;
+        depth++;
+        if (depth > deepest) deepest = depth;
+        break;
+
+      case RPN_STORE:
+        if (depth < 1 || value >= RPN_REG_COUNT) return false;
+        if (cacheEnd >= 0) {
+          storedInCache |= 1u << value;
+        } else {
+          stored |= 1u << value;
+        }
+        break;
+
+      case RPN_LOAD:
+        if (value >= RPN_REG_COUNT || !((stored | storedInCache) & (1u << value))) {
+          return false;
+        }
+        depth++;
+        if (depth > deepest) deepest = depth;
+        break;
+
+      default:
+        if (depth < 2) return false;
+        depth--;
+        break;
+    }
+
+    // A cached subtree has to end on an instruction boundary and leave
+    // exactly its one value on the stack
+    if (cacheEnd >= 0 && pc >= cacheEnd) {
+      if (pc != cacheEnd || depth != cacheDepth) return false;
+      cacheEnd = -1;
+      storedInCache = 0;
+    }
+  }
+
+  if (max_depth) *max_depth = deepest;
+  return program->length == 0 || depth == 1;
+}
+
+#if RPN_DISPATCH_THREADED
+// Threaded interpreter for verified programs: every handler jumps straight to
+// the next one through a computed goto, the top of stack lives in a local
+// (register) instead of the stack array, and no stack bounds are checked.
+uint32_t executeRPNVerified(uint32_t tval, const struct RpnProgram* program) {
+  static const void* const dispatch[RPN_OPCODE_COUNT] = {
+    [RPN_PUSH_T] = &&op_push_t, [RPN_PUSH_NUM] = &&op_push_num,
+    [RPN_ADD] = &&op_add, [RPN_SUB] = &&op_sub, [RPN_MUL] = &&op_mul,
+    [RPN_DIV] = &&op_div, [RPN_MOD] = &&op_mod, [RPN_AND] = &&op_and,
+    [RPN_OR] = &&op_or,   [RPN_XOR] = &&op_xor, [RPN_NOT] = &&op_not,
+    [RPN_NEG] = &&op_neg, [RPN_SHL] = &&op_shl, [RPN_SHR] = &&op_shr,
+    [RPN_LT] = &&op_lt,   [RPN_GT] = &&op_gt,   [RPN_EQ] = &&op_eq,
+    [RPN_LE] = &&op_le,   [RPN_GE] = &&op_ge,   [RPN_NE] = &&op_ne,
+    [RPN_DIVC] = &&op_divc, [RPN_MODC] = &&op_modc, [RPN_CACHE] = &&op_cache,
+    [RPN_DUP] = &&op_dup, [RPN_STORE] = &&op_store, [RPN_LOAD] = &&op_load,
+    [RPN_SWAP] = &&op_swap, [RPN_PUSH_CONST] = &&op_push_const
+  };
+
+  // stack[i + 1] holds entry i; the topmost entry is cached in tos
+  uint32_t stack[RPN_STACK_SIZE + 1];
+  uint32_t regs[RPN_REG_COUNT];
+  uint32_t* sp = stack;
+  uint32_t tos = 0;
+  const uint32_t* pool = program->pool;
+  const uint8_t* ip = program->code;
+  const uint8_t* end = ip + program->length;
+
+#define NEXT() \
+  do { \
+    if (ip == end) goto done; \
+    goto *dispatch[*ip++]; \
+  } while (0)
+
+#define THREADED_BINARY_OP(label, EXPR) \
+  label: { \
+    uint32_t x = *sp--, y = tos; \
+    tos = (EXPR); \
+  } \
+  NEXT()
+
+  NEXT();
+
+op_push_t:
+  *++sp = tos;
+  tos = tval;
+  NEXT();
+op_push_num:
+  *++sp = tos;
+  tos = *ip++;
+  NEXT();
+op_push_const:
+  *++sp = tos;
+  tos = pool[*ip++];
+  NEXT();
+op_not:
+  tos = ~tos;
+  NEXT();
+op_neg:
+  tos = (uint32_t)(-(int32_t)tos);
+  NEXT();
+op_cache:
+  ip += 2;
+  NEXT();
+op_dup:
+  *++sp = tos;
+  NEXT();
+op_store:
+  regs[*ip++] = tos;
+  NEXT();
+op_load:
+  *++sp = tos;
+  tos = regs[*ip++];
+  NEXT();
+op_swap: {
+    uint32_t x = *sp;
+    *sp = tos;
+    tos = x;
+  }
+  NEXT();
+op_divc: {
+    uint32_t encoded = pool[*ip++];
+    uint32_t x = *sp--;
+    tos = divideByMagic(x, tos, encoded);
+  }
+  NEXT();
+op_modc: {
+    uint32_t encoded = pool[*ip++];
+    uint32_t x = *sp--;
+    tos = x - divideByMagic(x, tos, encoded) * (encoded >> 5);
+  }
+  NEXT();
+
+  THREADED_BINARY_OP(op_add, x + y);
+  THREADED_BINARY_OP(op_sub, x - y);
+  THREADED_BINARY_OP(op_mul, x * y);
+  THREADED_BINARY_OP(op_div, y ? x / y : 0);
+  THREADED_BINARY_OP(op_mod, y ? x % y : 0);
+  THREADED_BINARY_OP(op_and, x & y);
+  THREADED_BINARY_OP(op_or,  x | y);
+  THREADED_BINARY_OP(op_xor, x ^ y);
+  THREADED_BINARY_OP(op_shl, x << (y & 31));
+  THREADED_BINARY_OP(op_shr, x >> (y & 31));
+  THREADED_BINARY_OP(op_lt,  x < y);
+  THREADED_BINARY_OP(op_gt,  x > y);
+  THREADED_BINARY_OP(op_eq,  x == y);
+  THREADED_BINARY_OP(op_le,  x <= y);
+  THREADED_BINARY_OP(op_ge,  x >= y);
+  THREADED_BINARY_OP(op_ne,  x != y);
+
+done:
+  return tos;
+
+#undef NEXT
+#undef THREADED_BINARY_OP
+}
+
+#else
+// Apply a binary operator to the two topmost stack entries, unchecked
+#define VERIFIED_BINARY_OP(EXPR) { \
+    uint32_t y = stack[--stackTop]; \
+    uint32_t x = stack[stackTop - 1]; \
+    stack[stackTop - 1] = (EXPR); \
+  } \
+  break
+
+// Switch interpreter for verified programs: same as executeRPN() minus the
+// stack bounds checks
+uint32_t executeRPNVerified(uint32_t tval, const struct RpnProgram* program) {
+  uint32_t stack[RPN_STACK_SIZE];
+  uint32_t regs[RPN_REG_COUNT];
+  uint8_t stackTop = 0;
+  const uint32_t* pool = program->pool;
+  const uint8_t* ip = program->code;
+  const uint8_t* end = ip + program->length;
+
+  while (ip < end) {
+    switch (*ip++) {
+      case RPN_PUSH_T:     stack[stackTop++] = tval; break;
+      case RPN_PUSH_NUM:   stack[stackTop++] = *ip++; break;
+      case RPN_PUSH_CONST: stack[stackTop++] = pool[*ip++]; break;
+      case RPN_NOT:        stack[stackTop - 1] = ~stack[stackTop - 1]; break;
+      case RPN_NEG:        stack[stackTop - 1] = (uint32_t)(-(int32_t)stack[stackTop - 1]); break;
+      case RPN_ADD:  VERIFIED_BINARY_OP(x + y);
+      case RPN_SUB:  VERIFIED_BINARY_OP(x - y);
+      case RPN_MUL:  VERIFIED_BINARY_OP(x * y);
+      case RPN_DIV:  VERIFIED_BINARY_OP(y ? x / y : 0);
+      case RPN_MOD:  VERIFIED_BINARY_OP(y ? x % y : 0);
+      case RPN_AND:  VERIFIED_BINARY_OP(x & y);
+      case RPN_OR:   VERIFIED_BINARY_OP(x | y);
+      case RPN_XOR:  VERIFIED_BINARY_OP(x ^ y);
+      case RPN_SHL:  VERIFIED_BINARY_OP(x << (y & 31));
+      case RPN_SHR:  VERIFIED_BINARY_OP(x >> (y & 31));
+      case RPN_LT:   VERIFIED_BINARY_OP(x < y);
+      case RPN_GT:   VERIFIED_BINARY_OP(x > y);
+      case RPN_EQ:   VERIFIED_BINARY_OP(x == y);
+      case RPN_LE:   VERIFIED_BINARY_OP(x <= y);
+      case RPN_GE:   VERIFIED_BINARY_OP(x >= y);
+      case RPN_NE:   VERIFIED_BINARY_OP(x != y);
+      case RPN_DIVC: {
+        uint32_t encoded = pool[*ip++];
+        VERIFIED_BINARY_OP(divideByMagic(x, y, encoded));
+      }
+      case RPN_MODC: {
+        uint32_t encoded = pool[*ip++];
+        VERIFIED_BINARY_OP(x - divideByMagic(x, y, encoded) * (encoded >> 5));
+      }
+      case RPN_CACHE: ip += 2; break;
+      case RPN_DUP:   stack[stackTop] = stack[stackTop - 1]; stackTop++; break;
+      case RPN_STORE: regs[*ip++] = stack[stackTop - 1]; break;
+      case RPN_LOAD:  stack[stackTop++] = regs[*ip++]; break;
+      case RPN_SWAP: {
+        uint32_t y = stack[stackTop - 1];
+        stack[stackTop - 1] = stack[stackTop - 2];
+        stack[stackTop - 2] = y;
+        break;
+      }
+    }
+  }
+
+  return stackTop > 0 ? stack[stackTop - 1] : 0;
+}
+#endif
+
+// Lanes of the block interpreter. With RPN_BLOCK_VECTOR a stack slot is one
+// GCC/Clang vector of RPN_BLOCK_SIZE uint32_t that the compiler lowers to
+// SSE2, AVX2, NEON or plain registers for the target; otherwise it is an
+// array of RPN_BLOCK_SIZE scalars. The operator code is written once for
+// both: it loops over BLOCK_LANE_GROUPS, which is 1 for vectors.
+#if RPN_BLOCK_VECTOR
+typedef uint32_t BlockLanes __attribute__((vector_size(RPN_BLOCK_SIZE * sizeof(uint32_t))));
+typedef uint64_t BlockWideLanes __attribute__((vector_size(RPN_BLOCK_SIZE * sizeof(uint64_t))));
+typedef double BlockRealLanes __attribute__((vector_size(RPN_BLOCK_SIZE * sizeof(double))));
+#define BLOCK_LANE_GROUPS 1
+// Truncated double division is exact for 32-bit operands and, unlike integer
+// division, exists as a vector instruction
+#define BLOCK_QUOTIENT(x, y) \
+  __builtin_convertvector(__builtin_convertvector(x, BlockRealLanes) / \
+                          __builtin_convertvector(y, BlockRealLanes), BlockLanes)
+#define BLOCK_MUL_HIGH(x, m) \
+  __builtin_convertvector((__builtin_convertvector(x, BlockWideLanes) * \
+                           __builtin_convertvector(m, BlockWideLanes)) >> 32, BlockLanes)
+#else
+typedef uint32_t BlockLanes;
+#define BLOCK_LANE_GROUPS RPN_BLOCK_SIZE
+#define BLOCK_QUOTIENT(x, y) ((x) / (y))
+#define BLOCK_MUL_HIGH(x, m) ((uint32_t)(((uint64_t)(x) * (m)) >> 32))
+#endif
+
+// Comparison result as 0/1 per lane (vector comparisons give 0/-1)
+#define BLOCK_BOOL(c) ((BlockLanes)(c) & 1)
+
+// divideByMagic() on all lanes. Macros rather than functions: vectors this
+// wide are not passed in registers.
+#define BLOCK_MAGIC_QUOTIENT(x, hi, encoded) (((hi) + (((x) - (hi)) >> 1)) >> ((encoded) & 31))
+#define BLOCK_DIVIDE_BY_MAGIC(x, m, encoded) BLOCK_MAGIC_QUOTIENT(x, BLOCK_MUL_HIGH(x, m), encoded)
+
+// Generic x86-64 builds compile the block interpreter twice and pick the AVX2
+// version at load time when the CPU has it (ifunc: GCC on glibc)
+#if RPN_BLOCK_VECTOR && defined(__x86_64__) && !defined(__AVX2__) && \
+    defined(__GLIBC__) && defined(__GNUC__) && !defined(__clang__)
+#define BLOCK_TARGET_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define BLOCK_TARGET_CLONES
+#endif
+
+// Apply a binary operator to the two topmost block stack entries
+#define BLOCK_BINARY_OP(EXPR) \
+  if (stackTop >= 2) { \
+    BlockLanes* a = stack[stackTop - 2]; \
+    const BlockLanes* b = stack[stackTop - 1]; \
+    for (uint32_t i = 0; i < BLOCK_LANE_GROUPS; i++) { \
+      BlockLanes x = a[i], y = b[i]; \
+      a[i] = (EXPR); \
+    } \
+    stackTop--; \
+  } \
+  break
+
+// Division and modulo by zero give 0 like in executeRPN(). Without a
+// per-lane branch: such lanes divide by 1 and are masked to 0.
+#define BLOCK_NONZERO(y) ((y) | BLOCK_BOOL((y) == 0))
+#define BLOCK_ZERO_MASK(y) (BLOCK_BOOL((y) == 0) - 1)
+
+// Shift by the top entry. A count that is the same in every lane is applied
+// as one scalar count: SSE2 has no per-lane variable shift.
+#define BLOCK_SHIFT_OP(OP) \
+  if (stackTop >= 2 && (uniform >> (stackTop - 1) & 1)) { \
+    uint32_t n = uniformValue[stackTop - 1] & 31; \
+    BlockLanes* a = stack[stackTop - 2]; \
+    for (uint32_t i = 0; i < BLOCK_LANE_GROUPS; i++) a[i] = a[i] OP n; \
+    stackTop--; \
+    break; \
+  } \
+  BLOCK_BINARY_OP(x OP (y & 31))
+
+static inline void blockBroadcast(BlockLanes* d, uint32_t v) {
+  for (uint32_t i = 0; i < BLOCK_LANE_GROUPS; i++) d[i] = v + (BlockLanes){0};
+}
+
+// Evaluate up to RPN_BLOCK_SIZE consecutive t values. The program is walked
+// once and every opcode is applied to all lanes, so dispatch is paid once per
+// block instead of once per sample. Stack behaviour matches executeRPN().
+// RPN_CACHE subtrees are skipped while their t >> shift key is unchanged.
+// All RPN_BLOCK_SIZE lanes are computed; only count of them are written out.
+BLOCK_TARGET_CLONES
+static void executeRPNChunk(uint32_t t0, uint32_t count, const struct RpnProgram* program,
+                            struct RpnCache* cache, uint8_t* out) {
+  BlockLanes stack[RPN_STACK_SIZE][BLOCK_LANE_GROUPS];
+  BlockLanes regs[RPN_REG_COUNT][BLOCK_LANE_GROUPS];
+  BlockLanes ramp[BLOCK_LANE_GROUPS];
+  uint32_t lanes[RPN_BLOCK_SIZE];
+  uint8_t stackTop = 0;
+
+  // Stack slots known to hold the same value in every lane
+  uint8_t uniform = 0;
+  uint32_t uniformValue[RPN_STACK_SIZE];
+
+  for (uint32_t i = 0; i < RPN_BLOCK_SIZE; i++) lanes[i] = i;
+  memcpy(ramp, lanes, sizeof(ramp));
+  memset(regs, 0, sizeof(regs));
+
+  // Cached subtree being evaluated: its value is stored once pc reaches storeAt
+  int32_t storeAt = -1;
+  uint8_t storeSlot = 0;
+  uint32_t storeKey = 0;
+
+  for (uint16_t pc = 0; pc < program->length;) {
+    uint32_t value;
+    uint8_t opcode = decodeRPN(program, &pc, &value);
+    bool broadcast = false;
+
+    switch (opcode) {
+      case RPN_PUSH_T:
+        if (stackTop < RPN_STACK_SIZE) {
+          BlockLanes* d = stack[stackTop++];
+          for (uint32_t i = 0; i < BLOCK_LANE_GROUPS; i++) d[i] = t0 + ramp[i];
+        }
+        break;
+
+      case RPN_PUSH_NUM:
+        if (stackTop < RPN_STACK_SIZE) {
+          uniformValue[stackTop] = value;
+          blockBroadcast(stack[stackTop++], value);
+          broadcast = true;
+        }
+        break;
+
+      case RPN_CACHE: {
+        uint8_t slot = value & 0xFF;
+        uint8_t shift = (value >> 8) & 31;
+        uint8_t length = (value >> 16) & 0xFF;
+        uint32_t firstKey = t0 >> shift;
+        uint32_t lastKey = (t0 + count - 1) >> shift;
+
+        // Malformed markers are ignored like in the other interpreters
+        if (slot >= RPN_CACHE_SLOTS || pc + length > program->length) break;
+
+        if (firstKey == lastKey && (cache->valid & (1u << slot)) &&
+            cache->key[slot] == firstKey && stackTop < RPN_STACK_SIZE) {
+          uniformValue[stackTop] = cache->value[slot];
+          blockBroadcast(stack[stackTop++], cache->value[slot]);
+          broadcast = true;
+          pc += length;
+        } else {
+          // Evaluate the subtree normally and keep the last lane's value,
+          // which is the one the next block starts from
+          storeAt = pc + length;
+          storeSlot = slot;
+          storeKey = lastKey;
+        }
+        break;
+      }
+
+      case RPN_ADD: BLOCK_BINARY_OP(x + y);
+      case RPN_SUB: BLOCK_BINARY_OP(x - y);
+      case RPN_MUL: BLOCK_BINARY_OP(x * y);
+      case RPN_DIV: BLOCK_BINARY_OP(BLOCK_QUOTIENT(x, BLOCK_NONZERO(y)) & BLOCK_ZERO_MASK(y));
+      case RPN_MOD: BLOCK_BINARY_OP((x - BLOCK_QUOTIENT(x, BLOCK_NONZERO(y)) * y) & BLOCK_ZERO_MASK(y));
+      case RPN_DIVC: {
+        uint32_t encoded = value;
+        BLOCK_BINARY_OP(BLOCK_DIVIDE_BY_MAGIC(x, y, encoded));
+      }
+      case RPN_MODC: {
+        uint32_t encoded = value;
+        uint32_t d = encoded >> 5;
+        BLOCK_BINARY_OP(x - BLOCK_DIVIDE_BY_MAGIC(x, y, encoded) * d);
+      }
+      case RPN_AND: BLOCK_BINARY_OP(x & y);
+      case RPN_OR:  BLOCK_BINARY_OP(x | y);
+      case RPN_XOR: BLOCK_BINARY_OP(x ^ y);
+      case RPN_SHL: BLOCK_SHIFT_OP(<<);
+      case RPN_SHR: BLOCK_SHIFT_OP(>>);
+      case RPN_LT:  BLOCK_BINARY_OP(BLOCK_BOOL(x < y));
+      case RPN_GT:  BLOCK_BINARY_OP(BLOCK_BOOL(x > y));
+      case RPN_EQ:  BLOCK_BINARY_OP(BLOCK_BOOL(x == y));
+      case RPN_LE:  BLOCK_BINARY_OP(BLOCK_BOOL(x <= y));
+      case RPN_GE:  BLOCK_BINARY_OP(BLOCK_BOOL(x >= y));
+      case RPN_NE:  BLOCK_BINARY_OP(BLOCK_BOOL(x != y));
+
+      case RPN_NOT:
+        if (stackTop >= 1) {
+          BlockLanes* a = stack[stackTop - 1];
+          for (uint32_t i = 0; i < BLOCK_LANE_GROUPS; i++) a[i] = ~a[i];
+        }
+        break;
+
+      case RPN_NEG:
+        if (stackTop >= 1) {
+          BlockLanes* a = stack[stackTop - 1];
+          for (uint32_t i = 0; i < BLOCK_LANE_GROUPS; i++) a[i] = 0 - a[i];
+        }
+        break;
+
+      case RPN_DUP:
+        if (stackTop >= 1 && stackTop < RPN_STACK_SIZE) {
+          memcpy(stack[stackTop], stack[stackTop - 1], sizeof(stack[0]));
+          stackTop++;
+        }
+        break;
+
+      case RPN_STORE:
+        if (stackTop >= 1 && value < RPN_REG_COUNT) {
+          memcpy(regs[value], stack[stackTop - 1], sizeof(stack[0]));
+        }
+        break;
+
+      case RPN_LOAD:
+        if (stackTop < RPN_STACK_SIZE && value < RPN_REG_COUNT) {
+          memcpy(stack[stackTop++], regs[value], sizeof(stack[0]));
+        }
+        break;
+
+      case RPN_SWAP:
+        if (stackTop >= 2) {
+          BlockLanes* a = stack[stackTop - 2];
+          BlockLanes* b = stack[stackTop - 1];
+          for (uint32_t i = 0; i < BLOCK_LANE_GROUPS; i++) {
+            BlockLanes x = a[i];
+            a[i] = b[i];
+            b[i] = x;
+          }
+          // Both slots change; carry the uniform state across
+          uint8_t lower = uniform >> (stackTop - 2) & 1;
+          uint8_t upper = uniform >> (stackTop - 1) & 1;
+          uint32_t v = uniformValue[stackTop - 2];
+          uniformValue[stackTop - 2] = uniformValue[stackTop - 1];
+          uniformValue[stackTop - 1] = v;
+          uniform &= ~(3u << (stackTop - 2));
+          uniform |= (upper | lower << 1) << (stackTop - 2);
+          broadcast = lower;
+        }
+        break;
+    }
+
+    // Every opcode writes at most the top slot
+    if (stackTop > 0) {
+      uint8_t topBit = 1u << (stackTop - 1);
+      uniform = broadcast ? (uniform | topBit) : (uniform & ~topBit);
+    }
+
+    if (pc == storeAt) {
+      if (stackTop > 0) {
+        memcpy(lanes, stack[stackTop - 1], sizeof(lanes));
+        cache->key[storeSlot] = storeKey;
+        cache->value[storeSlot] = lanes[count - 1];
+        cache->valid |= 1u << storeSlot;
+      }
+      storeAt = -1;
+    }
+  }
+
+  if (stackTop > 0) {
+    memcpy(lanes, stack[stackTop - 1], sizeof(lanes));
+    for (uint32_t i = 0; i < count; i++) out[i] = (uint8_t)lanes[i];
+  } else {
+    memset(out, 0, count);
+  }
+}
+
+void resetRPNCache(struct RpnCache* cache) {
+  cache->valid = 0;
+}
+
+void executeRPNBlockCached(uint32_t t0, uint32_t n, const struct RpnProgram* program,
+                           struct RpnCache* cache, uint8_t* out) {
+  while (n > 0) {
+    uint32_t count = n < RPN_BLOCK_SIZE ? n : RPN_BLOCK_SIZE;
+    executeRPNChunk(t0, count, program, cache, out);
+    t0 += count;
+    out += count;
+    n -= count;
+  }
+}
+
+// Render n consecutive samples starting at t0 as 8-bit output (low byte of
+// the result, same as the audio path)
+void executeRPNBlock(uint32_t t0, uint32_t n, const struct RpnProgram* program, uint8_t* out) {
+  struct RpnCache cache;
+  resetRPNCache(&cache);
+  executeRPNBlockCached(t0, n, program, &cache, out);
+}
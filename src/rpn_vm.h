@@ -3,9 +3,44 @@
 #include <stdbool.h>
 
 #define TEXT_BUFFER_SIZE 256
-#define MAX_TOKENS 256
 #define RPN_STACK_SIZE 8
-#define RPN_PROGRAM_SIZE 32
+#ifndef RPN_PROGRAM_SIZE
+#define RPN_PROGRAM_SIZE 128 // bytecode bytes per compiled program
+#endif
+#define RPN_POOL_SIZE 16     // literals above 255 per compiled program
+#define RPN_COMPILE_SIZE 128 // parser output limit before optimization
+#define RPN_OUTPUT_MASK 0xFF // result bits the audio output uses
+
+// Interpreter behind executeRPNVerified(): 1 = computed-goto threaded code
+// with the top of stack cached in a register (GCC/Clang), 0 = switch loop
+#ifndef RPN_DISPATCH_THREADED
+#if defined(__GNUC__)
+#define RPN_DISPATCH_THREADED 1
+#else
+#define RPN_DISPATCH_THREADED 0
+#endif
+#endif
+
+// Lanes behind executeRPNBlock(): 1 = GCC/Clang vector types, lowered to
+// SSE2/AVX2/NEON by the compiler, 0 = one loop per opcode over scalar lanes
+// (MSVC, and Cortex-M33, which has no SIMD for 32-bit lanes)
+#ifndef RPN_BLOCK_VECTOR
+#if (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 9)) && !defined(__arm__)
+#define RPN_BLOCK_VECTOR 1
+#else
+#define RPN_BLOCK_VECTOR 0
+#endif
+#endif
+
+// t values evaluated per pass in executeRPNBlock. Vector lanes need longer
+// blocks to amortize decoding; the device keeps its stack frame small.
+#ifndef RPN_BLOCK_SIZE
+#if RPN_BLOCK_VECTOR
+#define RPN_BLOCK_SIZE 128
+#else
+#define RPN_BLOCK_SIZE 16
+#endif
+#endif
 
 enum TokenType {
   TOK_T,
@@ -43,14 +78,12 @@ enum CompileError {
   ERR_PROGRAM_TOO_LONG
 };
 
-struct Token {
-  uint8_t type;
-  uint32_t value;
-};
-
+// Compiled programs are bytecode: a 1-byte opcode followed by the operand
+// bytes noted below, none for the rest. The compiler works on the
+// RpnInstruction form, where every instruction carries a 32-bit value.
 enum RpnOpcode {
   RPN_PUSH_T,
-  RPN_PUSH_NUM,
+  RPN_PUSH_NUM, // bytecode: 1-byte literal; larger ones use RPN_PUSH_CONST
   RPN_ADD,
   RPN_SUB,
   RPN_MUL,
@@ -68,7 +101,44 @@ enum RpnOpcode {
   RPN_EQ,
   RPN_LE,
   RPN_GE,
-  RPN_NE
+  RPN_NE,
+  // Division by a constant d via multiply-high (emitted by optimizeRPN).
+  // Stack operands are (x, m) where m is the magic multiplier; the
+  // instruction value holds (d << 5) | shift.
+  // Bytecode: 1-byte constant pool index of the value.
+  RPN_DIVC,
+  RPN_MODC,
+  // Marks the following subtree as depending on t only through t >> shift.
+  // Value: slot | (shift << 8) | (subtree length << 16). Block renderers
+  // with a RpnCache reuse the slot's value while t >> shift is unchanged;
+  // everything else treats it as a no-op.
+  // Bytecode: shift | (slot << 5), then the subtree length in bytes.
+  RPN_CACHE,
+  // Scratch registers for shared subexpressions (emitted by optimizeRPN).
+  // DUP pushes a copy of the top of stack, STORE copies the top of stack into
+  // register value without popping it and LOAD pushes register value.
+  // Bytecode: 1-byte register for STORE and LOAD.
+  RPN_DUP,
+  RPN_STORE,
+  RPN_LOAD,
+  // Exchange the two topmost entries (emitted by optimizeRPN when evaluating
+  // the right operand of a non-commutative operator first saves stack depth)
+  RPN_SWAP,
+  // Bytecode only: push the constant pool entry given by a 1-byte index
+  RPN_PUSH_CONST,
+  RPN_OPCODE_COUNT
+};
+
+#define RPN_REG_COUNT 4
+
+#define RPN_CACHE_SLOTS 4
+#define RPN_CACHE_MIN_SHIFT 8 // only cache values stable for >= 256 samples
+
+// Values of RPN_CACHE subtrees, keyed by the t >> shift they were computed for
+struct RpnCache {
+  uint32_t key[RPN_CACHE_SLOTS];
+  uint32_t value[RPN_CACHE_SLOTS];
+  uint8_t valid; // bit per slot
 };
 
 struct RpnInstruction {
@@ -76,18 +146,43 @@ struct RpnInstruction {
   uint32_t value;
 };
 
+struct RpnProgram {
+  uint16_t length; // bytes used in code
+  uint8_t poolSize;
+  uint32_t pool[RPN_POOL_SIZE];
+  uint8_t code[RPN_PROGRAM_SIZE];
+};
+
 // Global variables
-extern struct Token expr[MAX_TOKENS];
 extern volatile enum CompileError compileError;
-extern uint8_t expr_len;
 extern char textBuffer[TEXT_BUFFER_SIZE];
 extern uint8_t text_len;
 extern uint8_t cursor;
 extern bool needsRecompile;
 extern bool needsResetT;
+extern uint8_t compileRawLen;
+extern uint32_t compileOutputMask; // result bits compileToRPN() preserves
 
 // Function prototypes
-uint8_t compileToRPN(struct RpnInstruction *dst);
-uint32_t executeRPN(uint32_t tval, const struct RpnInstruction* program, uint8_t program_len);
+// Compile the editor's textBuffer into dst, reporting through compileError
+// and compileRawLen. Returns the bytecode length, 0 on error. Shares one
+// compiler: use compileRPN() (rpn_compile.h) from other threads or for
+// other text.
+uint16_t compileToRPN(struct RpnProgram *dst);
+// Encode compiler output as bytecode; false if it does not fit
+bool encodeRPN(const struct RpnInstruction* program, uint8_t program_len, struct RpnProgram* dst);
+uint32_t executeRPN(uint32_t tval, const struct RpnProgram* program);
+// Fast path without stack checks; program must pass verifyRPN() with a
+// max_depth <= RPN_STACK_SIZE (everything compileToRPN() returns does)
+uint32_t executeRPNVerified(uint32_t tval, const struct RpnProgram* program);
+bool verifyRPN(const struct RpnProgram* program, uint8_t* max_depth);
+// Render n consecutive samples, RPN_BLOCK_SIZE lanes per pass; results are
+// bit-identical to executeRPN()
+void executeRPNBlock(uint32_t t0, uint32_t n, const struct RpnProgram* program, uint8_t* out);
+// Same as executeRPNBlock() but keeps RPN_CACHE values across calls in cache,
+// which must be reset whenever the program changes
+void executeRPNBlockCached(uint32_t t0, uint32_t n, const struct RpnProgram* program,
+                           struct RpnCache* cache, uint8_t* out);
+void resetRPNCache(struct RpnCache* cache);
 uint8_t getPrecedence(uint8_t opcode);
 bool isHexDigit(char c);
@@ -1,5 +1,7 @@
 #include "test_rpn.h"
 #include "rpn_vm.h"
+#include "rpn_compile.h"
+#include "pico/stdlib.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
@@ -10,6 +12,9 @@
 #define RPN_TESTS_ENABLED 1
 #endif
 
+// Samples rendered per executeRPNBlock() call while testing
+#define TEST_BLOCK_SIZE 64
+
 // Function pointer type for C test expressions
 typedef uint32_t (*TestFunction)(uint32_t t);
 
@@ -53,6 +58,50 @@ static uint32_t test_expr_8(uint32_t t) {
     return t*5&t>>7|t*3&t>>10;
 }
 
+static uint32_t test_expr_9(uint32_t t) {
+    return t*(0xdeadbeef>>(4*2)&15)+(t*3)*5;
+}
+
+static uint32_t test_expr_10(uint32_t t) {
+    return (t*1|0)+(t>>3^t>>3)+(t+0)*(0-t)+(t-7-9);
+}
+
+static uint32_t test_expr_11(uint32_t t) {
+    return (t>>4>>3)*(t&t)+(8<t)+(t%1)+(3-t)*(t<<(40&31)); // VM masks shift counts
+}
+
+static uint32_t test_expr_12(uint32_t t) {
+    return t/3+t%7*(t>>4)/10+t*4%16;
+}
+
+static uint32_t test_expr_13(uint32_t t) {
+    return t*2654435761u/1000+t*2246822519u%255+(t>>2)*t/641;
+}
+
+static uint32_t test_expr_14(uint32_t t) {
+    return (t*(t>>9)/7|t*t%100000)+(~t)/0x7ffffff+(~t)%12345678;
+}
+
+static uint32_t test_expr_15(uint32_t t) {
+    return (t*3&t>>5)+(t*3^t>>9)+(((t>>10)*(t>>10)&t)|((t>>10)*(t>>10)*3));
+}
+
+// Demanded bits: only the low byte survives, so the high halves, the
+// 0xFFFF mask and most of each constant can go
+static uint32_t test_expr_16(uint32_t t) {
+    return (((t*t>>8&0xFFFF)|(t<<12))+((t^0xABCD00u)*0x10001u))&0x1FF;
+}
+
+// Division and modulo by zero give 0, as in the VM
+static uint32_t div0(uint32_t a, uint32_t b) { return b ? a / b : 0; }
+static uint32_t mod0(uint32_t a, uint32_t b) { return b ? a % b : 0; }
+
+// Operand order: nested to the right, this needs more than RPN_STACK_SIZE
+// entries unless the deeper operand of each node is evaluated first
+static uint32_t test_expr_17(uint32_t t) {
+    return t-div0(t>>1, (t>>2)-((t>>3)<((t>>4)^((t>>5)-mod0(t>>6, (t>>7)-((t>>8)<<((t*t>>9)&31)))))));
+}
+
 // Test cases array
 static TestCase testCases[] = {
     {
@@ -94,45 +143,111 @@ static TestCase testCases[] = {
         "Mask operations",
         "t*5&t>>7|t*3&t>>10",
         test_expr_8
+    },
+    {
+        "Constant folding",
+        "t*(0xdeadbeef>>(4*2)&15)+(t*3)*5",
+        test_expr_9
+    },
+    {
+        "Algebraic identities",
+        "(t*1|0)+(t>>3^t>>3)+(t+0)*(0-t)+(t-7-9)",
+        test_expr_10
+    },
+    {
+        "Shift and compare rewrites",
+        "(t>>4>>3)*(t&t)+(8<t)+(t%1)+(3-t)*(t<<40)",
+        test_expr_11
+    },
+    {
+        "Division by constants",
+        "t/3+t%7*(t>>4)/10+t*4%16",
+        test_expr_12
+    },
+    {
+        "Large dividends",
+        "t*2654435761/1000+t*2246822519%255+(t>>2)*t/641",
+        test_expr_13
+    },
+    {
+        "Wide divisors",
+        "(t*(t>>9)/7|t*t%100000)+(~t)/0x7ffffff+(~t)%12345678",
+        test_expr_14
+    },
+    {
+        "Shared subexpressions",
+        "(t*3&t>>5)+(t*3^t>>9)+((t>>10)*(t>>10)&t|(t>>10)*(t>>10)*3)",
+        test_expr_15
+    },
+    {
+        "Demanded bits",
+        "((t*t>>8&0xFFFF)|(t<<12))+((t^0xABCD00)*0x10001)&0x1FF",
+        test_expr_16
+    },
+    {
+        "Operand order",
+        "t-((t>>1)/((t>>2)-((t>>3)<((t>>4)^((t>>5)-((t>>6)%((t>>7)-((t>>8)<<(t*t>>9)))))))))",
+        test_expr_17
     }
 };
 
 #define NUM_TEST_CASES (sizeof(testCases) / sizeof(TestCase))
 
+// Keeps benchmark results alive so the loops are not optimized away
+volatile uint32_t benchSink;
+
+// Compiler of the tests, so they leave the expression being edited in
+// textBuffer alone; testCompiler.error reports failures
+static struct RpnCompiler testCompiler;
+
+// Compile an expression for the audio output
+static uint16_t compileExpression(const char* expression, struct RpnProgram* program) {
+    initRPNCompiler(&testCompiler, RPN_OUTPUT_MASK);
+    return compileRPN(expression, strlen(expression), program, &testCompiler);
+}
+
 // Run a single test case
 static bool runTestCase(TestCase* test, uint32_t startT, uint32_t samples, bool verbose) {
     printf("\n=== Testing: %s ===\n", test->name);
     printf("Expression: %s\n", test->expression);
 
     // Compile expression to RPN
-    strncpy(textBuffer, test->expression, TEXT_BUFFER_SIZE - 1);
-    textBuffer[TEXT_BUFFER_SIZE - 1] = '\0';
-    text_len = strlen(textBuffer);
+    struct RpnProgram program;
+    uint16_t program_len = compileExpression(test->expression, &program);
 
-    struct RpnInstruction program[RPN_PROGRAM_SIZE];
-    uint8_t program_len = compileToRPN(program);
-
-    if (compileError != ERR_NONE) {
-        printf("COMPILE ERROR: %d\n", compileError);
+    if (testCompiler.error != ERR_NONE) {
+        printf("COMPILE ERROR: %d\n", testCompiler.error);
         return false;
     }
 
-    printf("Compiled to %d RPN instructions\n", program_len);
+    printf("Compiled to %d bytes, %d constants\n", program_len, program.poolSize);
 
-    // Test sample by sample
+    // Test sample by sample, and the cached block renderer alongside
     uint32_t firstDiffT = 0;
     uint32_t diffCount = 0;
     bool hasDifferences = false;
+    uint8_t block[TEST_BLOCK_SIZE];
+    struct RpnCache cache;
+    resetRPNCache(&cache);
 
     for (uint32_t t = startT; t < startT + samples; t++) {
+        uint32_t blockIndex = (t - startT) % TEST_BLOCK_SIZE;
+        if (blockIndex == 0) {
+            uint32_t remaining = startT + samples - t;
+            executeRPNBlockCached(t, remaining < TEST_BLOCK_SIZE ? remaining : TEST_BLOCK_SIZE,
+                                  &program, &cache, block);
+        }
+
         uint32_t c_result = test->c_function(t);
-        uint32_t vm_result = executeRPN(t, program, program_len);
+        uint32_t vm_result = executeRPN(t, &program);
+        uint32_t fast_result = executeRPNVerified(t, &program);
 
         // Compare only the bottom 8 bits (audio output)
         uint8_t c_byte = (uint8_t)(c_result & 0xFF);
         uint8_t vm_byte = (uint8_t)(vm_result & 0xFF);
+        uint8_t block_byte = block[blockIndex];
 
-        if (c_byte != vm_byte) {
+        if (c_byte != vm_byte || c_byte != block_byte || vm_result != fast_result) {
             if (!hasDifferences) {
                 firstDiffT = t;
                 hasDifferences = true;
@@ -140,11 +255,12 @@ static bool runTestCase(TestCase* test, uint32_t startT, uint32_t samples, bool
             diffCount++;
 
             if (verbose && diffCount <= 10) {
-                printf("  DIFF at t=%lu: C=0x%08lX (%u) VM=0x%08lX (%u) [byte: C=%u VM=%u]\n",
+                printf("  DIFF at t=%lu: C=0x%08lX (%u) VM=0x%08lX (%u) FAST=0x%08lX [byte: C=%u VM=%u BLOCK=%u]\n",
                        (unsigned long)t,
                        (unsigned long)c_result, (unsigned int)c_byte,
                        (unsigned long)vm_result, (unsigned int)vm_byte,
-                       (unsigned int)c_byte, (unsigned int)vm_byte);
+                       (unsigned long)fast_result,
+                       (unsigned int)c_byte, (unsigned int)vm_byte, (unsigned int)block_byte);
             }
         }
     }
@@ -208,6 +324,33 @@ void runSingleTest(int testIndex, uint32_t startT, uint32_t samples, bool verbos
     runTestCase(&testCases[testIndex], startT, samples, verbose);
 }
 
+// Measure executeRPNVerified() throughput on every test case
+void benchAllTests(uint32_t samples) {
+    printf("\n=== executeRPNVerified benchmark (%s dispatch, %lu samples) ===\n",
+           RPN_DISPATCH_THREADED ? "threaded" : "switch", (unsigned long)samples);
+
+    for (int i = 0; i < (int)NUM_TEST_CASES; i++) {
+        struct RpnProgram program;
+        uint16_t program_len = compileExpression(testCases[i].expression, &program);
+        if (testCompiler.error != ERR_NONE) {
+            printf("  [%d] COMPILE ERROR: %d\n", i, testCompiler.error);
+            continue;
+        }
+
+        uint32_t sink = 0;
+        uint64_t start = time_us_64();
+        for (uint32_t t = 0; t < samples; t++) {
+            sink += executeRPNVerified(t, &program);
+        }
+        double ns = (double)(time_us_64() - start) * 1000.0 / samples;
+        benchSink = sink;
+
+        printf("  [%2d] %-28s %3d bytes %8.2f ns/sample\n",
+               i, testCases[i].name, program_len, ns);
+    }
+    printf("\n");
+}
+
 // List all available tests
 void listTests(void) {
     printf("\nAvailable test cases:\n");
@@ -27,6 +27,13 @@ void runAllTests(uint32_t startT, uint32_t samples, bool verbose);
  */
 void runSingleTest(int testIndex, uint32_t startT, uint32_t samples, bool verbose);
 
+/**
+ * Measure executeRPNVerified() ns/sample on every test case
+ *
+ * @param samples Number of samples to evaluate per test case
+ */
+void benchAllTests(uint32_t samples);
+
 /**
  * List all available test cases
  */
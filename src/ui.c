@@ -18,12 +18,13 @@ void ui_init(void) {
 void ui_handle_play_stop(void) {
     isPlaying = !isPlaying;
     if (isPlaying) {
-        t_audio = 0; // Reset t immediately when starting playback
-        audio_enable(true);
+        // Restart t with playback, on the same frame
+        struct AudioCommand batch[] = {{AUDIO_CMD_SEEK, 0, 0}, {AUDIO_CMD_PLAY, 0, 0}};
+        audio_send_now(batch, 2);
         printf("Audio started - Playing: %s\n", textBuffer);
         show_toaster("Audio started");
     } else {
-        audio_enable(false);
+        audio_command(AUDIO_CMD_STOP, 0);
         printf("Audio stopped\n");
         show_toaster("Audio stopped");
     }
@@ -43,6 +44,43 @@ void ui_set_expression(const char* expr) {
     oledDirty = true;
 }
 
+bool ui_set_sample_rate(uint32_t rate) {
+    char msg[24];
+    if (audio_set_sample_rate(rate)) {
+        snprintf(msg, sizeof(msg), "Rate %lu Hz", (unsigned long)rate);
+        printf("Sample rate set: %lu Hz\n", (unsigned long)rate);
+        show_toaster(msg);
+        oledDirty = true;
+        return true;
+    }
+
+    bool known = false;
+    for (int i = 0; i < AUDIO_RATE_COUNT; i++) {
+        if (audio_sample_rates[i] == rate) known = true;
+    }
+    if (known) {
+        printf("Sample rate %lu Hz refused: program needs %lu%% CPU (limit %d%%)\n",
+               (unsigned long)rate, (unsigned long)audio_load_at(rate),
+               AUDIO_LOAD_LIMIT_PERCENT);
+        snprintf(msg, sizeof(msg), "Too slow: %lu", (unsigned long)rate);
+    } else {
+        printf("Unsupported sample rate: %lu Hz\n", (unsigned long)rate);
+        snprintf(msg, sizeof(msg), "Bad rate");
+    }
+    show_toaster(msg);
+    oledDirty = true;
+    return false;
+}
+
+bool ui_step_sample_rate(int step) {
+    uint32_t current = audio_get_sample_rate();
+    int i = 0;
+    while (i < AUDIO_RATE_COUNT - 1 && audio_sample_rates[i] < current) i++;
+    i += step;
+    if (i < 0 || i >= AUDIO_RATE_COUNT) return false;
+    return ui_set_sample_rate(audio_sample_rates[i]);
+}
+
 void ui_show_toaster(const char* msg, uint32_t duration_ms) {
     show_toaster(msg);
     printf("Toaster: %s\n", msg);
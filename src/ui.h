@@ -10,7 +10,6 @@ extern uint8_t current_slot;
 extern volatile bool oledDirty;
 extern bool needsRecompile;
 extern bool needsResetT;
-extern volatile uint32_t t_audio;
 
 // Function prototypes
 void ui_init(void);
@@ -18,3 +17,7 @@ void ui_update(void);
 void ui_set_expression(const char* expr);
 void ui_show_toaster(const char* msg, uint32_t duration_ms);
 void ui_handle_play_stop(void);
+// Switch to rate (Hz) or to the next/previous of audio_sample_rates[];
+// false if the rate is unknown or the program cannot keep up with it
+bool ui_set_sample_rate(uint32_t rate);
+bool ui_step_sample_rate(int step);
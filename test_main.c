@@ -1,15 +1,46 @@
 /**
  * Compare RPN VM output with actual C expressions.
  *
- * Build: gcc -I./src -o test_standalone test_main.c src/rpn_vm.c
+ * Build: gcc -I./src -o test_standalone test_main.c src/rpn_vm.c src/rpn_ir.c src/rpn_opt.c src/rpn_batch.c src/rpn_jit.c src/preset_factory.c src/preset_native.c preset_native_gen.c -lm
  */
 
 #include "rpn_vm.h"
+#include "rpn_opt.h"
+#include "rpn_compile.h"
+#include "rpn_batch.h"
+#include "rpn_jit.h"
+#include "preset.h"
+#include "preset_native.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+// Shard test ranges across POSIX threads (GCC/Clang incl. MinGW); MSVC
+// builds run the shards on the calling thread
+#ifndef TEST_THREADS_ENABLED
+#if defined(_MSC_VER)
+#define TEST_THREADS_ENABLED 0
+#else
+#define TEST_THREADS_ENABLED 1
+#endif
+#endif
+
+#if TEST_THREADS_ENABLED
+#include <pthread.h>
+#include <unistd.h>
+#define SHARED _Atomic
+#else
+#define SHARED
+#endif
 
 #define DEFAULT_NUM_SAMPLES_TO_TEST 10000000
+#define TEST_BLOCK_SIZE 256
+#define TEST_SHARD_SIZE (1u << 20)     // samples per unit of work
+#define TEST_WRAP_WINDOW (1u << 20)    // samples checked on each side of the t wrap
+#define FULL_T_RANGE (1ull << 32)
+#define MAX_TEST_THREADS 256
 
 // ============================================================================
 // Test Framework
@@ -56,6 +87,50 @@ static uint32_t test_expr_8(uint32_t t) {
     return t*5&t>>7|t*3&t>>10;
 }
 
+static uint32_t test_expr_9(uint32_t t) {
+    return t*(0xdeadbeef>>(4*2)&15)+(t*3)*5;
+}
+
+static uint32_t test_expr_10(uint32_t t) {
+    return (t*1|0)+(t>>3^t>>3)+(t+0)*(0-t)+(t-7-9);
+}
+
+static uint32_t test_expr_11(uint32_t t) {
+    return (t>>4>>3)*(t&t)+(8<t)+(t%1)+(3-t)*(t<<(40&31)); // VM masks shift counts
+}
+
+static uint32_t test_expr_12(uint32_t t) {
+    return t/3+t%7*(t>>4)/10+t*4%16;
+}
+
+static uint32_t test_expr_13(uint32_t t) {
+    return t*2654435761u/1000+t*2246822519u%255+(t>>2)*t/641;
+}
+
+static uint32_t test_expr_14(uint32_t t) {
+    return (t*(t>>9)/7|t*t%100000)+(~t)/0x7ffffff+(~t)%12345678;
+}
+
+static uint32_t test_expr_15(uint32_t t) {
+    return (t*3&t>>5)+(t*3^t>>9)+(((t>>10)*(t>>10)&t)|((t>>10)*(t>>10)*3));
+}
+
+// Demanded bits: only the low byte survives, so the high halves, the
+// 0xFFFF mask and most of each constant can go
+static uint32_t test_expr_16(uint32_t t) {
+    return (((t*t>>8&0xFFFF)|(t<<12))+((t^0xABCD00u)*0x10001u))&0x1FF;
+}
+
+// Division and modulo by zero give 0, as in the VM
+static uint32_t div0(uint32_t a, uint32_t b) { return b ? a / b : 0; }
+static uint32_t mod0(uint32_t a, uint32_t b) { return b ? a % b : 0; }
+
+// Operand order: nested to the right, this needs more than RPN_STACK_SIZE
+// entries unless the deeper operand of each node is evaluated first
+static uint32_t test_expr_17(uint32_t t) {
+    return t-div0(t>>1, (t>>2)-((t>>3)<((t>>4)^((t>>5)-mod0(t>>6, (t>>7)-((t>>8)<<((t*t>>9)&31)))))));
+}
+
 // Test cases array
 static TestCase testCases[] = {
     {
@@ -97,80 +172,447 @@ static TestCase testCases[] = {
         "Mask operations",
         "t*5&t>>7|t*3&t>>10",
         test_expr_8
+    },
+    {
+        "Constant folding",
+        "t*(0xdeadbeef>>(4*2)&15)+(t*3)*5",
+        test_expr_9
+    },
+    {
+        "Algebraic identities",
+        "(t*1|0)+(t>>3^t>>3)+(t+0)*(0-t)+(t-7-9)",
+        test_expr_10
+    },
+    {
+        "Shift and compare rewrites",
+        "(t>>4>>3)*(t&t)+(8<t)+(t%1)+(3-t)*(t<<40)",
+        test_expr_11
+    },
+    {
+        "Division by constants",
+        "t/3+t%7*(t>>4)/10+t*4%16",
+        test_expr_12
+    },
+    {
+        "Large dividends",
+        "t*2654435761/1000+t*2246822519%255+(t>>2)*t/641",
+        test_expr_13
+    },
+    {
+        "Wide divisors",
+        "(t*(t>>9)/7|t*t%100000)+(~t)/0x7ffffff+(~t)%12345678",
+        test_expr_14
+    },
+    {
+        "Shared subexpressions",
+        "(t*3&t>>5)+(t*3^t>>9)+((t>>10)*(t>>10)&t|(t>>10)*(t>>10)*3)",
+        test_expr_15
+    },
+    {
+        "Demanded bits",
+        "((t*t>>8&0xFFFF)|(t<<12))+((t^0xABCD00)*0x10001)&0x1FF",
+        test_expr_16
+    },
+    {
+        "Operand order",
+        "t-((t>>1)/((t>>2)-((t>>3)<((t>>4)^((t>>5)-((t>>6)%((t>>7)-((t>>8)<<(t*t>>9)))))))))",
+        test_expr_17
     }
 };
 
 #define NUM_TEST_CASES (sizeof(testCases) / sizeof(TestCase))
 
-// Run a single test case
-static bool runTestCase(TestCase* test, uint32_t startT, uint32_t samples, bool verbose) {
+// Keeps benchmark results alive so the loops are not optimized away
+volatile uint32_t benchSink;
+
+// Compiler of the main thread; testCompiler.error reports failures
+static struct RpnCompiler testCompiler;
+
+// Compile an expression for the audio output
+static uint16_t compileExpression(const char* expression, struct RpnProgram* program) {
+    initRPNCompiler(&testCompiler, RPN_OUTPUT_MASK);
+    return compileRPN(expression, strlen(expression), program, &testCompiler);
+}
+
+// ============================================================================
+// Sharded Runner
+// ============================================================================
+
+// Every test range is split into shards that a pool of threads claims in
+// order. A worker stops its shard at the first mismatch and no new shards
+// are claimed afterwards; all shards below the failing one were claimed
+// earlier and still run to completion, so the reported mismatch is the
+// lowest t in the range.
+
+typedef struct {
+    uint32_t t;
+    uint32_t c_result;
+    uint32_t vm_result;
+    uint32_t fast_result;
+    uint8_t block_byte;
+    int jit_byte; // -1 without native code
+} Mismatch;
+
+typedef struct {
+    const TestCase* test;
+    const struct RpnProgram* program;
+    const struct RpnJit* jit;
+    uint32_t startT;
+    uint64_t samples;
+    bool sparse;        // check executeRPN/executeRPNVerified once per block only
+    bool verbose;
+    SHARED uint64_t nextShard;
+    SHARED bool stop;
+
+    // Merged results, guarded by lock
+#if TEST_THREADS_ENABLED
+    pthread_mutex_t lock;
+#endif
+    uint64_t checked;
+    bool failed;
+    uint64_t failOffset; // offset of mismatch from startT
+    Mismatch mismatch;
+} ShardJob;
+
+static uint32_t testThreadCount(void) {
+#if TEST_THREADS_ENABLED
+    const char* env = getenv("TEST_THREADS");
+    long n = env ? strtol(env, NULL, 0) : 0;
+#ifdef _SC_NPROCESSORS_ONLN
+    if (n <= 0) n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+#else
+    long n = 1;
+#endif
+    if (n <= 0) n = 1;
+    return n > MAX_TEST_THREADS ? MAX_TEST_THREADS : (uint32_t)n;
+}
+
+static double wallSeconds(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Check count samples at offset; returns false and fills m on a mismatch
+static bool checkShard(ShardJob* job, uint64_t offset, uint64_t count,
+                       uint64_t* checked, Mismatch* m) {
+    uint8_t block[TEST_BLOCK_SIZE];
+    uint8_t jitBlock[TEST_BLOCK_SIZE];
+    struct RpnCache cache;
+    resetRPNCache(&cache);
+
+    for (uint64_t i = 0; i < count; i += TEST_BLOCK_SIZE) {
+        uint32_t n = count - i < TEST_BLOCK_SIZE ? (uint32_t)(count - i) : TEST_BLOCK_SIZE;
+        uint32_t t0 = job->startT + (uint32_t)(offset + i); // wraps like the audio path
+        executeRPNBlockCached(t0, n, job->program, &cache, block);
+        if (job->jit->fn) job->jit->fn(t0, n, jitBlock);
+
+        for (uint32_t k = 0; k < n; k++) {
+            uint32_t t = t0 + k;
+            uint32_t c_result = job->test->c_function(t);
+            bool full = !job->sparse || k == 0;
+            uint32_t vm_result = full ? executeRPN(t, job->program) : 0;
+            uint32_t fast_result = full ? executeRPNVerified(t, job->program) : 0;
+
+            // Compare only the bottom 8 bits (audio output), except that both
+            // interpreters have to agree on the whole word
+            bool ok = (uint8_t)c_result == block[k];
+            if (job->jit->fn) ok = ok && (uint8_t)c_result == jitBlock[k];
+            if (full) {
+                ok = ok && (uint8_t)c_result == (uint8_t)vm_result && vm_result == fast_result;
+            }
+            if (!ok) {
+                m->t = t;
+                m->c_result = c_result;
+                m->vm_result = executeRPN(t, job->program);
+                m->fast_result = executeRPNVerified(t, job->program);
+                m->block_byte = block[k];
+                m->jit_byte = job->jit->fn ? jitBlock[k] : -1;
+                *checked = i + k + 1;
+                return false;
+            }
+        }
+    }
+
+    *checked = count;
+    return true;
+}
+
+static void* shardWorker(void* arg) {
+    ShardJob* job = arg;
+
+    while (!job->stop) {
+        uint64_t offset = job->nextShard++ * TEST_SHARD_SIZE;
+        if (offset >= job->samples) break;
+        uint64_t count = job->samples - offset;
+        if (count > TEST_SHARD_SIZE) count = TEST_SHARD_SIZE;
+
+        uint64_t checked;
+        Mismatch m;
+        bool ok = checkShard(job, offset, count, &checked, &m);
+
+#if TEST_THREADS_ENABLED
+        pthread_mutex_lock(&job->lock);
+#endif
+        job->checked += checked;
+        if (!ok) {
+            uint64_t failOffset = offset + checked - 1;
+            if (job->verbose) {
+                printf("  shard at t=%u: first DIFF at t=%u\n", job->startT + (uint32_t)offset, m.t);
+            }
+            if (!job->failed || failOffset < job->failOffset) {
+                job->failed = true;
+                job->failOffset = failOffset;
+                job->mismatch = m;
+            }
+            job->stop = true;
+        }
+#if TEST_THREADS_ENABLED
+        pthread_mutex_unlock(&job->lock);
+#endif
+    }
+    return NULL;
+}
+
+// Check samples consecutive t values from startT (wrapping past 2^32 - 1)
+static bool testRange(const TestCase* test, const struct RpnProgram* program,
+                      const struct RpnJit* jit, uint32_t startT, uint64_t samples,
+                      bool sparse, bool verbose) {
+    ShardJob job = {
+        .test = test,
+        .program = program,
+        .jit = jit,
+        .startT = startT,
+        .samples = samples,
+        .sparse = sparse,
+        .verbose = verbose,
+    };
+    uint32_t started = 0;
+    double start = wallSeconds();
+
+#if TEST_THREADS_ENABLED
+    uint32_t threads = testThreadCount();
+    pthread_t workers[MAX_TEST_THREADS];
+    pthread_mutex_init(&job.lock, NULL);
+    while (started < threads && pthread_create(&workers[started], NULL, shardWorker, &job) == 0) {
+        started++;
+    }
+#endif
+    if (started == 0) shardWorker(&job);
+#if TEST_THREADS_ENABLED
+    for (uint32_t i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_mutex_destroy(&job.lock);
+#endif
+
+    double elapsed = wallSeconds() - start;
+
+    if (job.failed) {
+        const Mismatch* m = &job.mismatch;
+        printf("FAILED: first difference at t=%u (0x%08X), %llu samples checked\n",
+               m->t, m->t, (unsigned long long)job.checked);
+        printf("  DIFF at t=%u: C=0x%08X (%u) VM=0x%08X (%u) FAST=0x%08X [byte: C=%u VM=%u BLOCK=%u",
+               m->t, m->c_result, m->c_result & 0xFF, m->vm_result, m->vm_result & 0xFF,
+               m->fast_result, m->c_result & 0xFF, m->vm_result & 0xFF, m->block_byte);
+        if (m->jit_byte >= 0) printf(" JIT=%d", m->jit_byte);
+        printf("]\n");
+        return false;
+    }
+
+    printf("PASSED: All %llu samples from t=%u match! (%.2f s, %u threads%s)\n",
+           (unsigned long long)samples, startT, elapsed, started ? started : 1,
+           sparse ? ", interpreters checked once per block" : "");
+    return true;
+}
+
+// Run a single test case: the requested range, then the samples around the
+// 32-bit t wrap unless the range already covers all of t
+static bool runTestCase(TestCase* test, uint32_t startT, uint64_t samples, bool verbose) {
     printf("\n=== Testing: %s ===\n", test->name);
     printf("Expression: %s\n", test->expression);
 
     // Compile expression to RPN
-    strncpy(textBuffer, test->expression, TEXT_BUFFER_SIZE - 1);
-    textBuffer[TEXT_BUFFER_SIZE - 1] = '\0';
-    text_len = strlen(textBuffer);
+    struct RpnProgram program;
+    uint16_t program_len = compileExpression(test->expression, &program);
 
-    struct RpnInstruction program[RPN_PROGRAM_SIZE];
-    uint8_t program_len = compileToRPN(program);
-
-    if (compileError != ERR_NONE) {
-        printf("COMPILE ERROR: %d\n", compileError);
+    if (testCompiler.error != ERR_NONE) {
+        printf("COMPILE ERROR: %d\n", testCompiler.error);
         return false;
     }
 
-    printf("Compiled to %d RPN instructions\n", program_len);
+    // The native code is checked alongside the interpreters when there is a
+    // backend for this host
+    static struct RpnJit jit;
+    bool native = jitCompileRPN(&program, &jit);
+    printf("Compiled to %d bytes, %d constants%s\n", program_len, program.poolSize,
+           native ? ", native code" : "");
+    if (RPN_JIT != RPN_JIT_NONE && !native) {
+        printf("JIT ERROR: no native code for a verified program\n");
+        return false;
+    }
 
-    // Test sample by sample
-    uint32_t firstDiffT = 0;
-    uint32_t diffCount = 0;
-    bool hasDifferences = false;
+    bool sweep = samples >= FULL_T_RANGE;
+    if (sweep) return testRange(test, &program, &jit, 0, FULL_T_RANGE, true, verbose);
 
-    for (uint32_t t = startT; t < startT + samples; t++) {
-        uint32_t c_result = test->c_function(t);
-        uint32_t vm_result = executeRPN(t, program, program_len);
+    return testRange(test, &program, &jit, startT, samples, false, verbose) &&
+           testRange(test, &program, &jit, (uint32_t)-TEST_WRAP_WINDOW, 2 * TEST_WRAP_WINDOW,
+                     false, verbose);
+}
 
-        // Compare only the bottom 8 bits (audio output)
-        uint8_t c_byte = (uint8_t)(c_result & 0xFF);
-        uint8_t vm_byte = (uint8_t)(vm_result & 0xFF);
+// Compare a range of the block renderer with the build-time C of a factory
+// preset; returns false at the first difference
+static bool checkNativeRange(const struct NativePreset* preset, const struct RpnProgram* program,
+                             uint32_t startT, uint64_t samples) {
+    uint8_t expected[TEST_BLOCK_SIZE];
+    uint8_t native[TEST_BLOCK_SIZE];
 
-        if (c_byte != vm_byte) {
-            if (!hasDifferences) {
-                firstDiffT = t;
-                hasDifferences = true;
-            }
-            diffCount++;
+    for (uint64_t i = 0; i < samples; i += TEST_BLOCK_SIZE) {
+        uint32_t n = samples - i < TEST_BLOCK_SIZE ? (uint32_t)(samples - i) : TEST_BLOCK_SIZE;
+        uint32_t t0 = startT + (uint32_t)i;
+        executeRPNBlock(t0, n, program, expected);
+        preset->render(t0, n, native);
 
-            if (verbose && diffCount <= 10) {
-                printf("  DIFF at t=%u: C=0x%08X (%u) VM=0x%08X (%u) [byte: C=%u VM=%u]\n",
-                       t, c_result, c_byte, vm_result, vm_byte, c_byte, vm_byte);
+        for (uint32_t k = 0; k < n; k++) {
+            if (expected[k] != native[k]) {
+                printf("FAILED: first difference at t=%u: BLOCK=%u NATIVE=%u\n",
+                       t0 + k, expected[k], native[k]);
+                return false;
             }
         }
     }
+    return true;
+}
 
-    if (hasDifferences) {
-        printf("FAILED: %u/%u samples differ (%.2f%%)\n",
-               diffCount, samples, 100.0f * diffCount / samples);
-        printf("First difference at t=%u\n", firstDiffT);
+// Check the generated C of a factory preset: the preset must still compile
+// to the bytecode it was generated from, and render the same samples
+static bool runNativePresetTest(const struct NativePreset* preset, uint32_t startT,
+                                uint64_t samples) {
+    printf("\n=== Testing: native P%d ===\n", preset->slot + 1);
+    printf("Expression: %s\n", factoryPresets[preset->slot]);
+
+    struct RpnProgram program;
+    compileExpression(factoryPresets[preset->slot], &program);
+    if (testCompiler.error != ERR_NONE || findNativePreset(&program) != preset) {
+        printf("FAILED: the preset no longer compiles to its generated bytecode\n");
         return false;
-    } else {
-        printf("PASSED: All %u samples match!\n", samples);
-        return true;
     }
+
+    double start = wallSeconds();
+    bool sweep = samples >= FULL_T_RANGE;
+    bool ok = sweep ? checkNativeRange(preset, &program, 0, FULL_T_RANGE)
+                    : checkNativeRange(preset, &program, startT, samples) &&
+                      checkNativeRange(preset, &program, (uint32_t)-TEST_WRAP_WINDOW,
+                                       2 * TEST_WRAP_WINDOW);
+    if (ok) printf("PASSED: native code matches (%.2f s)\n", wallSeconds() - start);
+    return ok;
 }
 
-// Run all tests
-void runAllTests(uint32_t startT, uint32_t samples, bool verbose) {
+// Rejected expressions with the error and offset parseExpression() reports
+typedef struct {
+    const char* expression;
+    enum CompileError error;
+    uint16_t position;
+} ParseErrorCase;
+
+static const ParseErrorCase parseErrorCases[] = {
+    {"",          ERR_TOKEN, 0},
+    {"t*",        ERR_TOKEN, 2},
+    {"t t",       ERR_TOKEN, 2},
+    {"t+(t*2",    ERR_PAREN, 6},
+    {"(t+)",      ERR_PAREN, 3},
+    {"t)",        ERR_TOKEN, 1},
+    {"t>>0x",     ERR_TOKEN, 5},
+    {"t&0b2",     ERR_TOKEN, 4},
+    {"t!=1",      ERR_TOKEN, 1},
+};
+
+#define NUM_PARSE_ERROR_CASES (sizeof(parseErrorCases) / sizeof(ParseErrorCase))
+
+static bool runParseErrorTest(void) {
+    static struct RpnIr ir;
+    bool ok = true;
+
+    printf("\n=== Testing: parse errors ===\n");
+    for (size_t i = 0; i < NUM_PARSE_ERROR_CASES; i++) {
+        const ParseErrorCase* c = &parseErrorCases[i];
+        uint16_t position = 0;
+        enum CompileError error =
+            parseExpression(c->expression, strlen(c->expression), &ir, &position);
+        if (error != c->error || position != c->position) {
+            printf("FAILED: \"%s\" gives error %d at %u, expected %d at %u\n",
+                   c->expression, error, position, c->error, c->position);
+            ok = false;
+        }
+    }
+    if (ok) printf("PASSED: %u expressions rejected at the right offset\n",
+                   (unsigned)NUM_PARSE_ERROR_CASES);
+    return ok;
+}
+
+#define BATCH_COPIES 64 // every expression is compiled this many times at once
+
+// Compile the test expressions, factory presets and rejected expressions on
+// all threads at once and compare with compiling them one by one
+static bool runBatchCompileTest(void) {
+    enum { UNIQUE = NUM_TEST_CASES + PRESET_COUNT + NUM_PARSE_ERROR_CASES };
+    static const char* texts[UNIQUE * BATCH_COPIES];
+    static struct RpnProgram programs[UNIQUE * BATCH_COPIES];
+    static struct RpnCompileResult results[UNIQUE * BATCH_COPIES];
+    uint32_t count = 0;
+
+    printf("\n=== Testing: batch compile ===\n");
+    for (int copy = 0; copy < BATCH_COPIES; copy++) {
+        for (size_t i = 0; i < NUM_TEST_CASES; i++) texts[count++] = testCases[i].expression;
+        for (int i = 0; i < PRESET_COUNT; i++) texts[count++] = factoryPresets[i];
+        for (size_t i = 0; i < NUM_PARSE_ERROR_CASES; i++) {
+            texts[count++] = parseErrorCases[i].expression;
+        }
+    }
+
+    double start = wallSeconds();
+    compileRPNBatch(texts, count, RPN_OUTPUT_MASK, programs, results, testThreadCount());
+    double elapsed = wallSeconds() - start;
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct RpnProgram expected;
+        uint16_t length = compileExpression(texts[i], &expected);
+        const struct RpnProgram* got = &programs[i];
+        if (results[i].length != length || results[i].error != testCompiler.error ||
+            results[i].errorPos != testCompiler.errorPos ||
+            results[i].rawLength != testCompiler.rawLength ||
+            got->length != expected.length || got->poolSize != expected.poolSize ||
+            memcmp(got->code, expected.code, expected.length) != 0 ||
+            memcmp(got->pool, expected.pool, expected.poolSize * sizeof(uint32_t)) != 0) {
+            printf("FAILED: \"%s\" compiles differently in the batch\n", texts[i]);
+            return false;
+        }
+    }
+    printf("PASSED: %u expressions match (%.3f s, %u threads)\n", count, elapsed,
+           testThreadCount());
+    return true;
+}
+
+// Run all tests; true if every test passed
+bool runAllTests(uint32_t startT, uint64_t samples, bool verbose) {
     printf("\n");
     printf("=====================================\n");
     printf("  RPN VM Unit Tests\n");
     printf("=====================================\n");
-    printf("Testing %u samples starting from t=%u\n", samples, startT);
-    printf("Number of test cases: %d\n", (int)NUM_TEST_CASES);
+    if (samples >= FULL_T_RANGE) {
+        printf("Testing every t in 0..2^32-1\n");
+    } else {
+        printf("Testing %llu samples starting from t=%u, and %u samples around the t wrap\n",
+               (unsigned long long)samples, startT, 2 * TEST_WRAP_WINDOW);
+    }
+    int total = (int)NUM_TEST_CASES + nativePresetCount + 2;
+    printf("Number of test cases: %d (%d native presets), threads: %u\n", total,
+           nativePresetCount, testThreadCount());
 
     int passed = 0;
     int failed = 0;
+    double start = wallSeconds();
 
     for (int i = 0; i < (int)NUM_TEST_CASES; i++) {
         if (runTestCase(&testCases[i], startT, samples, verbose)) {
@@ -179,13 +621,31 @@ void runAllTests(uint32_t startT, uint32_t samples, bool verbose) {
             failed++;
         }
     }
+    for (int i = 0; i < nativePresetCount; i++) {
+        if (runNativePresetTest(&nativePresets[i], startT, samples)) {
+            passed++;
+        } else {
+            failed++;
+        }
+    }
+    if (runParseErrorTest()) {
+        passed++;
+    } else {
+        failed++;
+    }
+    if (runBatchCompileTest()) {
+        passed++;
+    } else {
+        failed++;
+    }
 
     printf("\n");
     printf("=====================================\n");
     printf("  Test Summary\n");
     printf("=====================================\n");
-    printf("Passed: %d/%d\n", passed, (int)NUM_TEST_CASES);
-    printf("Failed: %d/%d\n", failed, (int)NUM_TEST_CASES);
+    printf("Passed: %d/%d\n", passed, total);
+    printf("Failed: %d/%d\n", failed, total);
+    printf("Time: %.2f s\n", wallSeconds() - start);
 
     if (failed == 0) {
         printf("\nALL TESTS PASSED!\n");
@@ -193,10 +653,11 @@ void runAllTests(uint32_t startT, uint32_t samples, bool verbose) {
         printf("\nSOME TESTS FAILED!\n");
     }
     printf("=====================================\n\n");
+    return failed == 0;
 }
 
 // Run a specific test by index
-void runSingleTest(int testIndex, uint32_t startT, uint32_t samples, bool verbose) {
+void runSingleTest(int testIndex, uint32_t startT, uint64_t samples, bool verbose) {
     if (testIndex < 0 || testIndex >= (int)NUM_TEST_CASES) {
         printf("Invalid test index: %d (valid range: 0-%d)\n", testIndex, (int)NUM_TEST_CASES - 1);
         return;
@@ -205,6 +666,305 @@ void runSingleTest(int testIndex, uint32_t startT, uint32_t samples, bool verbos
     runTestCase(&testCases[testIndex], startT, samples, verbose);
 }
 
+// ============================================================================
+// Benchmarks
+// ============================================================================
+
+#define BENCH_DEFAULT_SAMPLES 1000000
+#define BENCH_DEFAULT_REPS 5
+#define BENCH_OPCODE_REPEAT 16 // measured instructions per opcode program
+
+typedef enum {
+    BENCH_CHECKED,
+    BENCH_VERIFIED,
+    BENCH_BLOCK,
+    BENCH_JIT,
+    BENCH_PATH_COUNT
+} BenchPath;
+
+static const char* const benchPathNames[BENCH_PATH_COUNT] = {
+    "executeRPN", "executeRPNVerified", "executeRPNBlock", "executeRPNBlockJit"
+};
+
+typedef struct {
+    double mean;   // ns/sample
+    double stddev;
+} BenchStat;
+
+// One opcode program: PUSH_T, STORE 0, then BENCH_OPCODE_REPEAT times the
+// optional operand push followed by the opcode. Binary opcodes can only be
+// timed together with the push of their second operand.
+typedef struct {
+    const char* name;
+    uint8_t operand;      // RPN_OPCODE_COUNT for none
+    uint32_t operandValue;
+    uint8_t opcode;
+    uint32_t value;
+} BenchOpcode;
+
+static BenchOpcode benchOpcodes[] = {
+    {"NOT",             RPN_OPCODE_COUNT, 0,          RPN_NOT,   0},
+    {"NEG",             RPN_OPCODE_COUNT, 0,          RPN_NEG,   0},
+    {"STORE",           RPN_OPCODE_COUNT, 0,          RPN_STORE, 0},
+    {"PUSH_T + XOR",    RPN_PUSH_T,       0,          RPN_XOR,   0},
+    {"PUSH_NUM + XOR",  RPN_PUSH_NUM,     3,          RPN_XOR,   0},
+    {"PUSH_CONST + XOR", RPN_PUSH_NUM,    0x12345678, RPN_XOR,   0},
+    {"DUP + XOR",       RPN_DUP,          0,          RPN_XOR,   0},
+    {"LOAD + XOR",      RPN_LOAD,         0,          RPN_XOR,   0},
+    {"PUSH_NUM + ADD",  RPN_PUSH_NUM,     3,          RPN_ADD,   0},
+    {"PUSH_NUM + SUB",  RPN_PUSH_NUM,     3,          RPN_SUB,   0},
+    {"PUSH_NUM + MUL",  RPN_PUSH_NUM,     3,          RPN_MUL,   0},
+    {"PUSH_NUM + DIV",  RPN_PUSH_NUM,     3,          RPN_DIV,   0},
+    {"PUSH_NUM + MOD",  RPN_PUSH_NUM,     3,          RPN_MOD,   0},
+    {"PUSH_CONST + DIVC", RPN_PUSH_NUM,   0,          RPN_DIVC,  0}, // filled in by benchOpcodeProgram
+    {"PUSH_CONST + MODC", RPN_PUSH_NUM,   0,          RPN_MODC,  0},
+    {"PUSH_NUM + AND",  RPN_PUSH_NUM,     3,          RPN_AND,   0},
+    {"PUSH_NUM + OR",   RPN_PUSH_NUM,     3,          RPN_OR,    0},
+    {"PUSH_NUM + SHL",  RPN_PUSH_NUM,     3,          RPN_SHL,   0},
+    {"PUSH_NUM + SHR",  RPN_PUSH_NUM,     3,          RPN_SHR,   0},
+    {"PUSH_NUM + LT",   RPN_PUSH_NUM,     3,          RPN_LT,    0},
+    {"PUSH_NUM + GT",   RPN_PUSH_NUM,     3,          RPN_GT,    0},
+    {"PUSH_NUM + EQ",   RPN_PUSH_NUM,     3,          RPN_EQ,    0},
+    {"PUSH_NUM + LE",   RPN_PUSH_NUM,     3,          RPN_LE,    0},
+    {"PUSH_NUM + GE",   RPN_PUSH_NUM,     3,          RPN_GE,    0},
+    {"PUSH_NUM + NE",   RPN_PUSH_NUM,     3,          RPN_NE,    0},
+};
+
+#define NUM_BENCH_OPCODES (sizeof(benchOpcodes) / sizeof(BenchOpcode))
+
+// ns/sample of one pass over t = 0 .. samples-1
+static double benchPass(BenchPath path, const struct RpnProgram* program,
+                        const struct RpnJit* jit, uint32_t samples) {
+    uint32_t sink = 0;
+    clock_t start = clock();
+
+    switch (path) {
+        case BENCH_CHECKED:
+            for (uint32_t t = 0; t < samples; t++) sink += executeRPN(t, program);
+            break;
+        case BENCH_VERIFIED:
+            for (uint32_t t = 0; t < samples; t++) sink += executeRPNVerified(t, program);
+            break;
+        case BENCH_BLOCK: {
+            uint8_t block[TEST_BLOCK_SIZE];
+            struct RpnCache cache;
+            resetRPNCache(&cache);
+            for (uint32_t t = 0; t < samples; t += TEST_BLOCK_SIZE) {
+                uint32_t n = samples - t < TEST_BLOCK_SIZE ? samples - t : TEST_BLOCK_SIZE;
+                executeRPNBlockCached(t, n, program, &cache, block);
+                sink += block[0];
+            }
+            break;
+        }
+        case BENCH_JIT: {
+            uint8_t block[TEST_BLOCK_SIZE];
+            struct RpnCache cache;
+            resetRPNCache(&cache);
+            for (uint32_t t = 0; t < samples; t += TEST_BLOCK_SIZE) {
+                uint32_t n = samples - t < TEST_BLOCK_SIZE ? samples - t : TEST_BLOCK_SIZE;
+                executeRPNBlockJit(t, n, program, jit, &cache, block);
+                sink += block[0];
+            }
+            break;
+        }
+        default:
+            break;
+    }
+
+    double ns = (double)(clock() - start) * 1e9 / CLOCKS_PER_SEC / samples;
+    benchSink = sink;
+    return ns;
+}
+
+// Warm up, then time reps passes
+static BenchStat benchMeasure(BenchPath path, const struct RpnProgram* program,
+                              uint32_t samples, uint32_t reps) {
+    // Falls back to the interpreter like the audio path if the JIT fails
+    static struct RpnJit jit;
+    if (path == BENCH_JIT) jitCompileRPN(program, &jit);
+
+    benchPass(path, program, &jit, samples / 4 + 1);
+
+    // Welford's running mean and variance
+    double mean = 0, m2 = 0;
+    for (uint32_t r = 1; r <= reps; r++) {
+        double ns = benchPass(path, program, &jit, samples);
+        double delta = ns - mean;
+        mean += delta / r;
+        m2 += delta * (ns - mean);
+    }
+
+    BenchStat stat = {mean, reps > 1 ? sqrt(m2 / (reps - 1)) : 0};
+    return stat;
+}
+
+static bool benchOpcodeProgram(const BenchOpcode* op, bool withOpcode, struct RpnProgram* program) {
+    struct RpnInstruction ir[2 + 2 * BENCH_OPCODE_REPEAT];
+    uint8_t len = 0;
+    uint32_t operandValue = op->operandValue;
+    uint32_t value = op->value;
+
+    // Take the divide-by-7 magic from the optimizer instead of duplicating it
+    if (op->opcode == RPN_DIVC || op->opcode == RPN_MODC) {
+        struct RpnInstruction div[3] = {
+            {RPN_PUSH_T, 0}, {RPN_PUSH_NUM, 7}, {op->opcode == RPN_DIVC ? RPN_DIV : RPN_MOD, 0}
+        };
+        if (optimizeRPN(div, 3, 3, 0xFFFFFFFF) != 3 || div[2].opcode != op->opcode) return false;
+        operandValue = div[1].value;
+        value = div[2].value;
+    }
+
+    ir[len++] = (struct RpnInstruction){RPN_PUSH_T, 0};
+    ir[len++] = (struct RpnInstruction){RPN_STORE, 0};
+    for (int i = 0; withOpcode && i < BENCH_OPCODE_REPEAT; i++) {
+        if (op->operand != RPN_OPCODE_COUNT) {
+            ir[len++] = (struct RpnInstruction){op->operand, operandValue};
+        }
+        ir[len++] = (struct RpnInstruction){op->opcode, value};
+    }
+
+    uint8_t depth;
+    return encodeRPN(ir, len, program) && verifyRPN(program, &depth) && depth <= RPN_STACK_SIZE;
+}
+
+static void jsonString(FILE* f, const char* s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fputc('\\', f);
+        fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+static void jsonStats(FILE* f, const BenchStat* stats) {
+    fprintf(f, "{");
+    for (int p = 0; p < BENCH_PATH_COUNT; p++) {
+        fprintf(f, "%s\"%s\": {\"mean_ns\": %.4f, \"stddev_ns\": %.4f, \"samples_per_sec\": %.0f}",
+                p ? ", " : "", benchPathNames[p], stats[p].mean, stats[p].stddev,
+                stats[p].mean > 0 ? 1e9 / stats[p].mean : 0.0);
+    }
+    fprintf(f, "}");
+}
+
+// Benchmark one expression on every execution path; returns false if it
+// does not compile
+static bool benchExpression(const char* label, const char* expression, uint32_t samples,
+                            uint32_t reps, FILE* json, bool* firstJson) {
+    struct RpnProgram program;
+    uint16_t program_len = compileExpression(expression, &program);
+    if (testCompiler.error != ERR_NONE) {
+        printf("  %-6s COMPILE ERROR %d: %s\n", label, testCompiler.error, expression);
+        return false;
+    }
+
+    BenchStat stats[BENCH_PATH_COUNT];
+    printf("  %-6s %3d B", label, program_len);
+    for (int p = 0; p < BENCH_PATH_COUNT; p++) {
+        stats[p] = benchMeasure((BenchPath)p, &program, samples, reps);
+        printf("  %7.2f ±%5.2f ns %7.1fM/s", stats[p].mean, stats[p].stddev,
+               stats[p].mean > 0 ? 1e3 / stats[p].mean : 0.0);
+    }
+    printf("  %s\n", expression);
+
+    if (json) {
+        fprintf(json, "%s\n    {\"label\": ", *firstJson ? "" : ",");
+        jsonString(json, label);
+        fprintf(json, ", \"expression\": ");
+        jsonString(json, expression);
+        fprintf(json, ", \"bytes\": %d, \"constants\": %d, \"paths\": ", program_len, program.poolSize);
+        jsonStats(json, stats);
+        fprintf(json, "}");
+        *firstJson = false;
+    }
+    return true;
+}
+
+// Time every test case and factory preset on each execution path, then the
+// cost of each opcode. With jsonPath the results are also written as JSON.
+void benchAllTests(uint32_t samples, uint32_t reps, const char* jsonPath) {
+    if (samples == 0) samples = BENCH_DEFAULT_SAMPLES;
+    if (reps == 0) reps = BENCH_DEFAULT_REPS;
+
+    FILE* json = NULL;
+    if (jsonPath) {
+        json = fopen(jsonPath, "w");
+        if (!json) {
+            perror(jsonPath);
+            return;
+        }
+        fprintf(json, "{\n  \"dispatch\": \"%s\",\n  \"samples\": %lu,\n  \"repetitions\": %lu,\n"
+                      "  \"block_size\": %d,\n  \"expressions\": [",
+                RPN_DISPATCH_THREADED ? "threaded" : "switch", (unsigned long)samples,
+                (unsigned long)reps, TEST_BLOCK_SIZE);
+    }
+    bool firstJson = true;
+
+    printf("\n=== RPN VM benchmark (%s dispatch, %lu samples x %lu reps, mean ±stddev) ===\n",
+           RPN_DISPATCH_THREADED ? "threaded" : "switch", (unsigned long)samples, (unsigned long)reps);
+    printf("  %-6s %5s", "", "size");
+    for (int p = 0; p < BENCH_PATH_COUNT; p++) printf("  %-28s", benchPathNames[p]);
+    printf("\n");
+
+    for (int i = 0; i < (int)NUM_TEST_CASES; i++) {
+        char label[8];
+        snprintf(label, sizeof(label), "[%d]", i);
+        benchExpression(label, testCases[i].expression, samples, reps, json, &firstJson);
+    }
+    for (int i = 0; i < PRESET_COUNT; i++) {
+        if (!factoryPresets[i][0]) continue;
+        char label[8];
+        snprintf(label, sizeof(label), "P%d", i + 1);
+        benchExpression(label, factoryPresets[i], samples, reps, json, &firstJson);
+    }
+
+    // Marginal cost per opcode: the program minus its PUSH_T, STORE prefix,
+    // divided by the number of repeats
+    printf("\n  Per-opcode cost (ns, %d repeats per program)\n", BENCH_OPCODE_REPEAT);
+    printf("  %-20s", "");
+    for (int p = 0; p < BENCH_PATH_COUNT; p++) printf("  %18s", benchPathNames[p]);
+    printf("\n");
+    if (json) fprintf(json, "\n  ],\n  \"opcodes\": [");
+    firstJson = true;
+
+    struct RpnProgram base;
+    BenchStat baseStats[BENCH_PATH_COUNT];
+    benchOpcodeProgram(&benchOpcodes[0], false, &base);
+    for (int p = 0; p < BENCH_PATH_COUNT; p++) {
+        baseStats[p] = benchMeasure((BenchPath)p, &base, samples, reps);
+    }
+
+    for (int i = 0; i < (int)NUM_BENCH_OPCODES; i++) {
+        struct RpnProgram program;
+        if (!benchOpcodeProgram(&benchOpcodes[i], true, &program)) continue;
+
+        BenchStat stats[BENCH_PATH_COUNT];
+        printf("  %-20s", benchOpcodes[i].name);
+        for (int p = 0; p < BENCH_PATH_COUNT; p++) {
+            stats[p] = benchMeasure((BenchPath)p, &program, samples, reps);
+            stats[p].mean = (stats[p].mean - baseStats[p].mean) / BENCH_OPCODE_REPEAT;
+            stats[p].stddev /= BENCH_OPCODE_REPEAT;
+            printf("  %9.3f ±%6.3f", stats[p].mean, stats[p].stddev);
+        }
+        printf("\n");
+
+        if (json) {
+            fprintf(json, "%s\n    {\"opcode\": ", firstJson ? "" : ",");
+            jsonString(json, benchOpcodes[i].name);
+            fprintf(json, ", \"paths\": ");
+            jsonStats(json, stats);
+            fprintf(json, "}");
+            firstJson = false;
+        }
+    }
+    printf("\n");
+
+    if (json) {
+        fprintf(json, "\n  ]\n}\n");
+        fclose(json);
+        printf("Results written to %s\n\n", jsonPath);
+    }
+}
+
 // List all available tests
 void listTests(void) {
     printf("\nAvailable test cases:\n");
@@ -218,6 +978,12 @@ void listTests(void) {
 // Main Entry Point
 // ============================================================================
 
+// Sample count argument: a number, or "full" for every 32-bit t
+static uint64_t parseSamples(const char* arg) {
+    if (strcmp(arg, "full") == 0) return FULL_T_RANGE;
+    return strtoull(arg, NULL, 0);
+}
+
 int main(int argc, char* argv[]) {
     printf("RPN VM Standalone Test Runner\n");
     printf("Testing REAL rpn_vm.c implementation\n");
@@ -228,11 +994,19 @@ int main(int argc, char* argv[]) {
             listTests();
             return 0;
         } else if (strcmp(argv[1], "all") == 0) {
-            uint32_t samples = DEFAULT_NUM_SAMPLES_TO_TEST;
+            uint64_t samples = DEFAULT_NUM_SAMPLES_TO_TEST;
             bool verbose = false;
-            if (argc > 2) samples = atoi(argv[2]);
+            if (argc > 2) samples = parseSamples(argv[2]);
             if (argc > 3 && strcmp(argv[3], "verbose") == 0) verbose = true;
-            runAllTests(0, samples, verbose);
+            return runAllTests(0, samples, verbose) ? 0 : 1;
+        } else if (strcmp(argv[1], "bench") == 0) {
+            uint32_t samples = 0;
+            uint32_t reps = 0;
+            const char* jsonPath = NULL;
+            if (argc > 2) samples = atoi(argv[2]);
+            if (argc > 3) reps = atoi(argv[3]);
+            if (argc > 4) jsonPath = argv[4];
+            benchAllTests(samples, reps, jsonPath);
             return 0;
         } else if (strcmp(argv[1], "test") == 0) {
             if (argc < 3) {
@@ -240,9 +1014,9 @@ int main(int argc, char* argv[]) {
                 return 1;
             }
             int testIndex = atoi(argv[2]);
-            uint32_t samples = DEFAULT_NUM_SAMPLES_TO_TEST;
+            uint64_t samples = DEFAULT_NUM_SAMPLES_TO_TEST;
             bool verbose = true;
-            if (argc > 3) samples = atoi(argv[3]);
+            if (argc > 3) samples = parseSamples(argv[3]);
             if (argc > 4 && strcmp(argv[4], "verbose") == 0) verbose = true;
             runSingleTest(testIndex, 0, samples, verbose);
             return 0;
@@ -252,11 +1026,11 @@ int main(int argc, char* argv[]) {
     // Default: show usage and run tests
     printf("Usage:\n");
     printf("  %s list              - List all test cases\n", argv[0]);
-    printf("  %s all [samples]     - Run all tests (default 10000 samples)\n", argv[0]);
-    printf("  %s test <N> [samples] - Run test case N\n\n", argv[0]);
-
-    printf("Running default test suite (10000 samples each)...\n");
-    runAllTests(0, DEFAULT_NUM_SAMPLES_TO_TEST, false);
+    printf("  %s all [samples]     - Run all tests (default 10000000 samples)\n", argv[0]);
+    printf("  %s test <N> [samples] - Run test case N\n", argv[0]);
+    printf("  samples may be \"full\" to check every 32-bit t; TEST_THREADS sets the thread count\n");
+    printf("  %s bench [samples] [reps] [json] - Benchmark test cases, presets and opcodes\n\n", argv[0]);
 
-    return 0;
+    printf("Running default test suite (10000000 samples each)...\n");
+    return runAllTests(0, DEFAULT_NUM_SAMPLES_TO_TEST, false) ? 0 : 1;
 }